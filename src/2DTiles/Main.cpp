@@ -103,5 +103,6 @@ int main(int argc, char* argv[])
 	callbacks.display = display;
 	callbacks.init = init;
 	GlewGlut::Params params; params.camera = &camera;
+	params.parseArguments(argc, argv);
 	GlewGlut::main(callbacks,params);
 }
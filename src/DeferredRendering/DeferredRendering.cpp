@@ -29,13 +29,17 @@ void reloadShader() {
 
 void display() {
 
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-	glBindRenderbuffer(GL_RENDERBUFFER, depthRbo);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	firstPassShader.use();
-	mesh.draw();
-	//mesh2.draw();
+	{
+		GlewGlut::PassTimers::Scope pass(GlewGlut::timers, "geometry");
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthRbo);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		firstPassShader.use();
+		mesh.draw();
+		//mesh2.draw();
+	}
 
+	GlewGlut::PassTimers::Scope pass(GlewGlut::timers, "ao shading");
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	secondPassShader.use();
@@ -91,7 +95,7 @@ void init() {
 	reshape();
 }
 
-int main() {
+int main(int argc, char* argv[]) {
 
 	GlewGlut::keys.insert({ 'r',{
 		"Reload the Shader",
@@ -104,5 +108,7 @@ int main() {
 	callbacks.display = display;
 	callbacks.init = init;
 	callbacks.reshape = reshape;
-	GlewGlut::main(callbacks);
+	GlewGlut::Params params;
+	params.parseArguments(argc, argv);
+	GlewGlut::main(callbacks, params);
 }
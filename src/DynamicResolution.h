@@ -0,0 +1,42 @@
+#pragma once
+
+// Feedback loop on the resolution of the ray marchers : the scene renders at a scale of the window, raised or
+// lowered after each frame so that its time meets a budget. A frame's cost goes with its pixels, the square of
+// the scale, so a frame of 'ms' at the scale 's' asks for s * sqrt( budget / ms ) ; the scale goes part of the
+// way there, and not at all within a dead band around the budget, which keeps it from oscillating.
+// The timings usually come a few frames late (GPU queries) : each one is given with the scale it was taken at.
+// No GL nor clock here, for the controller to be driven by simulated timings.
+
+#include <math.h>
+#include <algorithm>
+
+struct DynamicResolution {
+
+	float budgetMs = 14.f; // per frame, under the 16.7 ms of 60 Hz
+	float minScale = 0.25f, maxScale = 1.f; // of the window's size
+	float deadBand = 0.1f; // relative error of the frame time left alone
+	float gain = 0.5f; // part of the way to the scale asked for, per frame, in log scale
+	float maxStep = 1.25f; // largest factor of the scale per frame
+
+	float scale = 1.f; // while the camera moves
+	bool idle = false; // when set, the frames render at maxScale
+
+	// the scale of the next frame
+	inline float current() const { return idle ? maxScale : scale; }
+
+	// the next frame's size for a w x h window, at least a pixel
+	inline int size(int windowSize) const {
+		return std::max(1, int(windowSize * current() + 0.5f));
+	}
+
+	// takes the time of a frame rendered at 'renderedScale' into account
+	void update(float frameMs, float renderedScale) {
+
+		if (frameMs <= 0 || renderedScale <= 0) { return; }
+		const float ratio = budgetMs / frameMs;
+		if (fabsf(ratio - 1) < deadBand) { return; }
+		const float asked = renderedScale * sqrtf(ratio);
+		const float step = std::min(maxStep, std::max(1 / maxStep, powf(asked / scale, gain)));
+		scale = std::min(maxScale, std::max(minScale, scale * step));
+	}
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+// Sparse grid of lower bounds of the distance to the fractal, for one order. The estimator is sampled at the
+// nodes of a coarse grid around the set, and at the nodes of finer bricks in the coarse cells near its surface.
+// A node at distance 'd' of the surface is at least 'd - l' away from any point at 'l' of it, so the bound of a
+// point is the best of its cell's 8 corners : the marchers step by it in free space, and only call the estimator
+// once it falls under half a fine cell. The bounds are as conservative as the estimator itself.
+
+#include "Fractal.h"
+#include "Estimators.h"
+#include <Parallel.h>
+
+#include <array>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+struct DistanceCache {
+
+	struct Stats {
+		size_t bricks = 0, evaluations = 0; // of the distance estimator
+		double seconds = 0;
+
+		void print(std::ostream& out) const {
+			out << bricks << " bricks, " << evaluations << " distance evaluations in " << 1000 * seconds << " ms" << std::endl;
+		}
+	};
+
+	float order = 0;
+	int iterations = 0;
+	float extent = 2; // the grid covers [-extent;extent]^3, out of which points escape for orders of 2 and more
+	unsigned cells = 0, brickSize = 0; // coarse cells per axis, fine cells per brick and axis
+	float cellSize = 0, fineSize = 0;
+
+	std::vector<float> coarse; // estimated distances at the (cells+1)^3 coarse nodes, x first
+	std::vector<int> brickOf; // brick of each coarse cell, or -1
+	std::vector<float> fine; // estimated distances at the (brickSize+1)^3 nodes of each brick, x first
+	Stats stats;
+
+	// GL textures of the bounds, see upload() in Fractal3D's Main.cpp
+	unsigned coarseId = 0, indirectionId = 0, bricksId = 0;
+	unsigned slotsPerAxis = 0; // of the bricks' atlas
+
+	DistanceCache() {}
+	DistanceCache(float order, int iterations, unsigned cells = 16, unsigned brickSize = 8, unsigned threads = 0)
+		: order(order), iterations(iterations), cells(cells), brickSize(brickSize) {
+
+		auto start = std::chrono::steady_clock::now();
+		cellSize = 2 * extent / cells;
+		fineSize = cellSize / brickSize;
+
+		// the coarse nodes, a slice of nodes per task
+		const unsigned n = cells + 1;
+		coarse.resize(size_t(n) * n * n);
+		Parallel::forEach(n, [&](size_t k, unsigned) {
+			for (unsigned j = 0; j < n; j++)
+				for (unsigned i = 0; i < n; i++)
+					coarse[i + n * (j + n * k)] = estimate(node(i, j, unsigned(k), cellSize));
+		}, threads);
+		stats.evaluations = coarse.size();
+
+		// a brick for the cells whose corners' bounds could fall under half their diagonal
+		const float diagonal = cellSize * sqrtf(3.f);
+		brickOf.assign(size_t(cells) * cells * cells, -1);
+		std::vector<unsigned> refined;
+		for (unsigned k = 0; k < cells; k++)
+			for (unsigned j = 0; j < cells; j++)
+				for (unsigned i = 0; i < cells; i++) {
+					const std::array<float, 8> d = corners(coarse.data(), n, i, j, k);
+					if (*std::min_element(d.begin(), d.end()) < diagonal) {
+						brickOf[i + cells * (j + cells * k)] = int(refined.size());
+						refined.push_back(i + cells * (j + cells * k));
+					}
+				}
+
+		const unsigned m = brickSize + 1;
+		const size_t brickNodes = size_t(m) * m * m;
+		fine.resize(refined.size() * brickNodes);
+		Parallel::forEach(refined.size(), [&](size_t b, unsigned) {
+			const unsigned cell = refined[b];
+			const unsigned ci = cell % cells, cj = (cell / cells) % cells, ck = cell / (cells * cells);
+			float* dst = &fine[b * brickNodes];
+			for (unsigned k = 0; k < m; k++)
+				for (unsigned j = 0; j < m; j++)
+					for (unsigned i = 0; i < m; i++)
+						dst[i + m * (j + m * k)] = estimate(node(ci * brickSize + i, cj * brickSize + j, ck * brickSize + k, fineSize));
+		}, threads);
+
+		stats.bricks = refined.size();
+		stats.evaluations += fine.size();
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	inline bool empty() const { return coarse.empty(); }
+
+	// under this bound, the marchers call the estimator
+	inline float minStep() const { return 0.5f * fineSize; }
+
+	// lower bound of the distance from 'p' to the fractal
+	float bound(const Vec3& p) const {
+
+		// out of the grid, the distance to it
+		const Vec3 out = { fabsf(p.x) - extent, fabsf(p.y) - extent, fabsf(p.z) - extent };
+		if (out.x > 0 || out.y > 0 || out.z > 0) {
+			return Vec3{ std::max(out.x, 0.f), std::max(out.y, 0.f), std::max(out.z, 0.f) }.norm();
+		}
+
+		const Vec3 g = (p + Vec3{ extent, extent, extent }) / cellSize; // in coarse cells
+		const unsigned i = std::min(unsigned(g.x), cells - 1), j = std::min(unsigned(g.y), cells - 1), k = std::min(unsigned(g.z), cells - 1);
+		const Vec3 local = g - Vec3{ float(i), float(j), float(k) };
+		const int brick = brickOf[i + cells * (j + cells * k)];
+		if (brick < 0) { return cornersBound(corners(coarse.data(), cells + 1, i, j, k), local, cellSize); }
+
+		const unsigned m = brickSize + 1;
+		const Vec3 f = local * float(brickSize); // in fine cells
+		const unsigned fi = std::min(unsigned(f.x), brickSize - 1), fj = std::min(unsigned(f.y), brickSize - 1), fk = std::min(unsigned(f.z), brickSize - 1);
+		const float* nodes = &fine[size_t(brick) * m * m * m];
+		return cornersBound(corners(nodes, m, fi, fj, fk), f - Vec3{ float(fi), float(fj), float(fk) }, fineSize);
+	}
+
+	void upload();
+
+private:
+	inline float estimate(const Vec3& p) const {
+		return std::max(0.f, Estimators::dist(order, p, iterations));
+	}
+
+	inline Vec3 node(unsigned i, unsigned j, unsigned k, float size) const {
+		return Vec3{ i * size - extent, j * size - extent, k * size - extent };
+	}
+
+	// the 8 corners of the cell ( i, j, k ) of a grid of n^3 nodes, corner c being at ( c & 1, c >> 1 & 1, c >> 2 )
+	static inline std::array<float, 8> corners(const float* nodes, unsigned n, unsigned i, unsigned j, unsigned k) {
+		const float* p = nodes + i + n * (j + n * size_t(k));
+		const size_t dy = n, dz = size_t(n) * n;
+		return {{ p[0], p[1], p[dy], p[dy + 1], p[dz], p[dz + 1], p[dz + dy], p[dz + dy + 1] }};
+	}
+
+	// 'local' is the point's position in the cell, in [0;1]^3
+	static inline float cornersBound(const std::array<float, 8>& d, const Vec3& local, float size) {
+		float bound = 0;
+		for (int c = 0; c < 8; c++) {
+			const Vec3 offset = local - Vec3{ float(c & 1), float(c >> 1 & 1), float(c >> 2) };
+			bound = std::max(bound, d[c] - offset.norm() * size);
+		}
+		return bound;
+	}
+};
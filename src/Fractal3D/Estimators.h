@@ -0,0 +1,130 @@
+#pragma once
+
+// Trig-free distance estimators for the integer orders. With rho = |z.xy|, Nylander's power of z is
+// ( Re(B) Re(A), Re(B) Im(A), Im(B) ), A = ( ( z.x + i z.y ) / rho )^n and B = ( rho + i z.z )^n :
+// a few complex products instead of asin, atan2, pow, cos and sin. A is raised from the unit complex, as
+// ( z.x + i z.y )^n / rho^n would underflow to 0 / 0 close to the z axis for the high orders. The powers follow one chain, unrolled by
+// templates for the CPU and written out as GLSL by glsl(), so both sides compute the same products.
+
+#include "Fractal.h"
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <math.h>
+
+namespace Estimators {
+
+	const int maxOrder = 16; // of the specialized estimators
+
+	// the power chain : x^n is the square of x^(n/2) for an even n, else x^(n-1) times x
+	constexpr int previous(int n) { return n % 2 == 0 ? n / 2 : n - 1; }
+
+	struct Complex { float re, im; };
+
+	inline float mul(float a, float b) { return a * b; }
+	inline Complex mul(const Complex& a, const Complex& b) {
+		return { a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re };
+	}
+
+	template<int N> struct Power {
+		template<typename T> static inline T of(const T& x) {
+			const T p = Power<previous(N)>::of(x);
+			return mul(p, N % 2 == 0 ? p : x);
+		}
+	};
+	template<> struct Power<1> {
+		template<typename T> static inline T of(const T& x) { return x; }
+	};
+
+	// powN() of Fractal.h for the order N
+	template<int N> inline void powTriplex(Vec3& z, float zr0, float& dr) {
+
+		const float rho = sqrtf(z.x * z.x + z.y * z.y);
+		const Complex a = Power<N>::of(rho > 0 ? Complex{ z.x / rho, z.y / rho } : Complex{ 1, 0 }); // atan2(0, 0) is 0
+		const Complex b = Power<N>::of(Complex{ rho, z.z });
+
+		dr = Power<N - 1>::of(zr0) * dr * N + 1.0f;
+		z = Vec3{ b.re * a.re, b.re * a.im, b.im };
+	}
+
+	// fractalDist() of Fractal.h for the order N
+	template<int N> float dist(Vec3 c, int iterations) {
+
+		Vec3 z = c;
+		float dr = 1.0;
+		float r = z.norm();
+
+		for (int i = 0; i < iterations; i++) {
+
+			powTriplex<N>(z, r, dr);
+
+			z = z + c;
+
+			r = z.norm();
+
+			if (r > 2) { break; }
+		}
+		return 0.5f * logf(r) * r / dr;
+	}
+
+	typedef float (*Function)(Vec3 c, int iterations);
+
+	// 'order' when it is an integer of [2;maxOrder] (up to the drift of the 0.1 steps of 'o' and 'i'), else 0
+	inline int integerOrder(float order) {
+		const int n = int(lroundf(order));
+		return n >= 2 && n <= maxOrder && fabsf(order - n) < 1e-3f ? n : 0;
+	}
+
+	// the trig-free estimator of an integer order, NULL for the others
+	inline Function specialized(float order) {
+		static const Function functions[maxOrder + 1] = {
+			NULL, NULL, dist<2>, dist<3>, dist<4>, dist<5>, dist<6>, dist<7>, dist<8>,
+			dist<9>, dist<10>, dist<11>, dist<12>, dist<13>, dist<14>, dist<15>, dist<16>
+		};
+		return functions[integerOrder(order)];
+	}
+
+	// the trig-free estimator for the integer orders, fractalDist() for the others
+	inline float dist(float order, const Vec3& c, int iterations) {
+		const Function f = specialized(order);
+		return f ? f(c, iterations) : fractalDist(order, c, iterations);
+	}
+
+	// declares x^n as 'name + n', from the powers already declared in 'done'
+	inline void chain(std::ostream& out, const char* type, const char* name, int n, std::vector<bool>& done) {
+		if (done[n]) { return; }
+		const int p = previous(n);
+		chain(out, type, name, p, done);
+		const bool isFloat = std::string(type) == "float";
+		out << "\t" << type << " " << name << n << " = ";
+		if (isFloat) { out << name << p << " * " << name << (n % 2 == 0 ? p : 1) << ";\n"; }
+		else { out << "cmul(" << name << p << ", " << name << (n % 2 == 0 ? p : 1) << ");\n"; }
+		done[n] = true;
+	}
+
+	// GLSL of powOrder( p, z, zr0, dr ) (see frag.glsl) : powTriplex() written out for an integer order of
+	// [2;maxOrder], else powN() ; the programs are compiled once per integer order
+	inline std::string glsl(int order) {
+
+		std::ostringstream out;
+		out << "\n// generated by Estimators::glsl(" << order << ")\n";
+		if (order < 2 || order > maxOrder) {
+			out << "void powOrder(float p, inout vec3 z, float zr0, inout float dr) { powN(p, z, zr0, dr); }\n";
+			return out.str();
+		}
+		out << "vec2 cmul(vec2 a, vec2 b) { return vec2(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x); }\n\n"
+			"void powOrder(float p, inout vec3 z, float zr0, inout float dr)\n{\n"
+			"\tfloat rho = length(z.xy), r1 = zr0;\n"
+			"\tvec2 a1 = rho > 0.0 ? z.xy / rho : vec2(1.0, 0.0), b1 = vec2(rho, z.z);\n";
+		std::vector<bool> doneA(order + 1, false), doneB(order + 1, false), doneR(order + 1, false);
+		doneA[1] = doneB[1] = doneR[1] = true;
+		chain(out, "vec2", "a", order, doneA);
+		chain(out, "vec2", "b", order, doneB);
+		chain(out, "float", "r", order - 1, doneR);
+		out << "\tdr = r" << order - 1 << " * dr * " << order << ".0 + 1.0;\n"
+			"\tz = vec3(b" << order << ".x * a" << order << ", b" << order << ".y);\n"
+			"}\n";
+		return out.str();
+	}
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+// The Mandelbulb's distance estimator and the camera, shared by Fractal3D and the CPU FractalRenderer
+// (frag.glsl has its own copy of the estimator)
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <math.h>
+
+struct Vec3 {
+	float x, y, z;
+	float norm2() const {
+		return x*x + y*y + z*z;
+	}
+	float norm() const {
+		return sqrt(norm2());
+	}
+	float dot(const Vec3& v) const {
+		return x*v.x + y*v.y + z*v.z;
+	}
+	Vec3 operator/ (float v) const {
+		return{ x / v, y / v, z / v };
+	}
+	Vec3 operator* (float v) const {
+		return{ x * v, y * v, z * v };
+	}
+	Vec3 operator+(const Vec3& v) const {
+		return{
+			x + v.x,
+			y + v.y,
+			z + v.z
+		};
+	}
+	Vec3 operator-(const Vec3& v) const {
+		return{
+			x - v.x,
+			y - v.y,
+			z - v.z
+		};
+	}
+	Vec3 normalize() const {
+		return operator/(norm());
+	}
+	Vec3 cross(const Vec3& v) const {
+		return{
+			y*v.z - v.y*z,
+			z*v.x - v.z*x,
+			x*v.y - v.x*y
+		};
+	}
+	void operator>>(std::fstream& file) {
+		file << x << " " << y << " " << z << std::endl;
+	}
+	/*void operator<<(fstream& file) {
+		file >> x;
+		file >> y;
+		file >> z;
+	}*/
+};
+
+// Nylander's power formula
+inline void powN(float p, Vec3& z, float zr0, float& dr)
+{
+	float zo0 = asin(z.z / zr0);
+	float zi0 = atan2(z.y, z.x);
+	float zr = pow(zr0, p - 1.0);
+	float zo = zo0 * p;
+	float zi = zi0 * p;
+	float czo = cos(zo);
+
+	dr = zr * dr * p + 1.0;
+	zr *= zr0;
+
+	z = Vec3{ zr * czo * cos(zi), zr * czo * sin(zi), zr * sin(zo) };
+}
+
+// distance to fractal (frag.glsl stops after 16 iterations)
+inline float fractalDist(float power, Vec3 c, int iterations = 256) {
+
+	Vec3 z = c;
+	float dr = 1.0;
+	float r = z.norm();
+
+	for (int i = 0; i < iterations; i++) {
+
+		powN(power, z, r, dr);
+
+		z = z + c;
+
+		r = z.norm();
+
+		if (r > 2) { break; }
+	}
+	return 0.5 * log(r) * r / dr;
+}
+
+struct Camera {
+
+	Vec3 pos, dir, left, up;
+	Camera(Vec3 pos, Vec3 dir, Vec3 up = { 0,0,1 }) :
+		pos(pos), dir(dir), up(up) {
+		left = dir.cross(up).normalize();
+	}
+	void vertRot(float v) {
+		dir = (dir + up * v).normalize();
+		up = left.cross(dir).normalize();
+	}
+	void horzRot(float v) { // HACK
+		dir = (dir + left * (-v)).normalize();
+		left = dir.cross(up);
+		left.z = 0; // constraining rotations along dir
+		left.normalize();
+	}
+	// the moves scale with the distance to the fractal of order 'order'
+	void moveHorz(float v, float order) {
+		pos = pos + left * (-v * fractalDist(order, pos));
+	}
+	void moveVert(float v, float order) {
+		pos = pos + up * v * fractalDist(order, pos);
+	}
+	void moveDir(float v, float order) {
+		pos = pos + dir * v * fractalDist(order, pos);
+	}
+	// direction of the ray through the screen point ( x, y ) in [-1;1], as in frag.glsl
+	Vec3 ray(float x, float y, float ratio, float focal = 1.0) const {
+		return (dir * focal + left * (ratio * x) + up * y).normalize();
+	}
+};
+
+// cameras recorded along a path, one per line triplet 'pos', 'dir' and 'up' (see camRecord.txt),
+// played back smoothly by interpolating the closest ones
+struct CameraPath {
+
+	std::vector<Camera> cameras;
+
+	CameraPath() {}
+	CameraPath(const std::string& fileName) {
+		std::fstream file(fileName, std::fstream::in);
+		while (file.is_open()) {
+			Vec3 pos, dir, up;
+			file >> pos.x >> pos.y >> pos.z;
+			file >> dir.x >> dir.y >> dir.z;
+			file >> up.x >> up.y >> up.z;
+			if (file.eof()) { break; }
+			cameras.push_back(Camera{ pos, dir, up });
+		}
+	}
+
+	inline bool empty() const { return cameras.empty(); }
+
+	// the progress goes along the path from 0 to length()
+	inline float length() const { return cameras.empty() ? 0 : cameras.size() - 1.f; }
+
+	static inline float interpKernel(float x) {
+		x = x < 0 ? -x : x;
+		return x < 1 ? 0.5f + 0.5f*cosf(3.1416f*x) : 0;
+	}
+
+	// HACK : bugs if U-Turns
+	// TODO : use quaternions instead
+	Camera at(float progress) const {
+		float coeffs = 0;
+		Vec3 pos = { 0,0,0 }, dir = { 0,0,0 }, up = { 0,0,0 };
+		for (int c = fmaxf(0.0f, progress - 5.0f); c <= fminf(cameras.size() - 1, progress + 5.0f); c++) {
+			float coeff = interpKernel((progress - c) / 3);
+			coeffs += coeff;
+			const Camera& cam = cameras[c];
+			pos = pos + cam.pos * coeff;
+			dir = dir + cam.dir * coeff;
+			up = up + cam.up * coeff;
+		}
+		return Camera(pos / coeffs, dir / coeffs, up / coeffs);
+	}
+};
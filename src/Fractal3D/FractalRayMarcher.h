@@ -0,0 +1,227 @@
+#pragma once
+
+// CPU port of frag.glsl : sphere tracing of the Mandelbulb, fog, central-difference normals and MatCap shading,
+// for reference images and offline renders without a GPU. Tiles of pixels are shared between the cores
+// by Parallel::forEach's work stealing.
+// The cone marching pre-passes march a cone per block of pixels, wide enough to hold the block's rays : the
+// ball around a point of its axis at the depth t holds the rays' points there once shrunk by t * tan( angle ),
+// so the depth where the cone meets the fractal is free for all of them, and their marching starts there.
+// Each pass starts from the depths of the coarser one, as the passes of frag.glsl do.
+
+#include "Fractal.h"
+#include "Estimators.h"
+#include "DistanceCache.h"
+#include <Parallel.h>
+#include "lodepng.h"
+#include <Trace.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+typedef unsigned char uchar;
+
+struct Image {
+	unsigned w, h;
+	std::vector<uchar> pixels; // RGBA, top row first
+	Image(const std::string& fileName) {
+		TRACE_SCOPE_DETAIL("PNG decode", fileName);
+		unsigned error = lodepng::decode(pixels, w, h, fileName);
+		if (error) {
+			std::cerr << "error when opening " << fileName <<
+				" " << lodepng_error_text(error) << std::endl; throw 1;
+		}
+	}
+	// bilinear lookup of the RGB channels in [0;1], repeating the image as GL_REPEAT and GL_LINEAR do
+	// (the texture's t = 0 is the first row)
+	Vec3 sample(float u, float v) const {
+		float x = u * w - 0.5f, y = v * h - 0.5f;
+		float fx = floorf(x), fy = floorf(y);
+		float ax = x - fx, ay = y - fy;
+		int x0 = wrap(int(fx), w), x1 = wrap(int(fx) + 1, w);
+		int y0 = wrap(int(fy), h), y1 = wrap(int(fy) + 1, h);
+		Vec3 dst = { 0, 0, 0 };
+		const int xs[2] = { x0, x1 }, ys[2] = { y0, y1 };
+		const float wx[2] = { 1 - ax, ax }, wy[2] = { 1 - ay, ay };
+		for (int j = 0; j < 2; j++)
+			for (int i = 0; i < 2; i++) {
+				const uchar* p = &pixels[4 * (size_t(ys[j]) * w + xs[i])];
+				dst = dst + Vec3{ float(p[0]), float(p[1]), float(p[2]) } * (wx[i] * wy[j] / 255);
+			}
+		return dst;
+	}
+private:
+	static inline int wrap(int i, unsigned n) {
+		int m = i % int(n);
+		return m < 0 ? m + int(n) : m;
+	}
+};
+
+struct FractalRayMarcher {
+
+	struct Stats {
+		size_t pixels = 0, evaluations = 0; // of the distance estimator
+		size_t coneEvaluations = 0; // out of them, in the cone marching pre-passes
+		size_t cachedSteps = 0; // taken from the DistanceCache's bounds
+		double seconds = 0;
+
+		void print(std::ostream& out) const {
+			out << pixels << " pixels in " << 1000 * seconds << " ms : " << pixels / seconds / 1e6 << " Mpixels/s, "
+				<< double(evaluations) / pixels << " distance evaluations per pixel";
+			if (coneEvaluations) { out << " (" << double(coneEvaluations) / pixels << " in the cone passes)"; }
+			if (cachedSteps) { out << ", " << double(cachedSteps) / pixels << " cached steps per pixel"; }
+			out << std::endl;
+		}
+	};
+
+	// frag.glsl's constants
+	float order = 8.0;
+	int iterations = 16; // of the distance estimator
+	int steps = 32; // of the sphere tracing
+	float minStep = 0.000001f;
+	float focal = 1.0;
+	bool trigFree = true; // for the integer orders, see Estimators.h
+
+	const Image* matCap;
+	const DistanceCache* cache = NULL; // of the same order and iterations, when not NULL
+	int maxCachedSteps = 256; // they don't count in 'steps'
+	std::vector<unsigned> coneBlocks; // pixels per side of the blocks of the cone marching pre-passes, coarsest first
+	unsigned tileSize = 16;
+	Stats stats;
+
+	FractalRayMarcher(const Image& matCap) : matCap(&matCap) {}
+
+	// distance to the fractal
+	inline float dist(const Vec3& c) const {
+		return trigFree ? Estimators::dist(order, c, iterations) : fractalDist(order, c, iterations);
+	}
+
+	// normal on a point 'z' of the surface, 'step' being the precision of the approximation
+	Vec3 normal(const Vec3& z, float step) const {
+		return Vec3{
+			dist(z + Vec3{ step, 0, 0 }) - dist(z + Vec3{ -step, 0, 0 }),
+			dist(z + Vec3{ 0, step, 0 }) - dist(z + Vec3{ 0, -step, 0 }),
+			dist(z + Vec3{ 0, 0, step }) - dist(z + Vec3{ 0, 0, -step })
+		}.normalize();
+	}
+
+	// depth from 'depth' on the axis of the cone through the screen point ( x, y ), up to which the rays of the
+	// screen's disk of radius 'radius' around it are out of the fractal, as frag.glsl's coneDepth()
+	float coneDepth(const Camera& camera, float x, float y, float ratio, float radius, float depth, float maxDist, size_t& evaluations) const {
+
+		const Vec3 axis = camera.dir * focal + camera.left * (ratio * x) + camera.up * y;
+		const Vec3 dir = axis.normalize();
+		const float sine = std::min(0.99f, radius / axis.norm()); // of the cone's half angle, at most
+		const float spread = sine / sqrtf(1 - sine * sine);
+
+		Vec3 pos = camera.pos + dir * depth;
+		for (int i = 0; i < steps; i++) {
+			const float step = dist(pos) - depth * spread;
+			evaluations++;
+			if (step < 0.1f * depth * spread || step < minStep) { break; }
+			depth += step;
+			pos = pos + dir * step;
+			if (depth > maxDist) { break; }
+		}
+		return std::min(depth, maxDist); // the background's rays stop there too, before the estimator overflows
+	}
+
+	// color of the screen point ( x, y ) in [-1;1], as frag.glsl's main(), from the depth 'start'
+	Vec3 shade(const Camera& camera, float x, float y, float ratio, float maxDist, size_t& evaluations, size_t& cachedSteps, float start = 0) const {
+
+		const Vec3 dir = camera.ray(x, y, ratio, focal);
+		float depth = start;
+		Vec3 pos = camera.pos + dir * depth;
+
+		for (int i = 0, cached = 0; i < steps; ) {
+
+			// the cache's bound while it is large enough, else the estimator
+			float step = cache && cached < maxCachedSteps ? cache->bound(pos) : 0;
+			if (cache && step >= cache->minStep()) { cached++; cachedSteps++; }
+			else { step = dist(pos); evaluations++; i++; }
+			depth += step;
+			pos = pos + dir * step;
+			if (depth > maxDist || step < minStep) { break; }
+		}
+
+		float fog = depth / maxDist;
+		Vec3 n = normal(pos, 0.01f * depth);
+		evaluations += 6;
+
+		Vec3 color = matCap->sample((1 + n.dot(camera.left)) / 2, (1 - n.dot(camera.up)) / 2);
+		return Vec3{ 1, 1, 1 } * fog + color * (1 - fog);
+	}
+
+	// renders 'width' x 'height' RGBA pixels, top row first
+	std::vector<uchar> render(const Camera& camera, unsigned width, unsigned height, unsigned threads = 0) {
+		std::vector<uchar> pixels;
+		render(camera, width, height, pixels, threads);
+		return pixels;
+	}
+
+	// into 'pixels', reusing its memory
+	void render(const Camera& camera, unsigned width, unsigned height, std::vector<uchar>& pixels, unsigned threads = 0) {
+
+		auto start = std::chrono::steady_clock::now();
+		pixels.resize(size_t(width) * height * 4);
+		const float ratio = width / float(height);
+		const float maxDist = 32 * dist(camera.pos);
+
+		// the cone passes : a depth per block, from the depth of the coarser block holding it
+		std::vector<size_t> evaluations(threads ? threads : Parallel::threadCount(), 0), cachedSteps(evaluations);
+		std::vector<float> starts;
+		unsigned startBlock = 0, startsX = 0;
+		for (unsigned block : coneBlocks) {
+			const unsigned blocksX = (width + block - 1) / block, blocksY = (height + block - 1) / block;
+			const float radius = sqrtf(ratio * block / width * ratio * block / width + block / float(height) * block / float(height));
+			std::vector<float> depths(size_t(blocksX) * blocksY);
+			Parallel::forEach(blocksY, [&](size_t by, unsigned worker) {
+				size_t count = 0;
+				for (unsigned bx = 0; bx < blocksX; bx++) {
+					const float x = 2 * (bx + 0.5f) * block / width - 1, y = 1 - 2 * (by + 0.5f) * block / height;
+					const float start = startBlock ? starts[(by * block / startBlock) * startsX + bx * block / startBlock] : 0;
+					depths[by * blocksX + bx] = coneDepth(camera, x, y, ratio, radius, start, maxDist, count);
+				}
+				evaluations[worker] += count;
+			}, threads);
+			starts.swap(depths);
+			startBlock = block;
+			startsX = blocksX;
+		}
+		size_t coneEvaluations = 0;
+		for (size_t e : evaluations) { coneEvaluations += e; }
+
+		const unsigned tilesX = (width + tileSize - 1) / tileSize, tilesY = (height + tileSize - 1) / tileSize;
+		Parallel::forEach(size_t(tilesX) * tilesY, [&](size_t tile, unsigned worker) {
+			const unsigned x0 = unsigned(tile % tilesX) * tileSize, y0 = unsigned(tile / tilesX) * tileSize;
+			size_t count = 0, cachedCount = 0;
+			for (unsigned j = y0; j < std::min(y0 + tileSize, height); j++)
+				for (unsigned i = x0; i < std::min(x0 + tileSize, width); i++) {
+					// pixel centers, the bottom row being at y = -1 as in GL's window coordinates
+					float x = 2 * (i + 0.5f) / width - 1, y = 1 - 2 * (j + 0.5f) / height;
+					const float start = startBlock ? starts[(j / startBlock) * startsX + i / startBlock] : 0;
+					Vec3 c = shade(camera, x, y, ratio, maxDist, count, cachedCount, start);
+					uchar* p = &pixels[4 * (size_t(j) * width + i)];
+					p[0] = toByte(c.x); p[1] = toByte(c.y); p[2] = toByte(c.z); p[3] = 255;
+				}
+			evaluations[worker] += count;
+			cachedSteps[worker] += cachedCount;
+		}, threads);
+
+		stats.pixels = size_t(width) * height;
+		stats.evaluations = 1; // the far distance
+		stats.coneEvaluations = coneEvaluations;
+		stats.cachedSteps = 0;
+		for (size_t e : evaluations) { stats.evaluations += e; }
+		for (size_t c : cachedSteps) { stats.cachedSteps += c; }
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+private:
+	// as GL's conversion to normalized bytes
+	static inline uchar toByte(float v) {
+		return uchar(std::min(1.f, std::max(0.f, v)) * 255 + 0.5f);
+	}
+};
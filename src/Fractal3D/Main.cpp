@@ -6,12 +6,24 @@
 #include <fstream>
 #include <unordered_map>
 #include <string>
+#include <future>
+#include <chrono>
+#include <memory>
+#include <thread>
 
 #include <math.h>
 
+#include "FractalRayMarcher.h"
+#include <FrameQueue.h>
+#include <GlewGlut.h>
+#include <Trace.h>
+
 #ifdef WIN32
 #define popen _popen
 #define pclose _pclose
+#define POPEN_WRITE "wb"
+#else
+#define POPEN_WRITE "w" // glibc's popen() rejects "wb"
 #endif
 
 using namespace std;
@@ -19,202 +31,69 @@ using namespace std;
 int currentW = 800;
 int currentH = 600;
 
-int targetFramerate = 60;
-
 float fractalOrder = 8.0;
 GLuint fractalOrderPos;
 
 int mouseLastX, mouseLastY;
 
-int windowId;
-
 GLuint uniform_ratio;
 
-struct keyFunction {
-	const string description;
-	void(*function)(void);
-};
+// shader uniforms of the camera
+GLuint uniform_camPos, uniform_camDir, uniform_camLeft, uniform_camUp;
 
-struct Vec3 {
-	float x, y, z;
-	float norm2() const {
-		return x*x + y*y + z*z;
-	}
-	float norm() const {
-		return sqrt(norm2());
-	}
-	Vec3 operator/ (float v) const {
-		return{ x / v, y / v, z / v };
-	}
-	Vec3 operator* (float v) const {
-		return{ x * v, y * v, z * v };
-	}
-	Vec3 operator+(const Vec3& v) const {
-		return{
-			x + v.x,
-			y + v.y,
-			z + v.z
-		};
-	}
-	Vec3 normalize() const {
-		return operator/(norm());
-	}
-	Vec3 cross(const Vec3& v) const {
-		return{
-			y*v.z - v.y*z,
-			z*v.x - v.z*x,
-			x*v.y - v.x*y
-		};
-	}
-	void operator>>(fstream& file) {
-		file << x << " " << y << " " << z << endl;
-	}
-	/*void operator<<(fstream& file) {
-		file >> x;
-		file >> y;
-		file >> z;
-	}*/
-	void glUniform(const GLuint pos) const {
-		glUniform3f(pos, x, y, z);
-	}
-};
-
-void powN(float p, Vec3& z, float zr0, float& dr)
-{
-	float zo0 = asin(z.z / zr0);
-	float zi0 = atan2(z.y, z.x);
-	float zr = pow(zr0, p - 1.0);
-	float zo = zo0 * p;
-	float zi = zi0 * p;
-	float czo = cos(zo);
-
-	dr = zr * dr * p + 1.0;
-	zr *= zr0;
-
-	z = Vec3{ zr * czo * cos(zi), zr * czo * sin(zi), zr * sin(zo) };
+void glUniform(const GLuint pos, const Vec3& v) {
+	glUniform3f(pos, v.x, v.y, v.z);
 }
 
-// distance to fractal
-float fractalDist(float power, Vec3 c) {
-
-	Vec3 z = c;
-	float dr = 1.0;
-	float r = z.norm();
-
-	for (int i = 0; i < 256; i++) {
-
-		powN(power, z, r, dr);
-
-		z = z + c;
-
-		r = z.norm();
-
-		if (r > 2) { break; }
-	}
-	return 0.5 * log(r) * r / dr;
+// the fractal renders at the resolution meeting the frame budget while the camera moves ('x' switches it) ; the
+// redraws, the frame rate ('u', --fps, --benchmark), the timings ('T', --timings) and --headless are GlewGlut's,
+// this demo driving glut itself with them (see GlewGlut::setup())
+using GlewGlut::target;
+using GlewGlut::timers;
+using GlewGlut::markDirty;
+
+void updateUniforms(const Camera& camera) {
+	target.moved();
+	glUniform(uniform_camPos, camera.pos);
+	glUniform(uniform_camDir, camera.dir);
+	glUniform(uniform_camLeft, camera.left);
+	glUniform(uniform_camUp, camera.up);
 }
 
-struct Camera {
-
-	Vec3 pos, dir, left, up;
-	GLuint uniform_pos, uniform_dir, uniform_left, uniform_up; // shader uniforms
-	Camera(Vec3 pos, Vec3 dir, Vec3 up = { 0,0,1 }) :
-		pos(pos), dir(dir), up(up) {
-		left = dir.cross(up).normalize();
-	}
-	void updateUniforms() {
-		pos.glUniform(uniform_pos);
-		dir.glUniform(uniform_dir);
-		left.glUniform(uniform_left);
-		up.glUniform(uniform_up);
-	}
-	void vertRot(float v) {
-		dir = (dir + up * v).normalize();
-		up = left.cross(dir).normalize();
-	}
-	void horzRot(float v) { // HACK
-		dir = (dir + left * (-v)).normalize();
-		left = dir.cross(up);
-		left.z = 0; // constraining rotations along dir
-		left.normalize();
-	}
-	void moveHorz(float v) {
-		pos = pos + left * (-v * fractalDist(fractalOrder,pos));
-	}
-	void moveVert(float v) {
-		pos = pos + up * v * fractalDist(fractalOrder, pos);
-	}
-	void moveDir(float v) {
-		pos = pos + dir * v * fractalDist(fractalOrder, pos);
-	}
-};
-
 bool demoMode = false;
 
-// HACK : bugs if U-Turns
-// TODO : use quaternions instead
+// plays back camRecord.txt in demo mode, and appends the positions recorded with 'r' to it
 struct CameraRecorded : public Camera {
 
-	vector<Camera> cameras;
+	CameraPath path;
 
 	float speed;
-	float progress = 0; // between 0 and cameras.size()-1
+	float progress = 0; // between 0 and path.length()
 
 	fstream file;
 
 	CameraRecorded(Vec3 pos, Vec3 dir, string fileName = "camRecord.txt", float speed = 0.01) :
-		Camera(pos, dir), speed(speed) {
-
-		file = fstream(fileName, fstream::in);
-		if (file.is_open()) {
-			while (true) {
-				Vec3 pos, dir, up;
-				/*pos << file;
-				dir << file;
-				up << file;*/ // TODO
-				file >> pos.x >> pos.y >> pos.z;
-				file >> dir.x >> dir.y >> dir.z;
-				file >> up.x >> up.y >> up.z;
-				if (file.eof()) { break; }
-				cameras.push_back(Camera{ pos, dir, up });
-			}
-			update();
-		}
+		Camera(pos, dir), path(fileName), speed(speed) {
 
+		update();
 		file = fstream(fileName, fstream::app);
 	}
 
 	void recordFrame() {
 		//cameras.push_back(*this); TODO ?
-		cameras.push_back(Camera{ pos, dir, up });
+		path.cameras.push_back(Camera{ pos, dir, up });
 		pos >> file;
 		dir >> file;
 		up >> file;
 	}
 
-	static inline float interpKernel(float x) {
-		x = x < 0 ? -x : x;
-		return x < 1 ? 0.5f + 0.5f*cosf(3.1416f*x) : 0;
-	}
-
 	void update() {
 
-		if (cameras.size() == 0) { return; }
-		float coeffs = 0;
-		pos = { 0,0,0 }; dir = { 0,0,0 }; up = { 0,0,0 };
-		for (int c = fmaxf(0.0f, progress - 5.0f); c <= fminf(cameras.size() - 1, progress + 5.0f); c++) {
-			float coeff = interpKernel((progress - c) / 3);
-			coeffs += coeff;
-			const Camera& cam = cameras[c];
-			pos = pos + cam.pos * coeff;
-			dir = dir + cam.dir * coeff;
-			up = up + cam.up * coeff;
-		}
-		pos = pos / coeffs; dir = dir / coeffs; up = up / coeffs;
-		left = dir.cross(up).normalize();
+		if (path.empty()) { return; }
+		Camera::operator=(path.at(progress));
 
 		progress += speed;
-		if (progress > cameras.size() - 1) { progress = 0; } // looping
+		if (progress > path.length()) { progress = 0; } // looping
 	}
 
 };
@@ -273,8 +152,10 @@ struct Shader {
 	}
 
 	Shader() { }
-	Shader(const string& vertFile, const string& fragFile) : name(vertFile + " " + fragFile) {
+	// 'fragSuffix' is appended to the fragment shader's code
+	Shader(const string& vertFile, const string& fragFile, const string& fragSuffix = "") : name(vertFile + " " + fragFile) {
 
+		TRACE_SCOPE_DETAIL("compile shader", name);
 		string vertCode = readFile(vertFile).data();
 		const char* vertCodeP = vertCode.data();
 		vert = glCreateShader(GL_VERTEX_SHADER);
@@ -282,7 +163,7 @@ struct Shader {
 		glCompileShader(vert);
 		displayProgramErrors(vert, vertFile.c_str());
 
-		string fragCode = readFile(fragFile).data();
+		string fragCode = readFile(fragFile).data() + fragSuffix;
 		const char* fragCodeP = fragCode.data();
 		frag = glCreateShader(GL_FRAGMENT_SHADER);
 		glShaderSource(frag, 1, &fragCodeP, NULL);
@@ -312,42 +193,284 @@ struct Shader {
 
 Shader shader;
 
-typedef unsigned char uchar;
+// distance bricks of the current order, rebuilt on a worker thread when the order changes
+bool useCache = true;
+DistanceCache cache;
+future<DistanceCache> cacheJob;
+GLint uniform_cached;
+
+void DistanceCache::upload() {
+
+	auto texture = [](GLuint& id, GLenum unit) {
+		glActiveTexture(unit);
+		if (id == 0) { glGenTextures(1, &id); }
+		glBindTexture(GL_TEXTURE_3D, id);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	};
+	const GLsizei n = cells + 1;
+	texture(coarseId, GL_TEXTURE1);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, n, n, n, 0, GL_RED, GL_FLOAT, coarse.data());
+
+	// the bricks in a cube of slots, and the origin of each cell's slot (or -1)
+	slotsPerAxis = 1;
+	while (slotsPerAxis * slotsPerAxis * slotsPerAxis < stats.bricks) { slotsPerAxis++; }
+	const unsigned m = brickSize + 1, side = slotsPerAxis * m;
+	vector<float> atlas(size_t(side) * side * side, 0.0f);
+	vector<float> indirection(brickOf.size() * 3, -1.0f);
+	for (size_t cell = 0; cell < brickOf.size(); cell++) {
+		if (brickOf[cell] < 0) { continue; }
+		const unsigned b = brickOf[cell];
+		const unsigned x = (b % slotsPerAxis) * m, y = (b / slotsPerAxis % slotsPerAxis) * m, z = (b / (slotsPerAxis * slotsPerAxis)) * m;
+		indirection[3 * cell] = float(x); indirection[3 * cell + 1] = float(y); indirection[3 * cell + 2] = float(z);
+		const float* src = &fine[size_t(b) * m * m * m];
+		for (unsigned k = 0; k < m; k++)
+			for (unsigned j = 0; j < m; j++)
+				copy(src + m * (j + m * k), src + m * (j + m * k) + m, &atlas[x + side * ((y + j) + side * size_t(z + k))]);
+	}
+	texture(indirectionId, GL_TEXTURE2);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB32F, cells, cells, cells, 0, GL_RGB, GL_FLOAT, indirection.data());
+	texture(bricksId, GL_TEXTURE3);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, side, side, side, 0, GL_RED, GL_FLOAT, atlas.data());
+	glActiveTexture(GL_TEXTURE0);
+}
 
-#include "lodepng.h"
+void rebuildCache() {
 
-struct Image {
-	GLuint w, h;
-	vector<uchar> pixels;
-	Image(string fileName) {
-		unsigned error = lodepng::decode(pixels, w, h, fileName);
-		if (error) {
-			std::cerr << "error when opening " << fileName <<
-				" " << lodepng_error_text(error) << endl; throw 1;
-		}
+	glUniform1i(uniform_cached, 0); // the bricks are for another order
+	if (cacheJob.valid()) { return; } // restarted once the running build is done
+	float order = fractalOrder;
+	cacheJob = async(launch::async, [order]() {
+		TRACE_THREAD("distance cache");
+		TRACE_SCOPE("DistanceCache");
+		return DistanceCache(order, 16); // frag.glsl's iterations
+	});
+}
+
+void cacheUniforms();
+
+// once built, uploads the bricks if the order is still the same, else builds them again
+void pollCache() {
+
+	if (!cacheJob.valid() || cacheJob.wait_for(chrono::seconds(0)) != future_status::ready) { return; }
+	DistanceCache built = cacheJob.get();
+	if (built.order != fractalOrder) { rebuildCache(); return; }
+	built.coarseId = cache.coarseId;
+	built.indirectionId = cache.indirectionId;
+	built.bricksId = cache.bricksId;
+	cache = std::move(built);
+	cache.upload();
+	cout << "distance cache of order " << cache.order << " : ";
+	cache.stats.print(cout);
+	cacheUniforms();
+	markDirty();
+}
+
+void cacheUniforms() {
+
+	glUniform1i(shader.getUniformLocation("cacheCoarse"), 1);
+	glUniform1i(shader.getUniformLocation("cacheIndirection"), 2);
+	glUniform1i(shader.getUniformLocation("cacheBricks"), 3);
+	glUniform1f(shader.getUniformLocation("cacheExtent"), cache.extent);
+	glUniform1i(shader.getUniformLocation("cacheCells"), cache.cells);
+	glUniform1i(shader.getUniformLocation("cacheBrickSize"), cache.brickSize);
+	glUniform1i(uniform_cached, useCache && !cache.empty() && cache.order == fractalOrder);
+}
+
+// cone marching pre-passes at 1/8 and 1/4 of the resolution (see frag.glsl), into float textures on unit 4
+bool useCones = true;
+const int coneLevels = 2;
+const int coneBlocks[coneLevels] = { 8, 4 };
+GLuint coneFbos[coneLevels], coneTextures[coneLevels];
+GLint uniform_coneBlock, uniform_coneParent, uniform_coneResolution;
+
+void initCones() {
+
+	glGenFramebuffers(coneLevels, coneFbos);
+	glGenTextures(coneLevels, coneTextures);
+}
+
+// the textures hold the blocks of the whole window, the frames of the dynamic resolution using a part of them
+void resizeCones(int w, int h) {
+
+	GLint bound = 0; // the matcap, on the unit 0
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+	for (int l = 0; l < coneLevels; l++) {
+		glBindTexture(GL_TEXTURE_2D, coneTextures[l]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, (w + coneBlocks[l] - 1) / coneBlocks[l], (h + coneBlocks[l] - 1) / coneBlocks[l], 0, GL_RED, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, coneFbos[l]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, coneTextures[l], 0);
+	}
+	glBindTexture(GL_TEXTURE_2D, bound);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void drawQuad() {
+
+	glBegin(GL_QUADS); {
+		glVertex3f(-1, -1, 0);
+		glVertex3f(-1, 1, 0);
+		glVertex3f(1, 1, 0);
+		glVertex3f(1, -1, 0);
+	}glEnd();
+}
+
+// renders the pre-passes of a w x h frame, then binds the target and the depths for the shading pass
+void conePasses(int w, int h) {
+
+	glUniform2f(uniform_coneResolution, GLfloat(w), GLfloat(h));
+	int parent = 0;
+	glActiveTexture(GL_TEXTURE4);
+	for (int l = 0; useCones && l < coneLevels; l++) {
+		glBindFramebuffer(GL_FRAMEBUFFER, coneFbos[l]);
+		glViewport(0, 0, (w + coneBlocks[l] - 1) / coneBlocks[l], (h + coneBlocks[l] - 1) / coneBlocks[l]);
+		glUniform1i(uniform_coneBlock, coneBlocks[l]);
+		glUniform1i(uniform_coneParent, parent);
+		drawQuad();
+		glBindTexture(GL_TEXTURE_2D, coneTextures[l]);
+		parent = coneBlocks[l];
 	}
-};
+	glActiveTexture(GL_TEXTURE0);
 
-#include <sstream>
-FILE* ffmpeg;
-bool recording = false;
+	glBindFramebuffer(GL_FRAMEBUFFER, target.target());
+	glViewport(0, 0, w, h);
+	glUniform1i(uniform_coneBlock, 0);
+	glUniform1i(uniform_coneParent, parent);
+}
 
-void init() {
+// a program per integer order, with its trig-free power (see Estimators.h), and one for the others
+unordered_map<int, Shader> programs;
 
-	glClearColor(0.0, 0.0, 0.0, 1.0);
+void useProgram() {
+
+	const int variant = Estimators::integerOrder(fractalOrder);
+	auto program = programs.find(variant);
+	if (program == programs.end()) {
+		program = programs.emplace(variant, Shader("vert.glsl", "frag.glsl", Estimators::glsl(variant))).first;
+	}
+	shader = program->second;
+	shader.use();
 
-	shader = Shader("vert.glsl", "frag.glsl");
 	uniform_ratio = shader.getUniformLocation("ratio");
-	camera.uniform_pos = shader.getUniformLocation("camPos");
-	camera.uniform_dir = shader.getUniformLocation("camDir");
-	camera.uniform_up = shader.getUniformLocation("camUp");
-	camera.uniform_left = shader.getUniformLocation("camLeft");
+	uniform_camPos = shader.getUniformLocation("camPos");
+	uniform_camDir = shader.getUniformLocation("camDir");
+	uniform_camUp = shader.getUniformLocation("camUp");
+	uniform_camLeft = shader.getUniformLocation("camLeft");
 	fractalOrderPos = shader.getUniformLocation("order");
+	uniform_cached = shader.getUniformLocation("cached");
+	uniform_coneBlock = shader.getUniformLocation("coneBlock");
+	uniform_coneParent = shader.getUniformLocation("coneParent");
+	uniform_coneResolution = shader.getUniformLocation("coneResolution");
 
-	shader.use();
 	glUniform1f(uniform_ratio, currentW / (float)currentH);
 	glUniform1f(fractalOrderPos, fractalOrder);
-	camera.updateUniforms();
+	updateUniforms(camera);
+	glUniform1i(shader.getUniformLocation("matCap"), 0);
+	glUniform1i(shader.getUniformLocation("coneDepths"), 4);
+	cacheUniforms();
+}
+
+void setOrder(float order) {
+
+	fractalOrder = order;
+	target.moved();
+	useProgram();
+	rebuildCache();
+}
+
+#include <sstream>
+
+// Frames recorded with 'g' : glReadPixels goes into a ring of pixel buffers and returns at once, each buffer
+// being mapped a few frames later, once its fence is signaled. The frames then wait in a FrameQueue for its
+// thread to write them into ffmpeg's pipe, so that neither the readback nor the encoder stall the rendering.
+struct FrameCapture {
+
+	static const int ringSize = 3;
+	GLuint pbos[ringSize];
+	GLsync fences[ringSize];
+	int next = 0, pending = 0; // next buffer of the ring, and the frames in flight before it
+	unsigned w, h;
+	FILE* pipe;
+	FrameQueue::Policy policy;
+	FrameQueue queue;
+
+	FrameCapture(unsigned w, unsigned h, FILE* pipe, FrameQueue::Policy policy) : w(w), h(h), pipe(pipe), policy(policy),
+		queue([pipe](const Frame& frame) { fwrite(frame.pixels.data(), 1, frame.size(), pipe); }, 8, policy) {
+
+		glGenBuffers(ringSize, pbos);
+		for (int i = 0; i < ringSize; i++) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, size_t(w) * h * 4, NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	// starts reading the back buffer, and queues the frames already read
+	void capture() {
+
+		// the GPU is a whole ring late : a buffer still in flight is never reused
+		if (pending == ringSize) {
+			if (policy == FrameQueue::Block) { while (!collect(true)) {} }
+			else if (!collect(true)) { queue.drop(); return; }
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[next]);
+		glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		fences[next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		next = (next + 1) % ringSize;
+		pending++;
+		while (pending > 0 && collect(false)) {}
+	}
+
+	// queues the oldest frame in flight once read, waiting for it or not ; false if it is not read yet
+	bool collect(bool wait) {
+
+		const int oldest = (next - pending + ringSize) % ringSize;
+		const GLenum status = glClientWaitSync(fences[oldest], wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000 : 0);
+		if (status == GL_TIMEOUT_EXPIRED) { return false; }
+		glDeleteSync(fences[oldest]);
+		pending--;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[oldest]);
+		const uchar* pixels = (const uchar*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size_t(w) * h * 4, GL_MAP_READ_BIT);
+		if (pixels != NULL) {
+			FramePtr frame = queue.acquire(w, h);
+			copy(pixels, pixels + frame->size(), frame->pixels.data());
+			queue.push(move(frame));
+		}
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		return true;
+	}
+
+	// queues the frames in flight, then waits for the writer and closes the pipe
+	~FrameCapture() {
+
+		while (pending > 0) { collect(true); }
+		queue.close();
+		pclose(pipe);
+		glDeleteBuffers(ringSize, pbos);
+		cout << "recording : ";
+		queue.getStats().print(cout);
+	}
+};
+
+unique_ptr<FrameCapture> recording;
+FrameQueue::Policy recordingPolicy = FrameQueue::Drop;
+
+void init() {
+
+	TRACE_SCOPE("init");
+	glClearColor(0.0, 0.0, 0.0, 1.0);
+
+	target.init();
+	target.resize(currentW, currentH);
+	initCones();
+	resizeCones(currentW, currentH);
+
+	useProgram();
 
 	// MatCap image
 	Image matCap("matcap.png");
@@ -357,158 +480,206 @@ void init() {
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, matCap.w, matCap.h, 0, GL_RGBA, GL_UNSIGNED_BYTE, matCap.pixels.data());
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glUniform1ui(shader.getUniformLocation("matCap"), 0);
+	rebuildCache();
 }
 
 void display() {
 
-	if (demoMode) {
-		camera.update();
-		camera.updateUniforms();
-	}
+	GlewGlut::redraws.drawn(GlewGlut::animating());
 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	timers.beginFrame();
+	{
+		GlewGlut::PassTimers::Scope frame(timers, "frame");
 
-	glBegin(GL_QUADS); {
-		glVertex3f(-1, -1, 0);
-		glVertex3f(-1, 1, 0);
-		glVertex3f(1, 1, 0);
-		glVertex3f(1, -1, 0);
-	}glEnd();
+		if (demoMode) {
+			camera.update();
+			updateUniforms(camera);
+		}
 
-	glutSwapBuffers();
+		target.begin();
+		{
+			GlewGlut::PassTimers::Scope pass(timers, "cones");
+			conePasses(target.renderW, target.renderH);
+		}
+		{
+			GlewGlut::PassTimers::Scope pass(timers, "march");
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			drawQuad();
+		}
+		{
+			GlewGlut::PassTimers::Scope pass(timers, "upscale");
+			target.end();
+		}
+
+		if (recording) {
+			GlewGlut::PassTimers::Scope pass(timers, "capture");
+			recording->capture();
 
-	if (recording) {
-		vector<uchar> pixels(currentW*currentH * 4);
-		glReadPixels(0, 0, currentW, currentH, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
-		fwrite(pixels.data(), sizeof(uchar)*currentW*currentH * 4, 1, ffmpeg);
+			// the queue's state in the title, a few times per second
+			FrameQueue::Stats stats = recording->queue.getStats();
+			if (stats.pushed % 15 == 0 && !GlewGlut::headless()) {
+				stringstream title;
+				title << "Fractal - recording : " << stats.depth << " frames queued, " << stats.dropped << " dropped";
+				glutSetWindowTitle(title.str().c_str());
+			}
+		}
 	}
-}
+	if (GlewGlut::showTimings && !GlewGlut::headless()) { timers.drawOverlay(currentH); }
+	timers.endFrame();
 
-void idle() {
+	if (GlewGlut::headless()) { return; }
 
-	static int nWaitUntil = glutGet(GLUT_ELAPSED_TIME);
-	int nTimer = glutGet(GLUT_ELAPSED_TIME);
-	if (nTimer >= nWaitUntil) {
-		glutPostRedisplay();
-		nWaitUntil = nTimer + (int)(1000.0f / targetFramerate);
-	}
+	glutSwapBuffers();
+
+	GlewGlut::pacer.shown();
+	if (GlewGlut::pacer.benchmarked()) { GlewGlut::quit(); }
 }
 
-unordered_map<char, keyFunction> keys = {
-	{
-		27 ,
-		{
-			"Exits the program",
-			[](void) {
-	glutDestroyWindow(windowId);
-	exit(EXIT_SUCCESS);
+// demo mode plays the recorded path, and a recording needs all the frames
+bool animating() {
+	return demoMode || recording;
 }
-		}
-	},
+
+// polls the distance cache's build, or waits for it before a headless frame
+bool updateCache(bool finish) {
+
+	pollCache();
+	while (finish && cacheJob.valid()) { cacheJob.wait(); pollCache(); }
+	return cacheJob.valid();
+}
+
+// added to GlewGlut's, which has escape, 'u', 'T' and 'x'
+unordered_map<char, GlewGlut::KeyFunction> keys = {
 	{
 		'w' ,
 		{
 			"Moves forward",
-			[](void) { camera.moveDir(camSpeed); camera.updateUniforms(); }
+			[](bool down) { if (down) { camera.moveDir(camSpeed, fractalOrder); updateUniforms(camera); } }
 		}
 	},
 	{
 		's' ,
 		{
 			"Moves backward",
-			[](void) { camera.moveDir(-camSpeed); camera.updateUniforms(); }
+			[](bool down) { if (down) { camera.moveDir(-camSpeed, fractalOrder); updateUniforms(camera); } }
 		}
 	},
 	{
 		'a' ,
 		{
 			"Moves left",
-			[](void) { camera.moveHorz(camSpeed); camera.updateUniforms(); }
+			[](bool down) { if (down) { camera.moveHorz(camSpeed, fractalOrder); updateUniforms(camera); } }
 		}
 	},
 	{
 		'd' ,
 		{
 			"Moves right",
-			[](void) { camera.moveHorz(-camSpeed); camera.updateUniforms(); }
+			[](bool down) { if (down) { camera.moveHorz(-camSpeed, fractalOrder); updateUniforms(camera); } }
 		}
 	},
 	{
 		' ' ,
 		{
 			"Moves up",
-			[](void) { camera.moveVert(camSpeed); camera.updateUniforms(); }
+			[](bool down) { if (down) { camera.moveVert(camSpeed, fractalOrder); updateUniforms(camera); } }
 		}
 	},
 	{
 		'c' ,
 		{
 			"Moves down",
-			[](void) { camera.moveVert(-camSpeed); camera.updateUniforms(); }
+			[](bool down) { if (down) { camera.moveVert(-camSpeed, fractalOrder); updateUniforms(camera); } }
 		}
 	},
 	{
 		'o' ,
 		{
 			"Increase Fractal order",
-			[](void) { fractalOrder += 0.1; glUniform1f(fractalOrderPos,fractalOrder); }
+			[](bool down) { if (down) { setOrder(fractalOrder + 0.1); } }
 		}
 	},
 	{
 		'i' ,
 		{
 			"Decrease Fractal order",
-			[](void) { fractalOrder -= 0.1; glUniform1f(fractalOrderPos,fractalOrder); }
+			[](bool down) { if (down) { setOrder(fractalOrder - 0.1); } }
+		}
+	},
+	{
+		'b' ,
+		{
+			"Switches the distance bricks",
+			[](bool down) {
+				if (down) {
+					useCache = !useCache;
+					cacheUniforms();
+				}
+			}
+		}
+	},
+	{
+		'm' ,
+		{
+			"Switches the cone marching pre-passes",
+			[](bool down) { if (down) { useCones = !useCones; } }
 		}
 	},
 	{
 		'p' ,
 		{
 			"Switches demo mode",
-			[](void) { demoMode = !demoMode; }
+			[](bool down) { if (down) { demoMode = !demoMode; } }
 		}
 	},
 	{
 		'r' ,
 		{
 			"Record Camera position",
-			[](void) { camera.recordFrame(); }
+			[](bool down) { if (down) { camera.recordFrame(); } }
 		}
 	},
 	{
 		'g' ,
 		{
 			"Starts recording frames",
-			[](void) {
-				if (!recording) {
-
-					currentW = 2 * (currentW / 2);
-					currentH = 2 * (currentH / 2);
-					stringstream cmd;
-					cmd << "ffmpeg -r 60 -f rawvideo -pix_fmt rgba -s "<< currentW << "x" << currentH << " -i - "
-						"-threads 0 -preset fast -y -pix_fmt yuv420p -crf 21 -vf vflip output.mp4";
-					ffmpeg = popen(cmd.str().c_str(), "wb");
-
-					recording = true;
+			[](bool down) {
+				if (down) {
+					if (!recording) {
+
+						currentW = 2 * (currentW / 2);
+						currentH = 2 * (currentH / 2);
+						stringstream cmd;
+						cmd << "ffmpeg -r 60 -f rawvideo -pix_fmt rgba -s "<< currentW << "x" << currentH << " -i - "
+							"-threads 0 -preset fast -y -pix_fmt yuv420p -crf 21 -vf vflip output.mp4";
+						FILE* ffmpeg = popen(cmd.str().c_str(), POPEN_WRITE);
+						if (ffmpeg == NULL) { cerr << "cannot start " << cmd.str() << endl; return; }
+
+						recording.reset(new FrameCapture(currentW, currentH, ffmpeg, recordingPolicy));
+					}
+					else {
+						recording.reset();
+						if (!GlewGlut::headless()) { glutSetWindowTitle("Fractal"); }
+					}
 				}
-				else {
-					pclose(ffmpeg);
-					recording = false;
+			}
+		}
+	},
+	{
+		'G' ,
+		{
+			"Switches between dropping frames and slowing down when the recording falls behind",
+			[](bool down) {
+				if (down) {
+					recordingPolicy = recordingPolicy == FrameQueue::Drop ? FrameQueue::Block : FrameQueue::Drop;
+					cout << "recording " << (recordingPolicy == FrameQueue::Drop ? "drops frames" : "slows down") << " when it falls behind"
+						<< (recording ? ", from the next recording" : "") << endl;
 				}
 			}
 		}
 	}
 };
 
-void keyboard(unsigned char key, int x, int y) {
-
-	auto function = keys.find(key);
-	if (function != keys.end()) {
-		function->second.function();
-	}
-}
-
 void keyboardSpecial(int key, int x, int y) {
 
 }
@@ -518,7 +689,10 @@ void reshape(GLsizei w, GLsizei h) {
 	currentW = w;
 	currentH = h;
 	glViewport(0, 0, w, h);
+	target.resize(w, h);
+	resizeCones(w, h);
 	glUniform1f(uniform_ratio, currentW / (float)currentH);
+	markDirty();
 	display();
 }
 
@@ -526,7 +700,8 @@ void mouseMove(int x, int y) {
 
 	camera.horzRot(-0.001*(x - mouseLastX));
 	camera.vertRot(-0.001*(y - mouseLastY));
-	camera.updateUniforms();
+	updateUniforms(camera);
+	markDirty();
 	mouseLastX = x;
 	mouseLastY = y;
 }
@@ -541,20 +716,40 @@ void mouseClick(int button, int state, int x, int y) {
 
 int main(int argc, char *argv[])
 {
-	cout << "Keys : " << endl;
-	for (const auto& key : keys) {
-		cout << " '" << key.first << "' " << key.second.description << endl;
+	TRACE_THREAD("main");
+	GlewGlut::callbacks.animating = animating;
+	GlewGlut::callbacks.update = updateCache; // each headless frame with the distance cache of its order
+	GlewGlut::callbacks.quit = []() { recording.reset(); };
+
+	// the options before glut's, which needs a display
+	GlewGlut::params.dynamicResolution = true;
+	GlewGlut::params.parseArguments(argc, argv);
+	GlewGlut::keys.insert(keys.begin(), keys.end());
+	GlewGlut::setup();
+
+	if (GlewGlut::headless()) {
+		currentW = GlewGlut::params.headless.w;
+		currentH = GlewGlut::params.headless.h;
+		GlewGlut::HeadlessHandlers handlers;
+		handlers.display = display;
+		handlers.reshape = reshape;
+		handlers.keyboard = GlewGlut::keyboard;
+		handlers.keyboardUp = GlewGlut::keyboardUp;
+		handlers.mouseMove = mouseMove;
+		handlers.mouseClick = mouseClick;
+		GlewGlut::runHeadless(handlers, init);
 	}
 
 	glutInit(&argc, argv);
 
 	glutInitWindowSize(currentW, currentH);
 
-	windowId = glutCreateWindow("Fractal");
+	GlewGlut::windowId = glutCreateWindow("Fractal");
 
 	glutDisplayFunc(display);
-	glutIdleFunc(idle);
-	glutKeyboardFunc(keyboard);
+	glutIdleFunc(GlewGlut::idle);
+	glutKeyboardFunc(GlewGlut::keyboard);
+	glutKeyboardUpFunc(GlewGlut::keyboardUp);
 	glutSpecialFunc(keyboardSpecial);
 	glutReshapeFunc(reshape);
 	glutMotionFunc(mouseMove);
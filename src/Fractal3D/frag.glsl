@@ -13,9 +13,29 @@ float focal = 1.0;
 // fractal order
 uniform float order = 8.0;
 
+// powN() of the program's order, appended by Fractal3D : trig-free for the integer orders (see Estimators.h)
+void powOrder(float p, inout vec3 z, float zr0, inout float dr);
+
 // MatCap shading
 uniform sampler2D matCap;
 
+// DistanceCache : lower bounds of the distance at the nodes of a coarse grid, and of the bricks refining its cells
+uniform bool cached = false;
+uniform sampler3D cacheCoarse;
+uniform sampler3D cacheIndirection; // brick's origin in the atlas, or -1
+uniform sampler3D cacheBricks; // atlas
+uniform float cacheExtent = 2.0;
+uniform int cacheCells = 16;
+uniform int cacheBrickSize = 8;
+uniform int maxCachedSteps = 256; // they don't count in the estimator's steps
+
+// cone marching pre-passes : a pass per block size, coarsest first, writes the depth where a cone holding the
+// rays of each block meets the fractal, from the depth of the coarser pass ; the shading pass starts from them
+uniform int coneBlock = 0; // pixels per side of this pass's blocks, 0 for the shading pass
+uniform int coneParent = 0; // of the previous pass, 0 without it
+uniform sampler2D coneDepths; // of the previous pass
+uniform vec2 coneResolution; // of the shading pass
+
 out vec4 color;
 
 // Nylander's power formula
@@ -43,7 +63,7 @@ float dist(vec3 c) {
 
 	for(int i = 0; i < 16; i++) {
 
-		powN(order, z, r, dr);
+		powOrder(order, z, r, dr);
 
 		z += c;
 
@@ -66,27 +86,88 @@ vec3 fracNormal(vec3 z, float step) {
 	));
 }
 
+// lower bound from the 8 corners of a cell, 'local' being the position in it
+float cornersBound(sampler3D nodes, ivec3 cell, vec3 local, float size) {
+
+	float bound = 0.0;
+	for(int c = 0; c < 8; c++) {
+		ivec3 corner = ivec3(c & 1, (c >> 1) & 1, c >> 2);
+		bound = max(bound, texelFetch(nodes, cell + corner, 0).r - length(local - vec3(corner)) * size);
+	}
+	return bound;
+}
+
+// lower bound of the distance to the fractal
+float cacheBound(vec3 p) {
+
+	vec3 outside = abs(p) - vec3(cacheExtent);
+	if(any(greaterThan(outside, vec3(0.0)))) { return length(max(outside, 0.0)); }
+
+	float cellSize = 2.0 * cacheExtent / cacheCells;
+	vec3 g = (p + vec3(cacheExtent)) / cellSize;
+	ivec3 cell = min(ivec3(g), ivec3(cacheCells - 1));
+	vec3 brick = texelFetch(cacheIndirection, cell, 0).xyz;
+	if(brick.x < 0.0) { return cornersBound(cacheCoarse, cell, g - vec3(cell), cellSize); }
+
+	vec3 f = (g - vec3(cell)) * cacheBrickSize;
+	ivec3 fineCell = min(ivec3(f), ivec3(cacheBrickSize - 1));
+	return cornersBound(cacheBricks, ivec3(brick) + fineCell, f - vec3(fineCell), cellSize / cacheBrickSize);
+}
+
+// depth from 'depth' along the axis 'dir' of a cone of tangent 'spread', up to which its rays are out of the
+// fractal : around the axis at the depth t, the ball of the estimated distance holds them once shrunk by t * spread
+float coneDepth(vec3 pos, vec3 dir, float depth, float spread, float maxDist) {
+
+	for(int i = 0; i < 32; i++) {
+		float step = dist(pos) - depth * spread;
+		if(step < 0.1 * depth * spread || step < 0.000001) { break; }
+		depth += step;
+		pos += step * dir;
+		if(depth > maxDist) { break; }
+	}
+	return min(depth, maxDist);
+}
+
 void main() {
 
+	// the center of the block in the cone passes
+	vec2 screen = coneBlock > 0 ? 2.0 * gl_FragCoord.xy * coneBlock / coneResolution - 1.0 : position;
+
 	// direction of the ray
-	vec3 dir = normalize(
-		focal * camDir // fisheye -> * (1-0.5*length(vec2( ratio * position.x, position.y)))
-		+ ratio * position.x * camLeft
-		+ position.y * camUp
-	);
-	vec3 pos = camPos; // variable position of the ray marching
-	float depth = 0.0; // distance from surface
+	vec3 axis = focal * camDir // fisheye -> * (1-0.5*length(vec2( ratio * screen.x, screen.y)))
+		+ ratio * screen.x * camLeft
+		+ screen.y * camUp;
+	vec3 dir = normalize(axis);
+
+	float maxDist = 32 * dist(camPos); // distance before stopping ray-marching
+
+	// distance from the camera, from the coarser pass's block holding this pixel
+	float depth = coneParent > 0 ? texelFetch(coneDepths, ivec2(gl_FragCoord.xy) * max(coneBlock, 1) / coneParent, 0).r : 0.0;
+
+	if(coneBlock > 0) {
+		// half the block's diagonal on the screen, over the axis : the sine of the cone's half angle, at most
+		float sine = min(0.99, length(vec2(ratio, 1.0) * coneBlock / coneResolution * 2.0) * 0.5 / length(axis));
+		color = vec4(coneDepth(camPos + depth * dir, dir, depth, sine / sqrt(1.0 - sine * sine), maxDist), 0.0, 0.0, 1.0);
+		return;
+	}
+
+	vec3 pos = camPos + depth * dir; // variable position of the ray marching
 
 	float minStep = 0.000001; // minimal step before stopping ray-marching
 	float step; // adaptive step for ray-marching
 
-	float maxDist = 32 * dist(camPos); // distance before stopping ray-marching
-
 	bool background = false; // is it a background pixel
 
-	for(int i = 0; i < 32; i++) {
+	float cacheMinStep = cacheExtent / (cacheCells * cacheBrickSize); // half a fine cell
+	int cachedSteps = 0;
+
+	for(int i = 0; i < 32; ) {
 
-		step = dist(pos);
+		// the cache's bound while it is large enough, else the estimator
+		step = 0.0;
+		if(cached && cachedSteps < maxCachedSteps) { step = cacheBound(pos); }
+		if(cached && step >= cacheMinStep) { cachedSteps++; }
+		else { step = dist(pos); i++; }
 		depth += step;
 		pos += step * dir;
 		background = depth > maxDist;
@@ -0,0 +1,478 @@
+
+// Headless CPU renderer of Fractal3D's Mandelbulb, for reference images and offline renders without a GPU
+
+#include "../Fractal3D/FractalRayMarcher.h"
+#include <FrameQueue.h>
+#include <DynamicResolution.h>
+
+#include <stdlib.h>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+
+// fractalDist() in double precision
+double fractalDistDouble( int order, const Vec3& c, int iterations )
+{
+	double x = c.x, y = c.y, z = c.z, dr = 1, r = sqrt( x * x + y * y + z * z );
+	for( int i = 0; i < iterations; i++ )
+	{
+		const double theta = asin( z / r ) * order, phi = atan2( y, x ) * order, rn = pow( r, order - 1 );
+		dr = rn * dr * order + 1;
+		x = rn * r * cos( theta ) * cos( phi ) + c.x;
+		y = rn * r * cos( theta ) * sin( phi ) + c.y;
+		z = rn * r * sin( theta ) + c.z;
+		r = sqrt( x * x + y * y + z * z );
+		if( r > 2 ) { break; }
+	}
+	return 0.5 * log( r ) * r / dr;
+}
+
+// compares the trig-free estimators with fractalDist(), then times both in iterations/s
+int checkEstimators( int iterations )
+{
+	mt19937 random( 0 );
+	uniform_real_distribution<float> coordinate( -1.5f, 1.5f );
+	vector<Vec3> points( 1 << 14 );
+	for( Vec3& p : points ) { p = Vec3{ coordinate( random ), coordinate( random ), coordinate( random ) }; }
+	// close to the z axis, where rho^n underflows for the high orders
+	uniform_real_distribution<float> nearAxis( -2e-3f, 2e-3f );
+	vector<Vec3> axisPoints( 1 << 12 );
+	for( Vec3& p : axisPoints ) { p = Vec3{ nearAxis( random ), nearAxis( random ), coordinate( random ) }; }
+
+	int failures = 0;
+	for( int order = 2; order <= Estimators::maxOrder; order++ )
+	{
+		const Estimators::Function specialized = Estimators::specialized( float( order ) );
+
+		// relative errors, out of the points where the iterations get chaotic and both take different paths
+		auto sortedErrors = [&]( const vector<Vec3>& from, bool doubleReference ) {
+			vector<float> errors;
+			for( const Vec3& p : from )
+			{
+				const float ref = doubleReference ? float( fractalDistDouble( order, p, iterations ) ) : fractalDist( float( order ), p, iterations );
+				const float d = specialized( p, iterations );
+				errors.push_back( fabsf( d - ref ) / std::max( fabsf( ref ), 1e-3f ) );
+			}
+			sort( errors.begin(), errors.end() );
+			return errors;
+		};
+		// near the axis, the float asin and atan2 of fractalDist() are less precise than the estimators
+		const vector<float> errors = sortedErrors( points, false ), axisErrors = sortedErrors( axisPoints, true );
+		const float median = errors[errors.size() / 2], p99 = errors[errors.size() * 99 / 100];
+		const float axisMedian = axisErrors[axisErrors.size() / 2], axisMax = axisErrors.back();
+		const bool ok = p99 < 1e-3f && axisMedian < 1e-5f && isfinite( axisMax );
+		failures += !ok;
+
+		// on the points whose orbits stay bounded, every call makes all the iterations
+		vector<Vec3> bounded;
+		for( const Vec3& c : points )
+		{
+			Vec3 z = c;
+			float dr = 1, r = z.norm();
+			int i = 0;
+			for( ; i < iterations && r <= 2; i++ ) { powN( float( order ), z, r, dr ); z = z + c; r = z.norm(); }
+			if( i == iterations && r <= 2 ) { bounded.push_back( c ); }
+		}
+		double seconds[2] = { 0, 0 };
+		volatile float sum = 0; // keeps the calls
+		for( int trigFree = 0; trigFree < 2; trigFree++ )
+		{
+			auto start = chrono::steady_clock::now();
+			for( int repeat = 0; repeat < 8; repeat++ )
+				for( const Vec3& c : bounded ) { sum += trigFree ? specialized( c, iterations ) : fractalDist( float( order ), c, iterations ); }
+			seconds[trigFree] = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+		}
+		const double count = 8.0 * bounded.size() * iterations;
+		cout << "order " << order << " : relative error median " << median << ", 99th percentile " << p99
+			<< " ; near the z axis median " << axisMedian << ", max " << axisMax << ( ok ? "" : " FAILED" )
+			<< " ; " << count / seconds[0] / 1e6 << " M iterations/s with trigonometry, " << count / seconds[1] / 1e6
+			<< " M trig-free (" << seconds[0] / seconds[1] << "x)" << endl;
+	}
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// feeds FrameQueues with synthetic frames faster than their writer consumes them, with both policies, and checks
+// that the frames are written whole, in order, and counted
+int checkCapture( int frames )
+{
+	int failures = 0;
+	for( FrameQueue::Policy policy : { FrameQueue::Drop, FrameQueue::Block } )
+	{
+		const unsigned w = 64, h = 32;
+		const size_t capacity = 4;
+		size_t written = 0, corrupted = 0, lastIndex = 0;
+		bool ordered = true, rejected = false;
+		auto start = chrono::steady_clock::now();
+		FrameQueue::Stats stats;
+		{
+			FrameQueue queue( [&]( const Frame& frame ) {
+				// the writer thread, slower than the source
+				this_thread::sleep_for( chrono::milliseconds( 2 ) );
+				for( uchar p : frame.pixels ) { corrupted += p != uchar( frame.index ); }
+				ordered = ordered && ( written == 0 || frame.index > lastIndex );
+				lastIndex = frame.index;
+				written++;
+			}, capacity, policy );
+
+			for( int f = 0; f < frames; f++ )
+			{
+				FramePtr frame = queue.acquire( w, h );
+				fill( frame->pixels.begin(), frame->pixels.end(), uchar( f ) ); // push() numbers the frames in order
+				queue.push( move( frame ) );
+				this_thread::sleep_for( chrono::milliseconds( 1 ) );
+			}
+			queue.close();
+			rejected = !queue.push( queue.acquire( w, h ) ); // the writer has exited
+			stats = queue.getStats();
+		}
+		const double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+
+		const bool ok = ordered && corrupted == 0 && written == stats.written && stats.pushed == size_t( frames ) + 1
+			&& stats.written + stats.dropped == stats.pushed && stats.maxDepth <= capacity
+			&& stats.allocations <= capacity + 2 // the queued frames, the written one and the pushed one
+			&& rejected && ( policy == FrameQueue::Drop ? stats.dropped > 1 : stats.dropped == 1 );
+		failures += !ok;
+		cout << ( policy == FrameQueue::Drop ? "drop" : "block" ) << " policy in " << 1000 * seconds << " ms : ";
+		stats.print( cout );
+		if( !ok ) { cout << "FAILED : " << corrupted << " corrupted bytes, " << ( ordered ? "" : "not " ) << "in order, "
+			<< ( rejected ? "" : "not " ) << "rejected once closed" << endl; }
+	}
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// drives a DynamicResolution with simulated frame times, late of 2 frames and noisy as GPU timings, through
+// changes of the scene's cost and an idle camera : no rendering, no asset
+int checkResolution()
+{
+	DynamicResolution resolution;
+	mt19937 random( 0 );
+	uniform_real_distribution<float> noise( 0.95f, 1.05f );
+	const int lag = 2;
+	vector<float> scales; // of the frames rendered
+	int failures = 0;
+
+	struct Phase { const char* name; int frames; float fullMs; bool idle; };
+	const Phase phases[] = {
+		{ "light scene", 200, 10, false }, // fits at full resolution
+		{ "heavy scene", 200, 40, false },
+		{ "heavier scene", 200, 120, false }, // a quarter of the pixels would still take 7.5 ms
+		{ "idle camera", 100, 120, true },
+		{ "moving again", 200, 40, false },
+		{ "out of reach", 100, 1000, false }, // over the budget even at minScale
+	};
+	for( const Phase& phase : phases )
+	{
+		resolution.idle = phase.idle;
+		double sumMs = 0, sumScale = 0;
+		int timed = 0, reversals = 0;
+		float lastStep = 0;
+		for( int f = 0; f < phase.frames; f++ )
+		{
+			const float before = resolution.scale;
+			scales.push_back( resolution.current() );
+			const size_t rendered = scales.size() - 1;
+			if( rendered >= size_t( lag ) )
+			{
+				const float s = scales[rendered - lag];
+				resolution.update( phase.fullMs * ( 0.05f + 0.95f * s * s ) * noise( random ), s );
+			}
+			// once settled, the frames' times and the scale's reversals
+			const float step = resolution.scale - before;
+			if( f >= 50 )
+			{
+				const float s = resolution.current();
+				sumMs += phase.fullMs * ( 0.05f + 0.95f * s * s );
+				sumScale += s;
+				timed++;
+				reversals += !phase.idle && step * lastStep < 0; // while idle, the scale shown is maxScale
+			}
+			if( step != 0 ) { lastStep = step; }
+		}
+		const double meanMs = sumMs / timed, meanScale = sumScale / timed;
+		const bool reachable = phase.fullMs * ( 0.05f + 0.95f * resolution.minScale * resolution.minScale ) <= resolution.budgetMs;
+		const bool ok = phase.idle ? meanScale == resolution.maxScale
+			: !reachable ? meanScale <= resolution.minScale * 1.01
+			: phase.fullMs <= resolution.budgetMs ? meanScale >= resolution.maxScale * 0.99
+			: meanMs < resolution.budgetMs * 1.15 && meanMs > resolution.budgetMs * 0.75 && reversals <= timed / 10;
+		failures += !ok;
+		cout << phase.name << " (" << phase.fullMs << " ms at full resolution) : " << meanMs << " ms at the scale "
+			<< meanScale << ", " << reversals << " reversals" << ( ok ? "" : " FAILED" ) << endl;
+	}
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// the same loop on this renderer's frames, rendered without delay : a demonstration, their times depend on the machine
+void resolutionOnFrames( const FractalRayMarcher& marcher, const Camera& camera, unsigned w, unsigned h, unsigned threads )
+{
+	DynamicResolution resolution;
+	FractalRayMarcher frameMarcher = marcher;
+	const float fullMs = 1000 * ( frameMarcher.render( camera, w, h, threads ), float( frameMarcher.stats.seconds ) );
+	resolution.budgetMs = fullMs / 4;
+	float ms = 0;
+	for( int f = 0; f < 40; f++ )
+	{
+		const float s = resolution.current();
+		frameMarcher.render( camera, unsigned( resolution.size( int( w ) ) ), unsigned( resolution.size( int( h ) ) ), threads );
+		ms = 1000 * float( frameMarcher.stats.seconds );
+		resolution.update( ms, s );
+	}
+	cout << "rendered frames : " << fullMs << " ms at full resolution, " << ms << " ms at the scale " << resolution.scale
+		<< " for a budget of " << resolution.budgetMs << " ms" << endl;
+}
+
+// "frame.png" -> "frame%05d.png", for the numbered images of a path
+string framePattern( const string& out )
+{
+	if( out.find( '%' ) != string::npos ) { return out; }
+	const size_t dot = out.rfind( '.' );
+	return dot == string::npos ? out + "%05d" : out.substr( 0, dot ) + "%05d" + out.substr( dot );
+}
+
+string frameFileName( const string& pattern, int frame )
+{
+	vector<char> name( pattern.size() + 32 );
+	snprintf( name.data(), name.size(), pattern.c_str(), frame );
+	return name.data();
+}
+
+// Renders the frames of a path recorded by Fractal3D, as fast as the cores go. Into numbered images, a frame
+// per core at a time, this process taking the frames 'offset', 'offset + stride'... so that several machines can
+// share a path ; with 'resume', the images already there are skipped. Or into a raw RGBA stream (top row
+// first, e.g. for ffmpeg -f rawvideo -pix_fmt rgba -s WxH -i out.rgba), in order, the frames being
+// written by a FrameQueue while the next ones render ; with 'resume', it goes on after the last whole frame.
+int renderPath( const FractalRayMarcher& marcher, const CameraPath& path, int frames, unsigned w, unsigned h,
+	unsigned threads, const string& out, bool resume, int stride, int offset )
+{
+	auto start = chrono::steady_clock::now();
+	auto cameraAt = [&]( int frame ) { return path.at( frames > 1 ? path.length() * frame / ( frames - 1 ) : 0 ); };
+	const size_t frameSize = size_t( w ) * h * 4;
+	const string extension = out.size() > 5 ? out.substr( out.size() - 5 ) : "";
+	int rendered = 0, skipped = 0;
+	size_t evaluations = 0, pixels = 0;
+
+	if( extension == ".rgba" )
+	{
+		if( stride != 1 ) { cerr << "a raw stream is written by a single process" << endl; return EXIT_FAILURE; }
+		int first = 0;
+		if( resume )
+		{
+			ifstream existing( out, ios::binary | ios::ate );
+			if( existing.is_open() ) { first = std::min( frames, int( size_t( existing.tellg() ) / frameSize ) ); }
+		}
+		fstream file( out, first > 0 ? ios::binary | ios::in | ios::out : ios::binary | ios::out | ios::trunc );
+		if( !file.is_open() ) { cerr << "error when writing " << out << endl; return EXIT_FAILURE; }
+		file.seekp( first * frameSize );
+		skipped = first;
+
+		FrameQueue queue( [&file]( const Frame& frame ) {
+			file.write( (const char*)frame.pixels.data(), frame.size() );
+		}, 4, FrameQueue::Block );
+		FractalRayMarcher frameMarcher = marcher;
+		for( int f = first; f < frames; f++, rendered++ )
+		{
+			FramePtr frame = queue.acquire( w, h );
+			frameMarcher.render( cameraAt( f ), w, h, frame->pixels, threads ); // the tiles on all the cores
+			evaluations += frameMarcher.stats.evaluations;
+			pixels += frameMarcher.stats.pixels;
+			queue.push( move( frame ) );
+		}
+		queue.close();
+		if( !file.good() ) { cerr << "error when writing " << out << endl; return EXIT_FAILURE; }
+	}
+	else
+	{
+		const string pattern = framePattern( out );
+		vector<int> todo;
+		for( int f = offset; f < frames; f += stride )
+		{
+			if( resume && ifstream( frameFileName( pattern, f ) ).is_open() ) { skipped++; }
+			else { todo.push_back( f ); }
+		}
+
+		// a frame per core, each with its own marcher for the statistics
+		const unsigned workers = threads ? threads : Parallel::threadCount();
+		vector<FractalRayMarcher> marchers( workers, marcher );
+		vector<size_t> workerEvaluations( workers, 0 ), workerPixels( workers, 0 );
+		int failures = 0;
+		mutex outMutex;
+		Parallel::forEach( todo.size(), [&]( size_t index, unsigned worker ) {
+			const int f = todo[index];
+			const vector<uchar> image = marchers[worker].render( cameraAt( f ), w, h, 1 );
+			workerEvaluations[worker] += marchers[worker].stats.evaluations;
+			workerPixels[worker] += marchers[worker].stats.pixels;
+
+			// renamed once whole, so that an interrupted render resumes from the last whole image
+			const string fileName = frameFileName( pattern, f ), part = fileName + ".part";
+			unsigned error = lodepng::encode( part, image, w, h );
+			lock_guard<mutex> lock( outMutex );
+			if( error )
+			{
+				cerr << "error when writing " << part << " " << lodepng_error_text( error ) << endl;
+				failures++;
+			}
+			else if( rename( part.c_str(), fileName.c_str() ) != 0 )
+			{
+				cerr << "error when renaming " << part << " to " << fileName << " : " << strerror( errno ) << endl;
+				failures++;
+			}
+			else { rendered++; }
+		}, workers );
+		if( failures ) { return EXIT_FAILURE; }
+		for( unsigned t = 0; t < workers; t++ ) { evaluations += workerEvaluations[t]; pixels += workerPixels[t]; }
+	}
+
+	const double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+	cout << rendered << " frames rendered, " << skipped << " skipped in " << seconds << " s : " << rendered / seconds
+		<< " frames/s, " << double( evaluations ) / std::max( pixels, size_t( 1 ) ) << " distance evaluations per pixel" << endl;
+	return EXIT_SUCCESS;
+}
+
+int main( int argc, char* argv[] )
+{
+	TRACE_THREAD( "main" );
+	unordered_map<string, string> args = {
+		{ "width", "800" },
+		{ "height", "600" },
+		{ "order", "8" },
+		{ "posX", "0.5" }, // Fractal3D's starting camera
+		{ "posY", "-1.5" },
+		{ "posZ", "0" },
+		{ "dirX", "0" },
+		{ "dirY", "1" },
+		{ "dirZ", "0" },
+		{ "iterations", "16" }, // of the distance estimator, as frag.glsl
+		{ "steps", "32" }, // of the sphere tracing, as frag.glsl
+		{ "threads", "0" },
+		{ "tile", "16" },
+		{ "frames", "1" }, // renders the image several times, to time it
+		{ "cache", "0" }, // steps by the bounds of a DistanceCache, then compares with the plain marching
+		{ "cacheCells", "16" },
+		{ "cacheBrick", "8" },
+		{ "cones", "0" }, // starts the rays from the depths of cone marching pre-passes at 1/8 and 1/4 resolution, then compares
+		{ "trigFree", "1" }, // trig-free estimators for the integer orders
+		{ "estimators", "0" }, // validates and benchmarks the trig-free estimators, then exits
+		{ "captureCheck", "0" }, // checks the frame capture's queue with this many synthetic frames, then exits
+		{ "resolutionCheck", "0" }, // checks the dynamic resolution's controller on simulated times (1), then on rendered frames too (2), then exits
+		{ "path", "" }, // renders the frames of a camera path recorded by Fractal3D (camRecord.txt)
+		{ "pathFrames", "0" }, // 0 : as Fractal3D plays the path back, 100 frames between two recorded cameras
+		{ "resume", "0" }, // skips the frames of the path already rendered
+		{ "stride", "1" }, // this process renders the frames offset, offset + stride... of the path
+		{ "offset", "0" },
+		{ "matcap", "matcap.png" },
+		{ "out", "fractal.png" }, // with a path, a pattern as frame%05d.png, or a raw stream if it ends with .rgba
+	};
+	for( int i = 1; i + 1 < argc; i += 2 )
+	{
+		string key = argv[i];
+		if( key.size() < 3 || key.substr( 0, 2 ) != "--" || args.find( key.substr( 2 ) ) == args.end() )
+		{
+			cerr << "unknown option " << key << endl << "Options (with their default) : " << endl;
+			for( const auto& arg : args ) { cerr << " --" << arg.first << " " << arg.second << endl; }
+			return EXIT_FAILURE;
+		}
+		args[key.substr( 2 )] = argv[i + 1];
+	}
+
+	if( args["estimators"] == "1" ) { return checkEstimators( stoi( args["iterations"] ) ); }
+	if( stoi( args["captureCheck"] ) > 0 ) { return checkCapture( stoi( args["captureCheck"] ) ); }
+	if( args["resolutionCheck"] == "1" ) { return checkResolution(); }
+
+	Image matCap( args["matcap"] );
+	Camera camera(
+		{ stof( args["posX"] ), stof( args["posY"] ), stof( args["posZ"] ) },
+		Vec3{ stof( args["dirX"] ), stof( args["dirY"] ), stof( args["dirZ"] ) }.normalize()
+	);
+
+	FractalRayMarcher marcher( matCap );
+	marcher.order = stof( args["order"] );
+	marcher.iterations = stoi( args["iterations"] );
+	marcher.steps = stoi( args["steps"] );
+	marcher.trigFree = args["trigFree"] == "1";
+	marcher.tileSize = std::max( 1, stoi( args["tile"] ) );
+	if( args["cones"] == "1" ) { marcher.coneBlocks = { 8, 4 }; }
+
+	const unsigned w = stoi( args["width"] ), h = stoi( args["height"] ), threads = stoi( args["threads"] );
+	if( args["resolutionCheck"] == "2" )
+	{
+		const int result = checkResolution();
+		resolutionOnFrames( marcher, camera, w, h, threads );
+		return result;
+	}
+	if( !args["path"].empty() )
+	{
+		const CameraPath path( args["path"] );
+		if( path.empty() ) { cerr << "no camera in " << args["path"] << endl; return EXIT_FAILURE; }
+		const int stride = std::max( 1, stoi( args["stride"] ) ), offset = stoi( args["offset"] );
+		const int frames = stoi( args["pathFrames"] ) > 0 ? stoi( args["pathFrames"] ) : int( path.length() * 100 ) + 1;
+		if( offset < 0 || offset >= stride ) { cerr << "the offset must be in [0;stride)" << endl; return EXIT_FAILURE; }
+		unique_ptr<DistanceCache> cache;
+		if( args["cache"] == "1" )
+		{
+			cache.reset( new DistanceCache( marcher.order, marcher.iterations, stoi( args["cacheCells"] ), stoi( args["cacheBrick"] ), threads ) );
+			marcher.cache = cache.get();
+		}
+		return renderPath( marcher, path, frames, w, h, threads, args["out"], args["resume"] == "1", stride, offset );
+	}
+
+	const int frames = std::max( 1, stoi( args["frames"] ) );
+	auto render = [&]() {
+		vector<uchar> image;
+		double best = 0;
+		for( int f = 0; f < frames; f++ )
+		{
+			image = marcher.render( camera, w, h, threads );
+			if( f == 0 || marcher.stats.seconds < best ) { best = marcher.stats.seconds; }
+		}
+		marcher.stats.seconds = best;
+		marcher.stats.print( cout );
+		return image;
+	};
+
+	unique_ptr<DistanceCache> cache;
+	if( args["cache"] == "1" )
+	{
+		cache.reset( new DistanceCache( marcher.order, marcher.iterations, stoi( args["cacheCells"] ), stoi( args["cacheBrick"] ), threads ) );
+		cache->stats.print( cout );
+		marcher.cache = cache.get();
+	}
+	vector<uchar> image = render();
+	if( marcher.cache || !marcher.coneBlocks.empty() )
+	{
+		const FractalRayMarcher::Stats stats = marcher.stats;
+
+		marcher.cache = NULL;
+		marcher.coneBlocks.clear();
+		vector<uchar> refImage = render();
+		int maxDiff = 0;
+		double meanDiff = 0;
+		size_t differing = 0;
+		for( size_t i = 0; i < image.size(); i++ )
+		{
+			int diff = abs( int( image[i] ) - refImage[i] );
+			maxDiff = std::max( maxDiff, diff );
+			meanDiff += diff;
+			differing += diff > 8;
+		}
+		cout << "difference with the plain marching : max " << maxDiff << ", mean " << meanDiff / image.size()
+			<< ", " << 100.0 * differing / image.size() << "% of the channels by more than 8 ; "
+			<< double( marcher.stats.evaluations ) / stats.evaluations << "x fewer distance evaluations, "
+			<< marcher.stats.seconds / stats.seconds << "x faster" << endl;
+	}
+
+	unsigned error = lodepng::encode( args["out"], image, w, h );
+	if( error ) { cerr << "error when writing " << args["out"] << " " << lodepng_error_text( error ) << endl; return EXIT_FAILURE; }
+	cout << "wrote " << args["out"] << endl;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+// Paces the main loop : wait() sleeps until the next frame's deadline instead of polling a millisecond clock.
+// The deadlines are a period apart whatever the frames cost, so that the pace stays even ; a frame later than a
+// whole period moves them rather than being caught up by a burst. Sleeps overshoot by up to the scheduler's
+// tick : the last 'slackMs' before a deadline yield instead. A rate of 0 leaves the frames uncapped.
+// A benchmark times the intervals between a number of frames, then reports their min, average and 99th percentile.
+// No GL here : the loop calls wait() before posting a frame, and shown() once it is on screen.
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <math.h>
+
+// "<n> frames<what> : " then the min, average, 99th percentile and max of 'times', in ms
+inline void printFrameTimes(std::ostream& out, std::vector<float> times, const std::string& what) {
+
+	if (times.empty()) { out << "no frame timed" << std::endl; return; }
+	std::sort(times.begin(), times.end());
+	float sum = 0;
+	for (float t : times) { sum += t; }
+	const float avg = sum / times.size();
+	const size_t p99 = size_t(ceil(0.99 * times.size())) - 1; // nearest rank
+	out << times.size() << " frames" << what << " : min " << times.front() << " ms, avg " << avg << " ms ("
+		<< 1000 / avg << " fps), p99 " << times[p99] << " ms, max " << times.back() << " ms" << std::endl;
+}
+
+struct FramePacer {
+
+	typedef std::chrono::steady_clock Clock;
+
+	float rate = 60; // frames per second, 0 for uncapped
+	float slackMs = 1; // before a deadline, spent yielding rather than sleeping
+	size_t benchmarkFrames = 0; // frames timed by the benchmark, none when 0
+
+	// sleeps until the next frame is due
+	void wait() {
+
+		const Clock::time_point now = Clock::now();
+		if (rate <= 0) { next = now; return; }
+		const Clock::duration period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1 / rate));
+		if (next + period < now) { next = now; } // too late to keep to the deadlines : starts them over
+
+		const Clock::duration slack = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(slackMs / 1000));
+		if (next - slack > now) { std::this_thread::sleep_until(next - slack); }
+		while (Clock::now() < next) { std::this_thread::yield(); }
+		next += period;
+	}
+
+	// a frame reached the screen
+	void shown() {
+
+		const Clock::time_point now = Clock::now();
+		if (frames > 0 && benchmarking()) { times.push_back(std::chrono::duration<float, std::milli>(now - last).count()); }
+		last = now;
+		frames++;
+	}
+
+	// the benchmark is timing frames : they are all due
+	inline bool benchmarking() const { return benchmarkFrames > 0 && times.size() < benchmarkFrames; }
+
+	// the benchmark timed all its frames
+	inline bool benchmarked() const { return benchmarkFrames > 0 && times.size() >= benchmarkFrames; }
+
+	void print(std::ostream& out) const {
+		printFrameTimes(out, times, rate > 0 ? " paced at " + std::to_string(int(rate)) + " Hz" : std::string(" uncapped"));
+	}
+
+private:
+	Clock::time_point next, last;
+	size_t frames = 0;
+	std::vector<float> times; // between consecutive frames, in ms
+};
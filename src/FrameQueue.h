@@ -0,0 +1,202 @@
+#pragma once
+
+// Bounded queue of captured frames, drained by a writer thread, so that a slow consumer (an encoder's pipe,
+// the disk) doesn't stall the rendering. The frames' buffers are recycled by a pool : once the pipeline is full,
+// capturing allocates nothing. When the queue is full, push() either drops the new frame or waits for room,
+// as chosen by the Policy. No GL here : the readback is the application's business.
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+
+#include "Trace.h"
+
+struct Frame {
+	std::vector<unsigned char> pixels; // RGBA, as read back
+	unsigned w = 0, h = 0;
+	size_t index = 0; // in the order of capture
+
+	inline size_t size() const { return size_t( w ) * h * 4; }
+};
+
+typedef std::unique_ptr<Frame> FramePtr;
+
+// reusable frames, shared between the producer and the writer
+class FramePool {
+	std::mutex mutex;
+	std::vector<FramePtr> frames;
+	size_t allocated = 0;
+public:
+	// a frame of w x h pixels, recycled when possible
+	FramePtr acquire( unsigned w, unsigned h )
+	{
+		FramePtr frame;
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			if( !frames.empty() ) { frame = std::move( frames.back() ); frames.pop_back(); }
+			else { allocated++; }
+		}
+		if( !frame ) { frame.reset( new Frame() ); }
+		frame->w = w;
+		frame->h = h;
+		frame->pixels.resize( frame->size() );
+		return frame;
+	}
+
+	void release( FramePtr frame )
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		frames.push_back( std::move( frame ) );
+	}
+
+	// frames created since the start, in use or not
+	size_t allocations()
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		return allocated;
+	}
+};
+
+class FrameQueue {
+public:
+	enum Policy {
+		Drop, // a frame pushed into a full queue is dropped : the rendering never waits
+		Block // push() waits for room : every frame is written, at the consumer's pace
+	};
+
+	struct Stats {
+		size_t pushed = 0, written = 0, dropped = 0;
+		size_t depth = 0, maxDepth = 0; // of the queue, in frames
+		size_t allocations = 0; // of the pool
+		double blockedSeconds = 0; // waited by push() for room
+
+		void print( std::ostream& out ) const
+		{
+			out << pushed << " frames captured, " << written << " written, " << dropped << " dropped ; queue depth "
+				<< depth << " (max " << maxDepth << "), " << allocations << " frame buffers, "
+				<< 1000 * blockedSeconds << " ms blocked" << std::endl;
+		}
+	};
+
+	typedef std::function<void( const Frame& frame )> Writer;
+
+	FramePool pool;
+
+	// starts the writer thread, which calls 'writer' on each frame in order
+	FrameQueue( const Writer& writer, size_t capacity = 8, Policy policy = Drop )
+		: writer( writer ), capacity( std::max( capacity, size_t( 1 ) ) ), policy( policy )
+	{
+		thread = std::thread( [this]() { drain(); } );
+	}
+
+	~FrameQueue() { close(); }
+
+	FrameQueue( const FrameQueue& ) = delete;
+	FrameQueue& operator=( const FrameQueue& ) = delete;
+
+	inline FramePtr acquire( unsigned w, unsigned h ) { return pool.acquire( w, h ); }
+
+	// queues a frame from acquire() ; false if it has been dropped, as every frame pushed once closed
+	bool push( FramePtr frame )
+	{
+		std::unique_lock<std::mutex> lock( mutex );
+		frame->index = stats.pushed++;
+		if( frames.size() >= capacity && policy == Block && !closed )
+		{
+			auto start = std::chrono::steady_clock::now();
+			room.wait( lock, [this]() { return closed || frames.size() < capacity; } );
+			stats.blockedSeconds += std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+		}
+		if( closed || frames.size() >= capacity ) // the writer may have exited
+		{
+			stats.dropped++;
+			lock.unlock();
+			pool.release( std::move( frame ) );
+			return false;
+		}
+		frames.push_back( std::move( frame ) );
+		TRACE_COUNTER( "frame queue depth", frames.size() );
+		stats.maxDepth = std::max( stats.maxDepth, frames.size() );
+		lock.unlock();
+		ready.notify_one();
+		return true;
+	}
+
+	// counts a frame dropped before it got to the queue (its readback not done in time)
+	void drop()
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		stats.pushed++;
+		stats.dropped++;
+	}
+
+	// writes the queued frames, then stops the writer thread
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			if( closed ) { return; }
+			closed = true;
+		}
+		ready.notify_one();
+		room.notify_all();
+		thread.join();
+	}
+
+	Stats getStats()
+	{
+		Stats s;
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			s = stats;
+			s.depth = frames.size();
+		}
+		s.allocations = pool.allocations();
+		return s;
+	}
+
+private:
+	Writer writer;
+	const size_t capacity;
+	const Policy policy;
+
+	std::mutex mutex;
+	std::condition_variable ready, room;
+	std::deque<FramePtr> frames;
+	bool closed = false;
+	Stats stats;
+	std::thread thread;
+
+	void drain()
+	{
+		TRACE_THREAD( "frame writer" );
+		while( true )
+		{
+			FramePtr frame;
+			{
+				std::unique_lock<std::mutex> lock( mutex );
+				ready.wait( lock, [this]() { return closed || !frames.empty(); } );
+				if( frames.empty() ) { return; } // closed
+				frame = std::move( frames.front() );
+				frames.pop_front();
+			}
+			room.notify_one();
+			{
+				TRACE_SCOPE( "write frame" );
+				writer( *frame );
+			}
+			{
+				std::lock_guard<std::mutex> lock( mutex );
+				stats.written++;
+			}
+			pool.release( std::move( frame ) );
+		}
+	}
+};
@@ -10,6 +10,15 @@
 #include <math.h>
 #include <assert.h>
 #include <string>
+#include <thread>
+#include <chrono>
+
+#include "ScaledTarget.h"
+#include "Redraws.h"
+#include "FramePacer.h"
+#include "Headless.h"
+#include "PassTimers.h"
+#include "Trace.h"
 
 template<typename T>
 T max(T a, T b) { return a < b ? b : a; }
@@ -76,6 +85,7 @@ namespace GlewGlut {
 		Shader() { }
 		Shader(const std::string& vertFile, const std::string& fragFile) : name(vertFile + " " + fragFile) {
 
+			TRACE_SCOPE_DETAIL("compile shader", name);
 			std::string vertCode = readFile(vertFile).data();
 			const char* vertCodeP = vertCode.data();
 			vert = glCreateShader(GL_VERTEX_SHADER);
@@ -210,34 +220,130 @@ namespace GlewGlut {
 		void(*display)() = NULL;
 		void(*init)() = NULL;
 		void(*reshape)() = NULL;
+		bool(*animating)() = NULL; // whether the scene changes on its own, else frames are only drawn on changes
+		// the background work the frames wait for : polled while idle, finished (true) before each headless frame ;
+		// returns whether some is still pending, the idle loop polling it instead of waiting for events
+		bool(*update)(bool finish) = NULL;
+		void(*quit)() = NULL; // before exiting, while the GL context is there
 	} callbacks;
 
 	struct Params {
 
 		AbstractCamera* camera = &turnAroundCamera;
 		GLsizei defaultW = 800, defaultH = 600;
+		// the scene renders into 'target' at a resolution meeting a frame time budget ('x' switches it) :
+		// the display callback must bind target.target() instead of the framebuffer 0
+		bool dynamicResolution = false;
+		float frameBudgetMs = 14;
+		float frameRate = 60; // 0 for uncapped ('u' switches it)
+		size_t benchmarkFrames = 0; // when set, that many frames are drawn and timed, then the program exits
+		HeadlessOptions headless; // when it has frames, they are drawn offscreen instead of in a window
+		std::string timingsCsv; // where to write the passes' timings of every frame, if set
+
+		// --fps and --benchmark set frameRate and benchmarkFrames, --headless and the others the headless options ;
+		// the arguments without "--" are glut's, and skipped
+		void parseArguments(int argc, char* argv[]) {
+
+			for (int i = 1; i + 1 < argc; i++) {
+				const std::string key = argv[i];
+				if (key.compare(0, 2, "--") != 0) { continue; } // glut's
+				if (key == "--fps") { frameRate = std::stof(argv[i + 1]); }
+				else if (key == "--benchmark") { benchmarkFrames = std::stoul(argv[i + 1]); }
+				else if (key == "--timings") { timingsCsv = argv[i + 1]; }
+				else if (headless.parse(key, argv[i + 1])) {}
+				else {
+					std::cerr << "unknown option " << key << ", the options are --fps " << frameRate
+						<< " (0 for uncapped), --benchmark " << benchmarkFrames << " (frames), --timings (CSV file), and without a window --headless "
+						<< headless.frames << " (frames), --width " << headless.w << ", --height " << headless.h
+						<< ", --script (of input events), --out " << headless.out << ", --dumpEvery " << headless.dumpEvery << std::endl;
+					throw 1;
+				}
+				i++;
+			}
+		}
 
 	} params;
 
+	ScaledTarget target;
+
+	// no window nor glut, see Headless.h
+	inline bool headless() { return params.headless.frames > 0; }
+
+	Redraws redraws;
+
+	FramePacer pacer;
+
+	// input, reshapes, the dynamic resolution's last full frame and the benchmark's frames are taken into account here
+	bool animating() {
+		return (callbacks.animating != NULL && callbacks.animating()) || (params.dynamicResolution && target.refining())
+			|| pacer.benchmarking();
+	}
+
+	// the passes of the frames : "frame", and the ones the display callback times ('T' shows them) ; only timed once
+	// 'T' or --timings enables them
+	PassTimers timers;
+	bool showTimings = false;
+
+	void quit() {
+		if (callbacks.quit != NULL) { callbacks.quit(); }
+		redraws.print(std::cout);
+		if (params.benchmarkFrames > 0) { pacer.print(std::cout); }
+		timers.finish();
+		timers.print(std::cout);
+		if (!headless()) { glutDestroyWindow(windowId); }
+		exit(EXIT_SUCCESS);
+	}
+
+	void idle();
+
+	// the scene changed : a frame is drawn at the next tick
+	void markDirty() {
+		redraws.mark();
+		if (!headless()) { glutIdleFunc(idle); }
+	}
+
 	void display() {
 
-		camera->display();
+		redraws.drawn(animating());
+
+		timers.beginFrame();
+		{
+			PassTimers::Scope pass(timers, "frame");
+
+			camera->display();
+
+			if (params.dynamicResolution) { target.begin(); }
+
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			if (callbacks.display != NULL) { callbacks.display(); }
+
+			if (params.dynamicResolution) { target.end(); }
+		}
+		if (showTimings && !headless()) { timers.drawOverlay(int(camera->currentH)); }
+		timers.endFrame();
 
-		if (callbacks.display != NULL) { callbacks.display(); }
+		if (headless()) { return; }
 
 		glutSwapBuffers();
+
+		pacer.shown();
+		if (pacer.benchmarked()) { quit(); }
 	}
 
 	void idle() {
 
-		static int nWaitUntil = glutGet(GLUT_ELAPSED_TIME);
-		int nTimer = glutGet(GLUT_ELAPSED_TIME);
-		if (nTimer >= nWaitUntil) {
-			glutPostRedisplay();
-			nWaitUntil = nTimer + (int)(1000.0f / 60);
+		const bool pending = callbacks.update != NULL && callbacks.update(false);
+
+		// nothing to draw : waits for the next event in glut's loop instead of spinning, or polls the background work
+		if (!redraws.due(animating())) {
+			if (!pending) { glutIdleFunc(NULL); }
+			else { std::this_thread::sleep_for(std::chrono::milliseconds(1)); }
+			return;
 		}
+
+		pacer.wait();
+		glutPostRedisplay();
 	}
 
 	std::unordered_map<char, KeyFunction> keys = {
@@ -246,10 +352,7 @@ namespace GlewGlut {
 			{
 				"Exits the program",
 				[](bool down) {
-					if(down) {
-						glutDestroyWindow(windowId);
-						exit(EXIT_SUCCESS);
-					}
+					if(down) { quit(); }
 				}
 			}
 		}
@@ -269,6 +372,8 @@ namespace GlewGlut {
 
 	void keyboard(unsigned char key, int x, int y) {
 
+		target.moved();
+		markDirty();
 		auto function = keys.find(key);
 		if (function != keys.end()) {
 			function->second.function(true);
@@ -277,6 +382,7 @@ namespace GlewGlut {
 
 	void keyboardUp(unsigned char key, int x, int y) {
 
+		markDirty();
 		auto function = keys.find(key);
 		if (function != keys.end()) {
 			function->second.function(false);
@@ -290,37 +396,136 @@ namespace GlewGlut {
 	void reshape(GLsizei w, GLsizei h) {
 
 		camera->reshape(w,h);
+		if (params.dynamicResolution) { target.resize(w, h); }
+		markDirty();
 		if(callbacks.reshape != NULL) { callbacks.reshape(); }
 		display();
 	}
 
 	void mouseMove(int x, int y) {
+		target.moved();
+		markDirty();
 		camera->mouseMove(x, y);
 	}
 
 	void mouseClick(int button, int state, int x, int y) {
+		target.moved();
+		markDirty();
 		camera->mouseClick( button, state, x, y );
 	}
 
+	// draws the headless frames with the application's handlers, then exits ; 'init' runs once the context is there
+	void runHeadless(HeadlessHandlers handlers, void(*init)()) {
+#ifdef GLEWGLUT_HEADLESS
+		bool ok;
+		{
+			Headless context(params.headless.w, params.headless.h);
+			target.enabled = false; // full resolution frames, whatever they cost ('x' in the script switches it)
+			if (init != NULL) { init(); }
+
+			if (callbacks.update != NULL) {
+				handlers.update = []() { callbacks.update(true); };
+			}
+			ok = context.run(params.headless, handlers);
+			if (callbacks.quit != NULL) { callbacks.quit(); }
+			redraws.print(std::cout);
+			timers.finish();
+			timers.print(std::cout);
+		}
+		exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+#else
+		std::cerr << "Error, --headless needs a build with GLEWGLUT_HEADLESS (the CMake option Headless)" << std::endl;
+		throw 1;
+#endif
+	}
+
+	// the headless frames of main()
+	void runHeadless() {
+
+		HeadlessHandlers handlers;
+		handlers.display = display;
+		handlers.reshape = reshape;
+		handlers.keyboard = keyboard;
+		handlers.keyboardUp = keyboardUp;
+		handlers.mouseMove = mouseMove;
+		handlers.mouseClick = mouseClick;
+		runHeadless(handlers, []() {
+			if (params.dynamicResolution) { target.init(); }
+			if (callbacks.init != NULL) { TRACE_SCOPE("init"); callbacks.init(); }
+		});
+	}
+
+	// applies the frame options of 'params' and adds their keys ('u', 'T', and 'x' with the dynamic resolution),
+	// then lists all the keys : for the applications driving glut themselves, main() calls it
+	void setup() {
+
+		pacer.rate = params.frameRate;
+		pacer.benchmarkFrames = params.benchmarkFrames;
+		if (!params.timingsCsv.empty()) {
+			timers.writeCsv(params.timingsCsv);
+			timers.enabled = true;
+		}
+		keys.insert({ 'T',{
+			"Shows the timings of the passes",
+			[](bool down) {
+				if (down) {
+					showTimings = !showTimings;
+					timers.enabled = showTimings || !params.timingsCsv.empty();
+				}
+			}
+		} });
+		keys.insert({ 'u',{
+			"Switches between the frame rate and uncapped frames",
+			[](bool down) {
+				if (down) {
+					static float paced = 60;
+					if (pacer.rate > 0) { paced = pacer.rate; pacer.rate = 0; }
+					else { pacer.rate = paced; }
+					std::cout << "frames " << (pacer.rate > 0 ? "paced" : "uncapped") << std::endl;
+				}
+			}
+		} });
+
+		if (params.dynamicResolution) {
+			target.resolution.budgetMs = params.frameBudgetMs;
+			keys.insert({ 'x',{
+				"Switches the dynamic resolution",
+				[](bool down) {
+					if (down) {
+						target.enabled = !target.enabled;
+						std::cout << "dynamic resolution " << (target.enabled ? "on" : "off") << ", last frame in "
+							<< target.lastFrameMs() << " ms at " << target.renderW << "x" << target.renderH << std::endl;
+					}
+				}
+			} });
+		}
+
+		std::cout << "Keys : " << std::endl;
+		for (const auto& key : keys) {
+			std::cout << " '" << key.first << "' -> " << key.second.description << std::endl;
+		}
+	}
+
 	void main( const Callbacks& callbacks, const Params& params = {} ) {
 
+		TRACE_THREAD("main");
 		GlewGlut::callbacks = callbacks;
 		GlewGlut::params = params;
 
+		camera = params.camera;
+		camera->init();
+
+		setup();
+
+		if (headless()) { runHeadless(); }
+
 		int argc = 0;
 		glutInit(&argc, NULL);
 		glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
 
 		glutInitWindowSize(params.defaultW,params.defaultW);
-		camera = params.camera;
-		camera->init();
 		camera->reshape(params.defaultW, params.defaultW);
 
-		std::cout << "Keys : " << std::endl;
-		for (const auto& key : keys) {
-			std::cout << " '" << key.first << "' -> " << key.second.description << std::endl;
-		}
-
 		windowId = glutCreateWindow("Scene");
 
 		glutDisplayFunc(display);
@@ -334,7 +539,12 @@ namespace GlewGlut {
 
 		glewInit();
 
-		if (callbacks.init != NULL) { callbacks.init(); }
+		if (params.dynamicResolution) {
+			target.init();
+			target.resize(params.defaultW, params.defaultW);
+		}
+
+		if (callbacks.init != NULL) { TRACE_SCOPE("init"); callbacks.init(); }
 
 		glutMainLoop();
 	}
@@ -35,6 +35,9 @@ struct Camera : public GlewGlut::TurnAroundCamera
 	}
 } camera;
 
+// the turntable spins the camera at each frame
+bool animating() { return turnTable; }
+
 void displayScene() {
 
 	meshShader.use();
@@ -76,6 +79,7 @@ int main() {
 	GlewGlut::Callbacks callbacks;
 	callbacks.init = init;
 	callbacks.display = displayScene;
+	callbacks.animating = animating;
 	GlewGlut::Params params; params.camera = &camera;
 	GlewGlut::main( callbacks, params );
 }
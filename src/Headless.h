@@ -0,0 +1,248 @@
+#pragma once
+
+// Headless backend of the demos, for machines without a display (CI, render nodes) : instead of a GLUT window,
+// an offscreen EGL context whose pbuffer stands for the window's framebuffer 0, of a fixed size. A scripted
+// loop replays input events and draws a number of frames, all of them whether the scene changed or not, timing
+// them and dumping some to PNG ; the GL errors fail the run.
+// EGL's surfaceless platform works on Mesa's software rasterizer, with no GPU nor X server. The context is only
+// built with GLEWGLUT_HEADLESS (the CMake option Headless, which links libEGL) ; the options and the script are
+// there either way.
+//
+// The script has an event per line, '#' starting a comment :
+//   <frame> key <c>                  keyboard(c) before the frame is drawn, c being a character or its code
+//   <frame> keyup <c>
+//   <frame> move <x> <y>             mouse motion, a button down
+//   <frame> click <button> <state> <x> <y>
+//   <frame> dump <file.png>          saves the frame once drawn
+
+#include <GL/glew.h>
+#ifdef GLEWGLUT_HEADLESS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include "lodepng.h"
+#endif
+
+#include "FramePacer.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <stdio.h>
+
+namespace GlewGlut {
+
+	struct HeadlessOptions {
+		size_t frames = 0; // drawn offscreen, no window when set
+		GLsizei w = 800, h = 600;
+		std::string script; // of input events, see above
+		std::string out = "frame.png"; // the last frame, or a pattern with the frame's index (printf's "%05d" is added if missing)
+		size_t dumpEvery = 0; // also saves every n-th frame
+
+		// reads "--<name> <value>", false if it isn't a headless option
+		bool parse(const std::string& name, const std::string& value) {
+			if (name == "--headless") { frames = std::stoul(value); }
+			else if (name == "--width") { w = std::stoi(value); }
+			else if (name == "--height") { h = std::stoi(value); }
+			else if (name == "--script") { script = value; }
+			else if (name == "--out") { out = value; }
+			else if (name == "--dumpEvery") { dumpEvery = std::stoul(value); }
+			else { return false; }
+			return true;
+		}
+
+		// the file of a frame : 'out' itself for the last frame when nothing else is dumped
+		std::string fileName(size_t frame) const {
+			if (dumpEvery == 0) { return out; }
+			std::string pattern = out;
+			if (pattern.find('%') == std::string::npos) {
+				const size_t dot = pattern.rfind('.');
+				pattern.insert(dot == std::string::npos ? pattern.size() : dot, "%05d");
+			}
+			std::vector<char> name(pattern.size() + 32);
+			snprintf(name.data(), name.size(), pattern.c_str(), int(frame));
+			return name.data();
+		}
+	};
+
+	// the application's handlers, NULL for the ones it doesn't have
+	struct HeadlessHandlers {
+		void(*display)() = NULL; // draws a frame into the framebuffer 0, without swapping
+		void(*reshape)(GLsizei w, GLsizei h) = NULL;
+		void(*keyboard)(unsigned char key, int x, int y) = NULL;
+		void(*keyboardUp)(unsigned char key, int x, int y) = NULL;
+		void(*mouseMove)(int x, int y) = NULL;
+		void(*mouseClick)(int button, int state, int x, int y) = NULL;
+		void(*update)() = NULL; // before each frame, to finish the background work it needs
+	};
+
+	struct HeadlessScript {
+
+		struct Event {
+			size_t frame;
+			std::string type;
+			std::vector<std::string> args;
+		};
+		std::vector<Event> events; // in the order of the frames
+
+		HeadlessScript() {}
+		HeadlessScript(const std::string& fileName) {
+
+			std::ifstream in(fileName);
+			if (!in.is_open()) { std::cerr << "Error, can't read " << fileName << std::endl; throw 1; }
+			std::string line;
+			for (int number = 1; std::getline(in, line); number++) {
+				line = line.substr(0, line.find('#'));
+				std::istringstream words(line);
+				Event event;
+				if (!(words >> event.frame >> event.type)) { continue; } // blank
+				for (std::string arg; words >> arg;) { event.args.push_back(arg); }
+				static const std::vector<std::pair<std::string, size_t>> arities = {
+					{ "key", 1 }, { "keyup", 1 }, { "move", 2 }, { "click", 4 }, { "dump", 1 }
+				};
+				auto arity = std::find_if(arities.begin(), arities.end(), [&](const std::pair<std::string, size_t>& a) { return a.first == event.type; });
+				if (arity == arities.end() || arity->second != event.args.size()) {
+					std::cerr << fileName << ":" << number << " : unknown event, or wrong count of arguments : " << line << std::endl;
+					throw 1;
+				}
+				events.push_back(event);
+			}
+			std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) { return a.frame < b.frame; });
+		}
+
+		// a character, or its code
+		static unsigned char key(const std::string& arg) {
+			return arg.size() == 1 ? arg[0] : (unsigned char)std::stoi(arg);
+		}
+
+		// calls the handlers of the frame's input events, and gives the files it is to be dumped to
+		std::vector<std::string> play(size_t frame, const HeadlessHandlers& handlers) {
+
+			std::vector<std::string> dumps;
+			for (; next < events.size() && events[next].frame <= frame; next++) {
+				const Event& e = events[next];
+				if (e.type == "key" && handlers.keyboard) { handlers.keyboard(key(e.args[0]), 0, 0); }
+				else if (e.type == "keyup" && handlers.keyboardUp) { handlers.keyboardUp(key(e.args[0]), 0, 0); }
+				else if (e.type == "move" && handlers.mouseMove) { handlers.mouseMove(std::stoi(e.args[0]), std::stoi(e.args[1])); }
+				else if (e.type == "click" && handlers.mouseClick) {
+					handlers.mouseClick(std::stoi(e.args[0]), std::stoi(e.args[1]), std::stoi(e.args[2]), std::stoi(e.args[3]));
+				}
+				else if (e.type == "dump") { dumps.push_back(e.args[0]); }
+			}
+			return dumps;
+		}
+
+	private:
+		size_t next = 0;
+	};
+
+#ifdef GLEWGLUT_HEADLESS
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+	class Headless {
+
+		EGLDisplay display = EGL_NO_DISPLAY;
+		EGLSurface surface = EGL_NO_SURFACE;
+		EGLContext context = EGL_NO_CONTEXT;
+		GLsizei w = 0, h = 0;
+
+	public:
+		// makes current a compatibility context of a w x h framebuffer, and loads GL's functions
+		Headless(GLsizei w, GLsizei h) : w(w), h(h) {
+
+			// the surfaceless platform when available (Mesa), else the default display
+			PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+			if (getPlatformDisplay != NULL) { display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL); }
+			if (display == EGL_NO_DISPLAY) { display = eglGetDisplay(EGL_DEFAULT_DISPLAY); }
+			EGLint major, minor;
+			if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) { std::cerr << "Error, no EGL display" << std::endl; throw 1; }
+			eglBindAPI(EGL_OPENGL_API);
+
+			const EGLint configAttribs[] = {
+				EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+				EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8, EGL_DEPTH_SIZE, 24,
+				EGL_NONE
+			};
+			EGLConfig config;
+			EGLint configs = 0;
+			if (!eglChooseConfig(display, configAttribs, &config, 1, &configs) || configs == 0) {
+				std::cerr << "Error, no EGL config with a 8 bits RGBA pbuffer" << std::endl; throw 1;
+			}
+			const EGLint surfaceAttribs[] = { EGL_WIDTH, w, EGL_HEIGHT, h, EGL_NONE };
+			surface = eglCreatePbufferSurface(display, config, surfaceAttribs);
+			context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+			if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context)) {
+				std::cerr << "Error, can't create a " << w << "x" << h << " EGL context (0x" << std::hex << eglGetError() << std::dec << ")" << std::endl;
+				throw 1;
+			}
+			glewExperimental = GL_TRUE;
+			glewInit(); // its GLX part fails without an X display, once the GL functions are loaded
+			glGetError();
+			std::cout << "headless " << w << "x" << h << " context : " << glGetString(GL_RENDERER) << ", OpenGL " << glGetString(GL_VERSION) << std::endl;
+		}
+
+		~Headless() {
+			eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			eglDestroyContext(display, context);
+			eglDestroySurface(display, surface);
+			eglTerminate(display);
+		}
+
+		Headless(const Headless&) = delete;
+		Headless& operator=(const Headless&) = delete;
+
+		// writes the framebuffer 0 to a PNG, top row first
+		void save(const std::string& fileName) {
+
+			std::vector<unsigned char> pixels(size_t(w) * h * 4), flipped(pixels.size());
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+			const size_t row = size_t(w) * 4;
+			for (GLsizei y = 0; y < h; y++) {
+				std::copy(pixels.begin() + (h - 1 - y) * row, pixels.begin() + (h - y) * row, flipped.begin() + y * row);
+			}
+			unsigned error = lodepng::encode(fileName, flipped, w, h);
+			if (error) { std::cerr << "Error, can't write " << fileName << " : " << lodepng_error_text(error) << std::endl; throw 1; }
+		}
+
+		// draws the frames of the options, the script's events handled before each one ; false on GL errors
+		bool run(const HeadlessOptions& options, const HeadlessHandlers& handlers) {
+
+			HeadlessScript script;
+			if (!options.script.empty()) { script = HeadlessScript(options.script); }
+
+			if (handlers.reshape) { handlers.reshape(w, h); }
+			std::vector<float> times;
+			size_t errors = 0;
+			for (size_t frame = 0; frame < options.frames; frame++) {
+
+				std::vector<std::string> dumps = script.play(frame, handlers);
+				if (handlers.update) { handlers.update(); }
+
+				const auto start = std::chrono::steady_clock::now();
+				handlers.display();
+				glFinish();
+				times.push_back(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+				for (GLenum error = glGetError(); error != GL_NO_ERROR; error = glGetError()) {
+					std::cerr << "GL error 0x" << std::hex << error << std::dec << " at frame " << frame << std::endl;
+					errors++;
+				}
+				const bool last = frame + 1 == options.frames;
+				if (last || (options.dumpEvery > 0 && frame % options.dumpEvery == 0)) { dumps.push_back(options.fileName(frame)); }
+				for (const std::string& file : dumps) { save(file); }
+			}
+			printFrameTimes(std::cout, times, " offscreen");
+			return errors == 0;
+		}
+	};
+
+#endif
+}
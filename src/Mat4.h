@@ -0,0 +1,127 @@
+#pragma once
+
+#include <math.h>
+#include <Vec.h>
+
+// Column-major 4x4 matrix, following the fixed pipeline conventions (glTranslate, glRotate...)
+struct Mat4
+{
+	float m[16];
+
+	Mat4() { for( uint i = 0; i < 16; i++ ) { m[i] = ( i % 5 == 0 ) ? 1.0f : 0.0f; } }
+
+	inline float& at( uint row, uint col ) { return m[4 * col + row]; }
+	inline float at( uint row, uint col ) const { return m[4 * col + row]; }
+
+	Mat4 operator*( const Mat4& o ) const
+	{
+		Mat4 dst;
+		for( uint r = 0; r < 4; r++ )
+			for( uint c = 0; c < 4; c++ )
+			{
+				float sum = 0;
+				for( uint k = 0; k < 4; k++ ) { sum += at( r, k ) * o.at( k, c ); }
+				dst.at( r, c ) = sum;
+			}
+		return dst;
+	}
+
+	Vec3F transformPoint( const Vec3F& p ) const
+	{
+		Vec3F dst;
+		for( uint r = 0; r < 3; r++ )
+			dst[r] = at( r, 0 ) * p[0] + at( r, 1 ) * p[1] + at( r, 2 ) * p[2] + at( r, 3 );
+		float w = at( 3, 0 ) * p[0] + at( 3, 1 ) * p[1] + at( 3, 2 ) * p[2] + at( 3, 3 );
+		return w == 1 ? dst : dst / w;
+	}
+	Vec3F transformDir( const Vec3F& d ) const
+	{
+		Vec3F dst;
+		for( uint r = 0; r < 3; r++ )
+			dst[r] = at( r, 0 ) * d[0] + at( r, 1 ) * d[1] + at( r, 2 ) * d[2];
+		return dst;
+	}
+
+	static Mat4 translation( float x, float y, float z )
+	{
+		Mat4 dst;
+		dst.at( 0, 3 ) = x; dst.at( 1, 3 ) = y; dst.at( 2, 3 ) = z;
+		return dst;
+	}
+	static Mat4 scaling( float x, float y, float z )
+	{
+		Mat4 dst;
+		dst.at( 0, 0 ) = x; dst.at( 1, 1 ) = y; dst.at( 2, 2 ) = z;
+		return dst;
+	}
+	// same as glRotate : angle in degrees around (x,y,z)
+	static Mat4 rotation( float angle, float x, float y, float z )
+	{
+		Vec3F a = Vec3F( x, y, z ).normalized();
+		float c = cosf( angle * float( M_PI ) / 180 ), s = sinf( angle * float( M_PI ) / 180 );
+		Mat4 dst;
+		for( uint r = 0; r < 3; r++ )
+			for( uint col = 0; col < 3; col++ )
+				dst.at( r, col ) = a[r] * a[col] * ( 1 - c ) + ( r == col ? c : 0 );
+		dst.at( 0, 1 ) -= a[2] * s; dst.at( 1, 0 ) += a[2] * s;
+		dst.at( 0, 2 ) += a[1] * s; dst.at( 2, 0 ) -= a[1] * s;
+		dst.at( 1, 2 ) -= a[0] * s; dst.at( 2, 1 ) += a[0] * s;
+		return dst;
+	}
+	// same as gluLookAt
+	static Mat4 lookAt( const Vec3F& eye, const Vec3F& center, const Vec3F& up )
+	{
+		// Vec::cross gives b x a : the operands are swapped
+		Vec3F f = ( center - eye ).normalized();
+		Vec3F s = up.cross( f ).normalized();
+		Vec3F u = f.cross( s );
+		Mat4 dst;
+		for( uint i = 0; i < 3; i++ )
+		{
+			dst.at( 0, i ) = s[i];
+			dst.at( 1, i ) = u[i];
+			dst.at( 2, i ) = -f[i];
+		}
+		return dst * translation( -eye[0], -eye[1], -eye[2] );
+	}
+	// same as gluPerspective
+	static Mat4 perspective( float fovY, float aspect, float zNear, float zFar )
+	{
+		float f = 1.0f / tanf( fovY * float( M_PI ) / 360 );
+		Mat4 dst;
+		dst.at( 0, 0 ) = f / aspect;
+		dst.at( 1, 1 ) = f;
+		dst.at( 2, 2 ) = ( zFar + zNear ) / ( zNear - zFar );
+		dst.at( 2, 3 ) = 2 * zFar * zNear / ( zNear - zFar );
+		dst.at( 3, 2 ) = -1;
+		dst.at( 3, 3 ) = 0;
+		return dst;
+	}
+
+	Mat4 inverse() const
+	{
+		// cofactor expansion
+		const float* a = m;
+		float inv[16];
+		inv[0] = a[5]*a[10]*a[15] - a[5]*a[11]*a[14] - a[9]*a[6]*a[15] + a[9]*a[7]*a[14] + a[13]*a[6]*a[11] - a[13]*a[7]*a[10];
+		inv[4] = -a[4]*a[10]*a[15] + a[4]*a[11]*a[14] + a[8]*a[6]*a[15] - a[8]*a[7]*a[14] - a[12]*a[6]*a[11] + a[12]*a[7]*a[10];
+		inv[8] = a[4]*a[9]*a[15] - a[4]*a[11]*a[13] - a[8]*a[5]*a[15] + a[8]*a[7]*a[13] + a[12]*a[5]*a[11] - a[12]*a[7]*a[9];
+		inv[12] = -a[4]*a[9]*a[14] + a[4]*a[10]*a[13] + a[8]*a[5]*a[14] - a[8]*a[6]*a[13] - a[12]*a[5]*a[10] + a[12]*a[6]*a[9];
+		inv[1] = -a[1]*a[10]*a[15] + a[1]*a[11]*a[14] + a[9]*a[2]*a[15] - a[9]*a[3]*a[14] - a[13]*a[2]*a[11] + a[13]*a[3]*a[10];
+		inv[5] = a[0]*a[10]*a[15] - a[0]*a[11]*a[14] - a[8]*a[2]*a[15] + a[8]*a[3]*a[14] + a[12]*a[2]*a[11] - a[12]*a[3]*a[10];
+		inv[9] = -a[0]*a[9]*a[15] + a[0]*a[11]*a[13] + a[8]*a[1]*a[15] - a[8]*a[3]*a[13] - a[12]*a[1]*a[11] + a[12]*a[3]*a[9];
+		inv[13] = a[0]*a[9]*a[14] - a[0]*a[10]*a[13] - a[8]*a[1]*a[14] + a[8]*a[2]*a[13] + a[12]*a[1]*a[10] - a[12]*a[2]*a[9];
+		inv[2] = a[1]*a[6]*a[15] - a[1]*a[7]*a[14] - a[5]*a[2]*a[15] + a[5]*a[3]*a[14] + a[13]*a[2]*a[7] - a[13]*a[3]*a[6];
+		inv[6] = -a[0]*a[6]*a[15] + a[0]*a[7]*a[14] + a[4]*a[2]*a[15] - a[4]*a[3]*a[14] - a[12]*a[2]*a[7] + a[12]*a[3]*a[6];
+		inv[10] = a[0]*a[5]*a[15] - a[0]*a[7]*a[13] - a[4]*a[1]*a[15] + a[4]*a[3]*a[13] + a[12]*a[1]*a[7] - a[12]*a[3]*a[5];
+		inv[14] = -a[0]*a[5]*a[14] + a[0]*a[6]*a[13] + a[4]*a[1]*a[14] - a[4]*a[2]*a[13] - a[12]*a[1]*a[6] + a[12]*a[2]*a[5];
+		inv[3] = -a[1]*a[6]*a[11] + a[1]*a[7]*a[10] + a[5]*a[2]*a[11] - a[5]*a[3]*a[10] - a[9]*a[2]*a[7] + a[9]*a[3]*a[6];
+		inv[7] = a[0]*a[6]*a[11] - a[0]*a[7]*a[10] - a[4]*a[2]*a[11] + a[4]*a[3]*a[10] + a[8]*a[2]*a[7] - a[8]*a[3]*a[6];
+		inv[11] = -a[0]*a[5]*a[11] + a[0]*a[7]*a[9] + a[4]*a[1]*a[11] - a[4]*a[3]*a[9] - a[8]*a[1]*a[7] + a[8]*a[3]*a[5];
+		inv[15] = a[0]*a[5]*a[10] - a[0]*a[6]*a[9] - a[4]*a[1]*a[10] + a[4]*a[2]*a[9] + a[8]*a[1]*a[6] - a[8]*a[2]*a[5];
+		float det = a[0]*inv[0] + a[1]*inv[4] + a[2]*inv[8] + a[3]*inv[12];
+		Mat4 dst;
+		for( uint i = 0; i < 16; i++ ) { dst.m[i] = det == 0 ? 0 : inv[i] / det; }
+		return dst;
+	}
+};
@@ -11,6 +11,8 @@
 #include <math.h>
 
 #include <Vec.h>
+#include <PassTimers.h>
+#include <Trace.h>
 
 class Mesh {
 
@@ -41,6 +43,21 @@ public:
 
 	inline uint ptCount() const { return vertices.size(); }
 	inline uint normalCount() const { return normals.size(); }
+	inline uint faceCount() const { return faces.size(); }
+	inline const std::vector<Vec3F>& getVertices() const { return vertices; }
+
+	// the faces' vertex indices, quads split in two
+	std::vector<std::array<uint, 3>> triangles() const
+	{
+		std::vector<std::array<uint, 3>> dst;
+		dst.reserve( faces.size() * 2 );
+		for( const Face& face : faces )
+		{
+			dst.push_back( {{ face.v[0], face.v[1], face.v[2] }} );
+			if( face.isQuad ) { dst.push_back( {{ face.v[0], face.v[2], face.v[3] }} ); }
+		}
+		return dst;
+	}
 
 	inline void addVertex( const Vec3F& v )
 	{
@@ -124,6 +141,7 @@ public:
 	}
 
 	static Mesh loadWavefront(const std::string& fileName) {
+		TRACE_SCOPE_DETAIL("Mesh::loadWavefront", fileName);
 		std::fstream file(fileName, std::ios::in);
 		if (!file.is_open()) {
 			std::cerr << "can't open " << fileName << std::endl;
@@ -211,6 +229,7 @@ public:
 
 	void init() {
 
+		TRACE_SCOPE("Mesh::init");
 		const std::vector<uint>
 			quadIndices = { 0, 1, 2, 0, 2, 3 },
 			triaIndices = { 0, 1, 2 };
@@ -280,16 +299,23 @@ public:
 
 		glDrawArrays(GL_TRIANGLES, 0, GLsizei( this->nbVertTris ) );
 
-		// Drawing normals
-		glBindBuffer(GL_ARRAY_BUFFER, this->lineVertVbId);
-		glEnableClientState(GL_VERTEX_ARRAY);
-		glVertexPointer(3, GL_FLOAT, 0, 0);
+		GlewGlut::DrawCounters& counters = GlewGlut::drawCounters();
+		counters.drawCalls++;
+		counters.triangles += this->nbVertTris / 3;
 
-		glBindBuffer(GL_ARRAY_BUFFER, this->lineNormVbId);
-		glEnableClientState(GL_NORMAL_ARRAY);
-		glNormalPointer(GL_FLOAT, 0, 0);
+		// Drawing normals, when the mesh has lines
+		if (this->nbVertLines > 0) {
+			glBindBuffer(GL_ARRAY_BUFFER, this->lineVertVbId);
+			glEnableClientState(GL_VERTEX_ARRAY);
+			glVertexPointer(3, GL_FLOAT, 0, 0);
+
+			glBindBuffer(GL_ARRAY_BUFFER, this->lineNormVbId);
+			glEnableClientState(GL_NORMAL_ARRAY);
+			glNormalPointer(GL_FLOAT, 0, 0);
 
-		glDrawArrays(GL_LINES, 0, GLsizei( this->nbVertLines ) );
+			glDrawArrays(GL_LINES, 0, GLsizei( this->nbVertLines ) );
+			counters.drawCalls++;
+		}
 	}
 };
 
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+
+namespace Parallel {
+
+	inline unsigned int threadCount()
+	{
+		unsigned int n = std::thread::hardware_concurrency();
+		return n == 0 ? 1 : n;
+	}
+
+	// Calls task( index, worker ) for every index in [0;count) on 'threads' workers (0 = all cores).
+	// Each worker starts with a contiguous range of indices ; once it is done,
+	// it steals the second half of the largest remaining range.
+	inline void forEach(
+		size_t count,
+		const std::function<void( size_t index, unsigned int worker )>& task,
+		unsigned int threads = 0
+	) {
+		if( threads == 0 ) { threads = threadCount(); }
+		if( threads > count ) { threads = unsigned( count ); }
+		if( threads <= 1 )
+		{
+			for( size_t i = 0; i < count; i++ ) { task( i, 0 ); }
+			return;
+		}
+
+		struct alignas( 64 ) Range {
+			std::mutex mutex;
+			size_t begin, end;
+		};
+		std::vector<Range> ranges( threads );
+		for( unsigned int t = 0; t < threads; t++ )
+		{
+			ranges[t].begin = count * t / threads;
+			ranges[t].end = count * ( t + 1 ) / threads;
+		}
+
+		auto pop = [&ranges]( unsigned int t, size_t& index ) {
+			std::lock_guard<std::mutex> lock( ranges[t].mutex );
+			if( ranges[t].begin >= ranges[t].end ) { return false; }
+			index = ranges[t].begin++;
+			return true;
+		};
+
+		auto steal = [&ranges, threads]( unsigned int t ) {
+			unsigned int victim = t;
+			size_t best = 0;
+			for( unsigned int v = 0; v < threads; v++ )
+			{
+				if( v == t ) { continue; }
+				std::lock_guard<std::mutex> lock( ranges[v].mutex );
+				size_t left = ranges[v].end > ranges[v].begin ? ranges[v].end - ranges[v].begin : 0;
+				if( left > best ) { best = left; victim = v; }
+			}
+			if( victim == t ) { return false; }
+			size_t begin, end;
+			{
+				std::lock_guard<std::mutex> lock( ranges[victim].mutex );
+				if( ranges[victim].begin >= ranges[victim].end ) { return true; } // raced, look again
+				end = ranges[victim].end;
+				begin = ranges[victim].begin + ( end - ranges[victim].begin ) / 2;
+				ranges[victim].end = begin;
+			}
+			std::lock_guard<std::mutex> lock( ranges[t].mutex );
+			ranges[t].begin = begin;
+			ranges[t].end = end;
+			return true;
+		};
+
+		auto work = [&]( unsigned int t ) {
+			size_t index;
+			do {
+				while( pop( t, index ) ) { task( index, t ); }
+			} while( steal( t ) );
+		};
+
+		std::vector<std::thread> workers;
+		for( unsigned int t = 1; t < threads; t++ ) { workers.push_back( std::thread( work, t ) ); }
+		work( 0 );
+		for( auto& w : workers ) { w.join(); }
+	}
+}
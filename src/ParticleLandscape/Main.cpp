@@ -16,6 +16,7 @@ struct Image {
 	std::vector<uchar> pixels;
 	inline uchar at(size_t x, size_t y, size_t c = 0) const { return this->pixels[4*(y*this->w + x)+c]; }
 	Image(std::string fileName) {
+		TRACE_SCOPE_DETAIL("PNG decode", fileName);
 		unsigned error = lodepng::decode(pixels, w, h, fileName);
 		if (error) {
 			std::cerr << "error when opening " << fileName <<
@@ -73,5 +74,6 @@ int main(int argc, char* argv[])
 	callbacks.init = init;
 	callbacks.display = displayScene;
 	GlewGlut::Params params;
+	params.parseArguments(argc, argv);
 	GlewGlut::main(callbacks, params);
 }
@@ -0,0 +1,272 @@
+#pragma once
+
+// Where the frame time goes : named passes timed on the CPU (issuing their GL calls) and on the GPU, by
+// GL_TIMESTAMP queries around them, which unlike GL_TIME_ELAPSED ones can nest. Each pass also counts the draw
+// calls and triangles of the Mesh::draw calls within it. The queries of a frame are read a few frames later,
+// once available, so that timing never stalls the pipeline ; only a full ring of frames in flight waits.
+// Each pass keeps the statistics of its last frames (min, average and 95th percentile), shown by the overlay,
+// and every frame can be written to a CSV. The timers are off until enabled, the queries costing every frame.
+//
+//   timers.beginFrame();
+//   { GlewGlut::PassTimers::Scope pass(timers, "lighting"); ... }
+//   timers.endFrame();
+
+#include <GL/glew.h>
+#include <GL/glut.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+
+namespace GlewGlut {
+
+	// what Mesh::draw submitted since the start
+	struct DrawCounters {
+		size_t drawCalls = 0, triangles = 0;
+	};
+	inline DrawCounters& drawCounters() { static DrawCounters counters; return counters; }
+
+	// statistics of the last 'size' samples
+	class RollingStats {
+		std::vector<float> samples;
+		size_t next = 0, size;
+	public:
+		static const size_t defaultSize = 120; // 2 seconds at 60 Hz
+
+		RollingStats(size_t size = defaultSize) : size(size) {}
+
+		void add(float sample) {
+			if (samples.size() < size) { samples.push_back(sample); }
+			else { samples[next] = sample; }
+			next = (next + 1) % size;
+		}
+		inline bool empty() const { return samples.empty(); }
+		float min() const { return samples.empty() ? 0 : *std::min_element(samples.begin(), samples.end()); }
+		float avg() const {
+			float sum = 0;
+			for (float s : samples) { sum += s; }
+			return samples.empty() ? 0 : sum / samples.size();
+		}
+		// nearest rank, p of [0;1]
+		float percentile(float p) const {
+			if (samples.empty()) { return 0; }
+			std::vector<float> sorted = samples;
+			const size_t rank = std::min(sorted.size() - 1, size_t(std::max(0.f, p * sorted.size() - 1e-3f)));
+			std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+			return sorted[rank];
+		}
+	};
+
+	class PassTimers {
+
+		struct Pass {
+			std::string name;
+			int depth; // of nesting, when first seen
+			RollingStats cpuMs, gpuMs, drawCalls, triangles;
+
+			Pass(const std::string& name, int depth) : name(name), depth(depth) {}
+		};
+
+		// a pass timed in a frame
+		struct Record {
+			size_t pass;
+			float cpuMs;
+			size_t drawCalls, triangles;
+		};
+
+		// a frame in flight
+		struct Frame {
+			long long index = -1;
+			std::vector<Record> records;
+			std::vector<GLuint> queries; // start and end timestamps of the records, reused
+			GLuint last = 0; // the last query issued, the end of the outermost pass
+		};
+
+		static const int ringSize = 4;
+		Frame ring[ringSize];
+		long long frames = 0, collected = 0;
+		bool inFrame = false;
+		int depth = 0;
+		std::vector<Pass> passes;
+		std::ofstream csv;
+
+		Frame& current() { return ring[frames % ringSize]; }
+
+		size_t passIndex(const char* name) {
+			for (size_t i = 0; i < passes.size(); i++) {
+				if (passes[i].name == name) { return i; }
+			}
+			passes.push_back(Pass(name, depth));
+			return passes.size() - 1;
+		}
+
+		// gives the frames whose queries are available to the statistics, in order, waiting for the oldest one or not
+		void collect(bool wait) {
+
+			while (collected < frames) {
+				Frame& frame = ring[collected % ringSize];
+				const size_t count = frame.records.size();
+				if (count > 0) {
+					GLint available = 0; // the queries complete in order : the last one issued tells
+					glGetQueryObjectiv(frame.last, GL_QUERY_RESULT_AVAILABLE, &available);
+					if (!available && !wait) { return; }
+				}
+				std::vector<Record> sums(passes.size(), Record{ 0, 0, 0, 0 });
+				std::vector<double> gpuSums(passes.size(), 0);
+				std::vector<bool> seen(passes.size(), false);
+				for (size_t r = 0; r < count; r++) {
+					const Record& record = frame.records[r];
+					GLuint64 start = 0, end = 0;
+					glGetQueryObjectui64v(frame.queries[2 * r], GL_QUERY_RESULT, &start);
+					glGetQueryObjectui64v(frame.queries[2 * r + 1], GL_QUERY_RESULT, &end);
+					Record& sum = sums[record.pass]; // a pass timed several times in a frame counts once, summed
+					sum.cpuMs += record.cpuMs;
+					sum.drawCalls += record.drawCalls;
+					sum.triangles += record.triangles;
+					gpuSums[record.pass] += (end - start) / 1e6;
+					seen[record.pass] = true;
+				}
+				for (size_t p = 0; p < passes.size(); p++) {
+					if (!seen[p]) { continue; }
+					passes[p].cpuMs.add(sums[p].cpuMs);
+					passes[p].gpuMs.add(float(gpuSums[p]));
+					passes[p].drawCalls.add(float(sums[p].drawCalls));
+					passes[p].triangles.add(float(sums[p].triangles));
+					if (csv.is_open()) {
+						csv << frame.index << "," << passes[p].name << "," << sums[p].cpuMs << "," << gpuSums[p] << ","
+							<< sums[p].drawCalls << "," << sums[p].triangles << "\n";
+					}
+				}
+				frame.records.clear();
+				collected++;
+				wait = false;
+			}
+		}
+
+	public:
+		bool enabled = false;
+
+		// times the code of its scope as the pass 'name', within a frame
+		class Scope {
+			PassTimers& timers;
+			bool timing = false;
+			size_t index;
+			std::chrono::steady_clock::time_point start;
+		public:
+			Scope(PassTimers& timers, const char* name) : timers(timers) {
+
+				if (!timers.enabled || !timers.inFrame) { return; }
+				Frame& frame = timers.current();
+				index = frame.records.size();
+				if (frame.queries.size() < 2 * (index + 1)) {
+					frame.queries.resize(2 * (index + 1));
+					glGenQueries(2, &frame.queries[2 * index]);
+				}
+				const DrawCounters& counters = drawCounters();
+				frame.records.push_back({ timers.passIndex(name), 0, counters.drawCalls, counters.triangles });
+				timers.depth++;
+				glQueryCounter(frame.queries[2 * index], GL_TIMESTAMP);
+				start = std::chrono::steady_clock::now();
+				timing = true;
+			}
+			~Scope() {
+
+				if (!timing) { return; }
+				Frame& frame = timers.current();
+				Record* record = &frame.records[index]; // not kept by the constructor : nested scopes may move it
+				record->cpuMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+				glQueryCounter(frame.queries[2 * index + 1], GL_TIMESTAMP);
+				frame.last = frame.queries[2 * index + 1];
+				const DrawCounters& counters = drawCounters();
+				record->drawCalls = counters.drawCalls - record->drawCalls;
+				record->triangles = counters.triangles - record->triangles;
+				timers.depth--;
+			}
+			Scope(const Scope&) = delete;
+			Scope& operator=(const Scope&) = delete;
+		};
+
+		// the passes of a frame are timed between beginFrame() and endFrame()
+		void beginFrame() {
+
+			if (!enabled) { return; }
+			if (frames - collected == ringSize) { collect(true); } // the frame reuses the oldest one's queries
+			current().index = frames;
+			inFrame = true;
+		}
+
+		void endFrame() {
+
+			if (!inFrame) { return; }
+			inFrame = false;
+			frames++;
+			collect(false);
+		}
+
+		// writes a line per pass of each frame from now on : frame, pass, cpu_ms, gpu_ms, draw_calls, triangles
+		void writeCsv(const std::string& fileName) {
+
+			csv.open(fileName);
+			if (!csv.is_open()) { std::cerr << "Error, can't write " << fileName << std::endl; throw 1; }
+			csv << "frame,pass,cpu_ms,gpu_ms,draw_calls,triangles\n";
+		}
+
+		// waits for the frames in flight, for the statistics and the CSV to be complete
+		void finish() {
+			while (collected < frames) { collect(true); }
+			if (csv.is_open()) { csv.flush(); }
+		}
+
+		// a line per pass, nested passes indented
+		std::vector<std::string> report() const {
+
+			std::vector<std::string> lines;
+			std::ostringstream header;
+			header << std::left << std::setw(20) << "pass" << "   cpu ms min/avg/p95     gpu ms min/avg/p95    draws  triangles";
+			lines.push_back(header.str());
+			for (const Pass& pass : passes) {
+				if (pass.cpuMs.empty()) { continue; }
+				std::ostringstream line;
+				line << std::fixed << std::setprecision(2) << std::left << std::setw(20) << (std::string(2 * pass.depth, ' ') + pass.name) << std::right
+					<< std::setw(7) << pass.cpuMs.min() << std::setw(7) << pass.cpuMs.avg() << std::setw(7) << pass.cpuMs.percentile(0.95f) << "  "
+					<< std::setw(7) << pass.gpuMs.min() << std::setw(7) << pass.gpuMs.avg() << std::setw(7) << pass.gpuMs.percentile(0.95f) << "  "
+					<< std::setprecision(0) << std::setw(7) << pass.drawCalls.avg() << std::setw(11) << pass.triangles.avg();
+				lines.push_back(line.str());
+			}
+			return lines;
+		}
+
+		void print(std::ostream& out) const {
+			if (passes.empty()) { return; }
+			out << "passes, over their last " << RollingStats::defaultSize << " frames :" << std::endl;
+			for (const std::string& line : report()) { out << line << std::endl; }
+		}
+
+		// draws the report in the top left corner of the bound framebuffer, of height 'h', with glut's bitmap font
+		void drawOverlay(int h) const {
+
+			GLint program = 0;
+			glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+			glUseProgram(0);
+			glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+			glDisable(GL_DEPTH_TEST);
+			glDisable(GL_BLEND);
+			glDisable(GL_TEXTURE_2D);
+			glDisable(GL_TEXTURE_3D);
+			glColor3f(1, 1, 0.4f);
+			int y = h - 15;
+			for (const std::string& line : report()) {
+				glWindowPos2i(8, y);
+				for (char c : line) { glutBitmapCharacter(GLUT_BITMAP_8_BY_13, c); }
+				y -= 15;
+			}
+			glPopAttrib();
+			glUseProgram(program);
+		}
+	};
+}
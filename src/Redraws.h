@@ -0,0 +1,33 @@
+#pragma once
+
+// Render on demand : a frame is drawn when something marked the scene dirty (input, a reshape, a finished
+// background job...) or while it changes on its own (an animation, a turntable, a load in progress), at most at
+// the frame rate ; a static scene costs no frame. The counts of the frames drawn, and why, are there to check it.
+
+#include <iostream>
+
+struct Redraws {
+
+	bool dirty = true; // the first frame is due
+	size_t marks = 0; // calls of mark(), merged into fewer frames
+	size_t frames = 0, onDemand = 0, animated = 0, exposed = 0; // drawn, and why (the window system asked for the others)
+
+	inline void mark() { dirty = true; marks++; }
+
+	// whether a frame is due, 'animating' telling if the scene changes on its own
+	inline bool due(bool animating) const { return dirty || animating; }
+
+	// counts a frame being drawn
+	inline void drawn(bool animating) {
+		frames++;
+		if (dirty) { onDemand++; }
+		else if (animating) { animated++; }
+		else { exposed++; }
+		dirty = false;
+	}
+
+	void print(std::ostream& out) const {
+		out << frames << " frames drawn : " << onDemand << " on demand (for " << marks << " changes), "
+			<< animated << " animated, " << exposed << " asked by the window system" << std::endl;
+	}
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+// Offscreen target of the scene, at the dynamic resolution of a DynamicResolution : each frame renders in its
+// lower left corner, timed by a GL_TIME_ELAPSED query (only while enabled), and is upscaled into the window. The queries are read
+// a few frames later, once available, so that timing doesn't stall the GPU. After 'idleSeconds' without a call
+// to moved(), the frames render at full resolution.
+// The scene binds target() where it would bind the window's framebuffer 0, and keeps the viewport.
+
+#include <GL/glew.h>
+#include "DynamicResolution.h"
+
+#include <chrono>
+#include <algorithm>
+
+namespace GlewGlut {
+
+	struct ScaledTarget {
+
+		DynamicResolution resolution;
+		bool enabled = true;
+		double idleSeconds = 0.25;
+
+		GLuint fbo = 0, color = 0, depth = 0;
+		GLsizei w = 0, h = 0; // of the window
+		GLsizei renderW = 0, renderH = 0; // of the current frame
+
+		void init() {
+
+			glGenFramebuffers(1, &fbo);
+			glGenTextures(1, &color);
+			glGenRenderbuffers(1, &depth);
+			glGenQueries(queryCount, queries);
+			moved();
+		}
+
+		// the target has the window's size, the frames using a part of it
+		void resize(GLsizei windowW, GLsizei windowH) {
+
+			w = std::max(1, windowW);
+			h = std::max(1, windowH);
+			GLint bound = 0; // the application's texture of the active unit, kept
+			glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+			glBindTexture(GL_TEXTURE_2D, color);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glBindTexture(GL_TEXTURE_2D, bound);
+			glBindRenderbuffer(GL_RENDERBUFFER, depth);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+			glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		}
+
+		// the camera, or anything on screen, changed
+		void moved() { lastMove = std::chrono::steady_clock::now(); }
+
+		inline GLuint target() const { return enabled ? fbo : 0; }
+
+		// the last frame was under the full resolution : more are due, up to the full one once idle
+		inline bool refining() const { return enabled && (renderW < w || renderH < h); }
+
+		// binds the target and sets the frame's viewport
+		void begin() {
+
+			collect(false);
+			resolution.idle = std::chrono::duration<double>(std::chrono::steady_clock::now() - lastMove).count() > idleSeconds;
+			renderW = enabled ? resolution.size(w) : w;
+			renderH = enabled ? resolution.size(h) : h;
+			glBindFramebuffer(GL_FRAMEBUFFER, target());
+			glViewport(0, 0, renderW, renderH);
+
+			timing = enabled; // the controller only needs the times of the scaled frames
+			if (timing) {
+				const int slot = frames % queryCount;
+				scales[slot] = renderW / float(w);
+				glBeginQuery(GL_TIME_ELAPSED, queries[slot]);
+			}
+		}
+
+		// upscales the frame into the window
+		void end() {
+
+			if (timing) {
+				glEndQuery(GL_TIME_ELAPSED);
+				frames++;
+			}
+			if (enabled) {
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+				glBlitFramebuffer(0, 0, renderW, renderH, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			glViewport(0, 0, w, h);
+			if (frames - collected == queryCount) { collect(true); } // the next frame reuses the oldest query
+		}
+
+		// GPU time of the last frame timed, in ms
+		inline float lastFrameMs() const { return lastMs; }
+
+	private:
+		static const int queryCount = 4;
+		GLuint queries[queryCount];
+		float scales[queryCount]; // of the frames timed by the queries
+		long long frames = 0, collected = 0; // timed
+		bool timing = false; // the frame between begin() and end() is
+		float lastMs = 0;
+		std::chrono::steady_clock::time_point lastMove;
+
+		// gives the available timings to the controller, in order, waiting for the oldest one or not
+		void collect(bool wait) {
+
+			while (collected < frames) {
+				const int slot = collected % queryCount;
+				GLint available = 0;
+				glGetQueryObjectiv(queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available && !wait) { return; }
+				GLuint64 ns = 0;
+				glGetQueryObjectui64v(queries[slot], GL_QUERY_RESULT, &ns);
+				lastMs = float(ns / 1e6);
+				resolution.update(lastMs, scales[slot]);
+				collected++;
+				wait = false;
+			}
+		}
+	};
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+// Where the startup and the loading go : scopes, counters and thread names recorded as trace events, written at
+// exit as the JSON of chrome://tracing and Perfetto (ui.perfetto.dev), a track per thread. Only compiled with
+// TRACE_EVENTS (the CMake option Trace) ; without it the macros are empty and their arguments aren't evaluated.
+//
+//   TRACE_SCOPE("Mesh::init");                           // the rest of the enclosing block
+//   TRACE_SCOPE_DETAIL("Mesh::loadWavefront", fileName); // with a string shown in the event's args
+//   TRACE_COUNTER("bricks pending", queue.size());
+//   TRACE_THREAD("brick loader");                        // names the calling thread's track
+//
+// Each thread appends to its own buffer, a list of chunks : an event is published by bumping its chunk's atomic
+// count, so recording takes no lock and the export reads the buffers of the threads still running. The names are
+// kept as pointers : string literals. The trace goes to $TRACE_FILE, else to trace.json.
+
+#ifdef TRACE_EVENTS
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <stdlib.h>
+#include <stdio.h>
+
+namespace Trace {
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct Event {
+		const char* name = NULL;
+		char phase = 'X'; // 'X' a complete event (a scope), 'C' a counter
+		double ts = 0, value = 0; // µs since the start ; the scope's duration in µs, or the counter's value
+		std::string detail;
+	};
+
+	// the events of a thread, appended by it alone
+	class Buffer {
+	public:
+		static const size_t chunkSize = 512;
+
+		struct Chunk {
+			Event events[chunkSize];
+			std::atomic<size_t> count{ 0 }; // of the published events
+			std::atomic<Chunk*> next{ NULL };
+		};
+
+		const int tid;
+		std::string name; // of the track, under the session's mutex
+		Chunk first;
+
+		Buffer(int tid) : tid(tid) {}
+
+		void push(Event&& event) {
+			size_t n = last->count.load(std::memory_order_relaxed);
+			if (n == chunkSize) {
+				Chunk* chunk = new Chunk();
+				last->next.store(chunk, std::memory_order_release);
+				last = chunk;
+				n = 0;
+			}
+			last->events[n] = std::move(event);
+			last->count.store(n + 1, std::memory_order_release);
+		}
+
+	private:
+		Chunk* last = &first; // the writer's
+	};
+
+	// the buffers of all the threads, written to the file when the program ends
+	class Session {
+		std::mutex mutex;
+		std::vector<Buffer*> buffers; // never freed : threads may record until the end
+		const Clock::time_point start = Clock::now();
+
+		static void writeString(std::ostream& out, const char* s) {
+			out << '"';
+			for (; *s; s++) {
+				if (*s == '"' || *s == '\\') { out << '\\' << *s; }
+				else if ((unsigned char)*s < 0x20) { char code[8]; snprintf(code, sizeof(code), "\\u%04x", *s); out << code; }
+				else { out << *s; }
+			}
+			out << '"';
+		}
+
+	public:
+		~Session() {
+			const char* env = getenv("TRACE_FILE");
+			write(env != NULL ? env : "trace.json");
+		}
+
+		inline double now() const { return std::chrono::duration<double, std::micro>(Clock::now() - start).count(); }
+
+		// the calling thread's buffer, created on its first event
+		Buffer& buffer() {
+			thread_local Buffer* local = NULL;
+			if (local == NULL) {
+				std::lock_guard<std::mutex> lock(mutex);
+				local = new Buffer(int(buffers.size()) + 1);
+				buffers.push_back(local);
+			}
+			return *local;
+		}
+
+		void threadName(const char* name) {
+			Buffer& b = buffer();
+			std::lock_guard<std::mutex> lock(mutex);
+			b.name = name;
+		}
+
+		// the events published so far, in the trace-event format
+		void write(const std::string& fileName) {
+
+			std::ofstream out(fileName);
+			if (!out.is_open()) { std::cerr << "Error, can't write " << fileName << std::endl; return; }
+			std::lock_guard<std::mutex> lock(mutex);
+			out.precision(3);
+			out << std::fixed << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+			size_t events = 0;
+			for (const Buffer* b : buffers) {
+				const std::string name = b->name.empty() ? "thread " + std::to_string(b->tid) : b->name;
+				out << (events++ > 0 ? ",\n" : "\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid << ",\"args\":{\"name\":";
+				writeString(out, name.c_str());
+				out << "}}";
+				for (const Buffer::Chunk* chunk = &b->first; chunk != NULL; chunk = chunk->next.load(std::memory_order_acquire)) {
+					const size_t count = chunk->count.load(std::memory_order_acquire);
+					for (size_t i = 0; i < count; i++) {
+						const Event& e = chunk->events[i];
+						out << ",\n{\"name\":";
+						writeString(out, e.name);
+						out << ",\"ph\":\"" << e.phase << "\",\"pid\":1,\"tid\":" << b->tid << ",\"ts\":" << e.ts;
+						if (e.phase == 'X') {
+							out << ",\"dur\":" << e.value;
+							if (!e.detail.empty()) { out << ",\"args\":{\"detail\":"; writeString(out, e.detail.c_str()); out << "}"; }
+						}
+						else { out << ",\"args\":{\"value\":" << e.value << "}"; }
+						out << "}";
+						events++;
+					}
+				}
+			}
+			out << "\n]}\n";
+			std::cout << "trace : " << events << " events written to " << fileName << std::endl;
+		}
+	};
+
+	inline Session& session() { static Session s; return s; }
+
+	// records the rest of the enclosing block
+	class Scope {
+		Event event;
+	public:
+		Scope(const char* name, const std::string& detail = std::string()) {
+			event.name = name;
+			event.detail = detail;
+			event.ts = session().now();
+		}
+		~Scope() {
+			Session& s = session();
+			event.value = s.now() - event.ts;
+			s.buffer().push(std::move(event));
+		}
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+
+	inline void counter(const char* name, double value) {
+		Session& s = session();
+		Event event;
+		event.name = name;
+		event.phase = 'C';
+		event.ts = s.now();
+		event.value = value;
+		s.buffer().push(std::move(event));
+	}
+
+	inline void threadName(const char* name) { session().threadName(name); }
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) Trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_SCOPE_DETAIL(name, detail) Trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name, detail)
+#define TRACE_COUNTER(name, value) Trace::counter(name, double(value))
+#define TRACE_THREAD(name) Trace::threadName(name)
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_SCOPE_DETAIL(name, detail) do {} while (0)
+#define TRACE_COUNTER(name, value) do {} while (0)
+#define TRACE_THREAD(name) do {} while (0)
+
+#endif
@@ -10,7 +10,7 @@ struct Vec
 public:
 
 	const T* begin() const { return values; }
-	const T* end() const { return values + S + 1; }
+	const T* end() const { return values + S; }
 	T* begin() { return values; }
 	T* end() { return values + S; }
 
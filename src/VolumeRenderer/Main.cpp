@@ -0,0 +1,414 @@
+
+// Headless renderer of Volumetric's scenes, for offline renders and image regression tests
+
+#include "../Volumetric/Voxel.h"
+#include "../Volumetric/VoxelCache.h"
+#include "../Volumetric/VolumeRayMarcher.h"
+#include "../Volumetric/BrickCache.h"
+#include "../Volumetric/AnimatedVolume.h"
+#include "../Volumetric/IsoSurfaceWriter.h"
+#include "../Volumetric/VoxelDistanceField.h"
+
+#include <stdlib.h>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <chrono>
+#include <thread>
+#include <lodepng.h>
+
+using namespace std;
+
+VoxelTexture loadModel( const string& model, const VoxelCache& cache, uint sdfSize )
+{
+	if( model.size() > 4 && model.substr( model.size() - 4 ) == ".obj" )
+	{
+		VoxelDistanceField sdf( Mesh::loadWavefront( model ), sdfSize );
+		sdf.stats.print( cout );
+		return sdf.density();
+	}
+	if( model == "perlin" )
+		return cache.get( { "PerlinNoise", PerlinNoise::version, { 256, 0 } }, []() {
+			return VoxelTexture( PerlinNoise( 256, 0 ) );
+		} );
+	if( model == "cube" )
+		return VoxelCube();
+	if( model == "mandelbulb" )
+		return cache.get( { "VoxelMandelbulb", VoxelMandelbulb::version, { 128, 3, 20 } }, []() {
+			auto mandelbulb = VoxelMandelbulb( 128, 3 );
+			mandelbulb.compute();
+			return VoxelTexture( mandelbulb );
+		} );
+	if( model == "sphere" )
+		return cache.get( { "VoxelSphere", VoxelSphere::version, { 128, 0.5 } }, []() {
+			auto sphere = VoxelSphere( 128, 0.5f );
+			sphere.compute();
+			return VoxelTexture( sphere );
+		} );
+	if( model == "mri" )
+	{
+		auto mri = VoxelMRI( "data/MRbrain/MRbrain.", 1, 109 );
+		mri.zRatio = -1; mri.xRatio = 0.7f;
+		return mri;
+	}
+	cerr << "unknown model " << model << " (perlin, cube, mandelbulb, sphere, mri or a .obj mesh)" << endl;
+	throw 1;
+}
+
+// the brick cache's LRU eviction under its budget, then the loader streaming a small volume's visible bricks
+int checkBricks()
+{
+	int failures = 0;
+	auto check = [&]( bool ok, const char* what ) {
+		cout << ( ok ? "ok : " : "FAILED : " ) << what << endl;
+		failures += !ok;
+	};
+
+	{
+		const size_t texels = 1000, bytes = texels * sizeof( float );
+		auto brick = [&]( float value ) { return make_shared<const vector<float>>( texels, value ); };
+		const BrickId a = { 0, 0, 0, 0 }, b = { 0, 1, 0, 0 }, c = { 0, 0, 1, 0 }, d = { 1, 0, 0, 0 };
+
+		BrickCache cache( 3 * bytes );
+		cache.insert( a, brick( 1 ) );
+		cache.insert( b, brick( 2 ) );
+		cache.insert( c, brick( 3 ) );
+		check( cache.find( a ) && ( *cache.find( a ) )[0] == 1, "find returns the inserted brick" );
+		cache.insert( d, brick( 4 ) ); // over budget : b is the least recently used
+		BrickCache::Stats stats = cache.getStats();
+		check( !cache.contains( b ) && cache.contains( a ) && cache.contains( c ) && cache.contains( d ), "the least recently used brick is evicted" );
+		check( stats.evictions == 1 && stats.bricks == 3 && stats.bytes == 3 * bytes, "evictions and resident bytes" );
+		check( !cache.find( b ) && cache.getStats().hits == 2 && cache.getStats().misses == 1, "hits and misses" );
+
+		cache.insert( d, brick( 5 ) );
+		check( cache.getStats().bytes == 3 * bytes && ( *cache.find( d ) )[0] == 5, "inserting a resident brick replaces it" );
+
+		cache.insert( b, make_shared<const vector<float>>( 4 * texels, 6.f ) );
+		stats = cache.getStats();
+		check( stats.bricks == 1 && cache.contains( b ) && stats.bytes == 4 * bytes, "a brick over the budget evicts the others but stays" );
+	}
+
+	{
+		const string name = "brickCheck.bricks";
+		auto sphere = VoxelSphere( 64, 0.5f );
+		sphere.compute();
+		VoxelTexture tex( sphere );
+		BrickedVolume::write( name, tex, 16 );
+		BrickedVolume volume;
+		if( !volume.open( name ) ) { cerr << "can't open " << name << endl; return EXIT_FAILURE; }
+
+		VolumeCamera camera;
+		Mat4 projection = camera.projection( 256, 256 );
+		vector<BrickId> wanted = volume.withAncestors( volume.visibleBricks( projection * camera.modelView( tex ), projection.at( 1, 1 ) * 256 / 2 ) );
+		check( !wanted.empty() && wanted.front().level == volume.levels - 1, "visible bricks, coarsest first" );
+
+		BrickCache cache;
+		{
+			BrickLoader loader( volume, cache );
+			loader.request( wanted );
+			loader.wait();
+			bool resident = true;
+			for( const BrickId& b : wanted ) { resident = resident && cache.contains( b ); }
+			check( resident && loader.failures == 0 && loader.bytesRead == wanted.size() * volume.brickBytes(), "the loader reads every wanted brick" );
+
+			loader.request( wanted );
+			check( loader.pending() == 0, "resident bricks aren't requested again" );
+		}
+
+		const BrickId& finest = wanted.back();
+		vector<float> read( volume.brickTexels() );
+		BrickCache::Brick cached = cache.find( finest );
+		check( volume.readBrick( finest, read.data() ) && cached && *cached == read, "a cached brick holds the file's texels" );
+
+		volume.close();
+		remove( name.c_str() );
+	}
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main( int argc, char* argv[] )
+{
+	TRACE_THREAD( "main" );
+	unordered_map<string, string> args = {
+		{ "model", "perlin" },
+		{ "sdfSize", "128" }, // of the signed distance field of .obj models
+		{ "width", "800" },
+		{ "height", "800" },
+		{ "rotX", "30" },
+		{ "rotZ", "10" },
+		{ "zoom", "1" },
+		{ "offset", "0" },
+		{ "threads", "0" },
+		{ "skip", "0" }, // empty-space skipping and early ray termination
+		{ "maxSteps", "1024" },
+		{ "preint", "0" }, // pre-integrated transfer function
+		{ "step", "0.01" },
+		{ "gain", "5" }, // of the transfer function
+		{ "bench", "0" }, // compares with the plain marching at 'refStep'
+		{ "refStep", "0.01" },
+		{ "out", "volume.png" },
+		{ "bricks", "" }, // writes the model as an out-of-core volume, then streams the camera's view of it
+		{ "brickSize", "32" },
+		{ "cacheMB", "1024" },
+		{ "compress", "0" }, // reports the block compression's ratio and speed on the model
+		{ "animate", "0" }, // number of 60 Hz frames to animate the model for (perlin scrolls, mandelbulb changes order)
+		{ "iso", "" }, // sweeps an iso surface's threshold from this value to 'isoEnd', re-extracting it incrementally
+		{ "isoEnd", "" },
+		{ "isoSteps", "20" },
+		{ "ply", "" }, // streams the iso surface at 'plyThreshold' to this binary PLY file
+		{ "plyThreshold", "0.5" },
+		{ "plyFrom", "" }, // bricked volume to read the surface from, instead of the model
+		{ "light", "0" }, // directional lighting from precomputed gradients and light transmittance
+		{ "lightX", "0.6" }, // direction the light travels, in texels (s,t,r)
+		{ "lightY", "0.5" },
+		{ "lightZ", "-0.7" },
+		{ "brickCheck", "0" }, // checks the brick cache and loader without a GPU, then exits
+	};
+	for( int i = 1; i + 1 < argc; i += 2 )
+	{
+		string key = argv[i];
+		if( key.size() < 3 || key.substr( 0, 2 ) != "--" || args.find( key.substr( 2 ) ) == args.end() )
+		{
+			cerr << "unknown option " << key << endl << "Options (with their default) : " << endl;
+			for( const auto& arg : args ) { cerr << " --" << arg.first << " " << arg.second << endl; }
+			return EXIT_FAILURE;
+		}
+		args[key.substr( 2 )] = argv[i + 1];
+	}
+
+	if( args["brickCheck"] == "1" ) { return checkBricks(); }
+
+	VoxelCache cache;
+	VoxelTexture tex = loadModel( args["model"], cache, stoi( args["sdfSize"] ) );
+
+	VolumeCamera camera;
+	camera.viewRotX = stof( args["rotX"] );
+	camera.viewRotZ = stof( args["rotZ"] );
+	camera.zoom = stof( args["zoom"] );
+
+	VolumeRayMarcher marcher( tex );
+	marcher.offset = stoi( args["offset"] );
+	marcher.threads = stoi( args["threads"] );
+
+	marcher.step = stof( args["step"] );
+	marcher.gain = stof( args["gain"] );
+
+	OccupancyGrid grid( tex );
+	if( args["skip"] == "1" )
+	{
+		marcher.grid = &grid;
+		marcher.earlyExit = true;
+		marcher.maxSteps = stoi( args["maxSteps"] );
+	}
+
+	TransferFunction transfer;
+	if( args["preint"] == "1" )
+	{
+		auto start = chrono::steady_clock::now();
+		transfer.gain = marcher.gain;
+		transfer.brightness = expf( 0.1f * marcher.offset );
+		transfer.fit( tex );
+		transfer.compute();
+		cout << "pre-integrated " << transfer.size << "x" << transfer.size << " table in "
+			<< chrono::duration<double, milli>( chrono::steady_clock::now() - start ).count() << " ms" << endl;
+		marcher.transfer = &transfer;
+	}
+
+	if( !args["iso"].empty() )
+	{
+		const float from = stof( args["iso"] ), to = args["isoEnd"].empty() ? from : stof( args["isoEnd"] );
+		const int steps = std::max( 1, stoi( args["isoSteps"] ) );
+		auto start = chrono::steady_clock::now();
+		IsoSurface full( tex ), incremental( tex );
+		cout << "min/max index of " << full.index.width * full.index.height * full.index.depth << " bricks in "
+			<< chrono::duration<double, milli>( chrono::steady_clock::now() - start ).count() / 2 << " ms" << endl;
+		double fullMs = 0, incrementalMs = 0;
+		for( int i = 0; i <= steps; i++ )
+		{
+			const float threshold = from + ( to - from ) * i / steps;
+			start = chrono::steady_clock::now();
+			IsoSurface scratch( tex );
+			scratch.extract( threshold );
+			fullMs += chrono::duration<double, milli>( chrono::steady_clock::now() - start ).count();
+			start = chrono::steady_clock::now();
+			incremental.update( threshold );
+			incrementalMs += chrono::duration<double, milli>( chrono::steady_clock::now() - start ).count();
+			if( scratch.cubes() != incremental.cubes() ) { cerr << "iso surfaces differ at " << threshold << endl; return EXIT_FAILURE; }
+		}
+		cout << "iso surface from " << from << " to " << to << " (" << incremental.cubes() << " cubes at the end) : "
+			<< fullMs / ( steps + 1 ) << " ms per full extraction (index included), "
+			<< incrementalMs / ( steps + 1 ) << " ms per incremental one" << endl;
+		incremental.stats.print( cout );
+	}
+
+	GradientVolume gradients;
+	TransmittanceVolume transmittance;
+	VolumeLighting lighting;
+	if( args["light"] == "1" )
+	{
+		auto start = chrono::steady_clock::now();
+		gradients = GradientVolume( tex, marcher.threads );
+		auto gradientsDone = chrono::steady_clock::now();
+		const Vec3F direction( stof( args["lightX"] ), stof( args["lightY"] ), stof( args["lightZ"] ) );
+		transmittance.gain = marcher.gain;
+		transmittance.compute( tex, direction, marcher.threads );
+		auto transmittanceDone = chrono::steady_clock::now();
+		cout << "gradients in " << chrono::duration<double, milli>( gradientsDone - start ).count() << " ms, transmittance in "
+			<< chrono::duration<double, milli>( transmittanceDone - gradientsDone ).count() << " ms" << endl;
+
+		// as Volumetric does when the light turns : a few slices per frame
+		const uint slicesPerFrame = 16;
+		double maxFrame = 0;
+		uint frames = 0;
+		TransmittanceVolume turned = transmittance;
+		turned.start( tex, Vec3F( direction[1], -direction[0], direction[2] ) );
+		while( turned.sweeping() )
+		{
+			auto frameStart = chrono::steady_clock::now();
+			turned.sweep( tex, slicesPerFrame, marcher.threads );
+			maxFrame = std::max( maxFrame, chrono::duration<double, milli>( chrono::steady_clock::now() - frameStart ).count() );
+			frames++;
+		}
+		cout << "turned light swept over " << frames << " frames of " << slicesPerFrame << " slices, at most " << maxFrame << " ms each" << endl;
+
+		lighting.gradients = &gradients;
+		lighting.transmittance = &transmittance;
+		marcher.lighting = &lighting;
+	}
+
+	uint w = stoi( args["width"] ), h = stoi( args["height"] );
+
+	if( stoi( args["animate"] ) > 0 )
+	{
+		const int frames = stoi( args["animate"] );
+		auto start = chrono::steady_clock::now();
+		unique_ptr<AnimatedVolume> animated = args["model"] == "mandelbulb"
+			? AnimatedVolume::mandelbulb( 128, 2, 8, 20 ) : AnimatedVolume::scrolling( tex, 30 );
+		cout << "first state in " << chrono::duration<double, milli>( chrono::steady_clock::now() - start ).count() << " ms" << endl;
+
+		// the uploads are only counted
+		start = chrono::steady_clock::now();
+		for( int frame = 0; frame < frames; frame++ )
+		{
+			animated->update( frame / 60.0f );
+			AnimatedVolume::Brick brick;
+			const float* data;
+			while( animated->nextUpload( brick, data ) ) {}
+			this_thread::sleep_until( start + chrono::microseconds( 16667 * ( frame + 1 ) ) );
+		}
+		double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+		animated->stats.print( cout );
+		cout << animated->stats.generations / seconds << " volume updates per second at 60 fps" << endl;
+	}
+
+	if( args["compress"] == "1" )
+	{
+		auto start = chrono::steady_clock::now();
+		CompressedVoxels compressed( tex.data(), tex.width, tex.height, tex.depth, marcher.threads );
+		cout << "compressed " << tex.size() * sizeof( float ) / ( 1 << 20 ) << " MB to " << compressed.bytes() / 1024 << " KB ("
+			<< compressed.ratio() << "x) in " << chrono::duration<double, milli>( chrono::steady_clock::now() - start ).count() << " ms" << endl;
+
+		vector<float> decoded( tex.size() );
+		const unsigned int threads[2] = { 1, marcher.threads == 0 ? Parallel::threadCount() : marcher.threads };
+		for( unsigned int t : threads )
+		{
+			start = chrono::steady_clock::now();
+			const unsigned int repeats = 5;
+			for( unsigned int i = 0; i < repeats; i++ ) { compressed.decompress( decoded.data(), t ); }
+			double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count() / repeats;
+			cout << "decompression on " << t << " threads : " << tex.size() * sizeof( float ) / seconds / 1e9 << " GB/s" << endl;
+		}
+		float maxError = 0;
+		for( size_t i = 0; i < tex.size(); i++ ) { maxError = std::max( maxError, fabsf( decoded[i] - tex.data()[i] ) ); }
+		cout << "max error " << maxError << " (bound " << compressed.maxError() << ")" << endl;
+
+		// at() goes through the cache of decompressed blocks
+		start = chrono::steady_clock::now();
+		double sum = 0;
+		for( size_t i = 0; i < tex.size(); i++ ) { sum += compressed.at( i ); }
+		double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+		cout << "sequential at() : " << tex.size() / seconds / 1e6 << " Mvoxels/s (sum " << sum << ")" << endl;
+	}
+
+	if( !args["bricks"].empty() )
+	{
+		auto start = chrono::steady_clock::now();
+		BrickedVolume::write( args["bricks"], tex, stoi( args["brickSize"] ) );
+		BrickedVolume volume;
+		if( !volume.open( args["bricks"] ) ) { cerr << "can't open " << args["bricks"] << endl; return EXIT_FAILURE; }
+		cout << "wrote " << args["bricks"] << " : " << volume.levels << " levels of " << volume.brickSize << "^3 bricks in "
+			<< chrono::duration<double, milli>( chrono::steady_clock::now() - start ).count() << " ms" << endl;
+
+		// what Volumetric streams for this camera
+		Mat4 projection = camera.projection( w, h );
+		vector<BrickId> wanted = volume.withAncestors( volume.visibleBricks( projection * camera.modelView( tex ), projection.at( 1, 1 ) * h / 2 ) );
+		size_t levels[16] = {};
+		for( const BrickId& b : wanted ) { levels[b.level]++; }
+		cout << wanted.size() << " bricks wanted (by level :";
+		for( uint l = 0; l < volume.levels; l++ ) { cout << " " << levels[l]; }
+		cout << ")" << endl;
+
+		BrickCache bricks( size_t( stoi( args["cacheMB"] ) ) << 20 );
+		BrickLoader loader( volume, bricks );
+		for( uint pass = 0; pass < 2; pass++ )
+		{
+			start = chrono::steady_clock::now();
+			loader.request( wanted );
+			loader.wait();
+			for( const BrickId& b : wanted ) { bricks.find( b ); }
+			cout << "pass " << pass << " : " << loader.bytesRead / ( 1 << 20 ) << " MB read in "
+				<< chrono::duration<double, milli>( chrono::steady_clock::now() - start ).count() << " ms, ";
+			bricks.getStats().print( cout );
+		}
+	}
+	if( !args["ply"].empty() )
+	{
+		IsoSurfaceWriter writer;
+		const float threshold = stof( args["plyThreshold"] );
+		IsoSurfaceWriter::Stats written;
+		if( args["plyFrom"].empty() ) { written = writer.write( args["ply"], tex.width, tex.height, tex.depth, IsoSurfaceWriter::reader( tex ), threshold ); }
+		else
+		{
+			BrickedVolume volume;
+			if( !volume.open( args["plyFrom"] ) ) { cerr << "can't open " << args["plyFrom"] << endl; return EXIT_FAILURE; }
+			written = writer.write( args["ply"], volume.width, volume.height, volume.depth, IsoSurfaceWriter::reader( volume ), threshold );
+		}
+		cout << "wrote " << args["ply"] << " : ";
+		written.print( cout );
+	}
+
+	vector<unsigned char> image;
+	VolumeRenderStats stats = marcher.render( camera, w, h, image );
+	stats.print( cout );
+
+	if( args["bench"] == "1" )
+	{
+		cout << "occupancy grid : " << 100 * grid.emptyRatio() << "% of empty cells" << endl;
+		VolumeRayMarcher reference( tex );
+		reference.offset = marcher.offset;
+		reference.threads = marcher.threads;
+		reference.step = stof( args["refStep"] );
+		reference.gain = marcher.gain;
+		vector<unsigned char> refImage;
+		VolumeRenderStats refStats = reference.render( camera, w, h, refImage );
+		cout << "reference : ";
+		refStats.print( cout );
+		int maxDiff = 0;
+		double meanDiff = 0;
+		for( size_t i = 0; i < image.size(); i++ )
+		{
+			int diff = abs( int( image[i] ) - refImage[i] );
+			maxDiff = std::max( maxDiff, diff );
+			meanDiff += diff;
+		}
+		cout << "difference with the reference : max " << maxDiff << ", mean " << meanDiff / image.size()
+			<< " ; " << double( refStats.samples ) / stats.samples << "x fewer samples, "
+			<< refStats.seconds / stats.seconds << "x faster" << endl;
+	}
+
+	unsigned error = lodepng::encode( args["out"], image, w, h );
+	if( error ) { cerr << "error when writing " << args["out"] << " " << lodepng_error_text( error ) << endl; return EXIT_FAILURE; }
+	cout << "wrote " << args["out"] << endl;
+
+	return EXIT_SUCCESS;
+}
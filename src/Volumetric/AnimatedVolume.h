@@ -0,0 +1,243 @@
+#pragma once
+
+#include "Voxel.h"
+#include <Parallel.h>
+
+#include <memory>
+#include <future>
+#include <chrono>
+#include <functional>
+
+// A volume that changes over time. Each generation recomputes, on worker threads, the bricks that may
+// change, into a back staging buffer ; once done it becomes the front one, whose changed bricks are
+// uploaded a few per frame (see Volumetric's display()) while the next generation is computed.
+struct AnimatedVolume {
+
+	struct Brick {
+		uint s, t, r; // origin, in texels
+		uint w, h, d; // size, in texels
+		size_t offset; // of its texels in the staging buffers (s fastest, then t, then r)
+		inline size_t texels() const { return size_t( w ) * h * d; }
+	};
+
+	struct Stats {
+		size_t generations = 0;
+		size_t computed = 0, skipped = 0, unchanged = 0, uploaded = 0; // bricks
+		size_t bytesUploaded = 0;
+		double computeSeconds = 0;
+
+		void print( ostream& out ) const
+		{
+			out << generations << " generations (" << 1000 * computeSeconds / std::max( size_t( 1 ), generations ) << " ms each) : "
+				<< computed << " bricks computed, " << skipped << " skipped, " << unchanged << " unchanged, "
+				<< uploaded << " uploaded (" << bytesUploaded / ( 1 << 20 ) << " MB)" << endl;
+		}
+	};
+
+	typedef function<void( const Brick& brick, float time, float* dst )> Compute;
+	typedef function<bool( const Brick& brick, float from, float to )> MayChange;
+
+	uint brickSize;
+	vector<Brick> bricks;
+	Compute compute; // called on worker threads
+	MayChange mayChange; // optional : the bricks that can't change between two times aren't recomputed
+	VoxelTexture tex; // the last computed state (the uploaded one once the front is uploaded)
+	Stats stats;
+
+	AnimatedVolume( uint w, uint h, uint d, const Compute& compute, const MayChange& mayChange = MayChange(), uint brickSize = 32 )
+		: brickSize( brickSize ), compute( compute ), mayChange( mayChange )
+	{
+		tex.width = w; tex.height = h; tex.depth = d;
+		size_t offset = 0;
+		for( uint r = 0; r < d; r += brickSize )
+			for( uint t = 0; t < h; t += brickSize )
+				for( uint s = 0; s < w; s += brickSize )
+				{
+					Brick b = { s, t, r, std::min( brickSize, w - s ), std::min( brickSize, h - t ), std::min( brickSize, d - r ), offset };
+					bricks.push_back( b );
+					offset += b.texels();
+				}
+		for( Staging& staging : stagings ) { staging.data.resize( offset ); }
+
+		// the first state is computed right away
+		tex.voxels.resize( tex.size() );
+		Parallel::forEach( bricks.size(), [&]( size_t i, unsigned int ) {
+			compute( bricks[i], 0, &stagings[0].data[bricks[i].offset] );
+			copy( bricks[i], &stagings[0].data[bricks[i].offset], true );
+		} );
+	}
+	AnimatedVolume( const AnimatedVolume& ) = delete;
+	AnimatedVolume& operator=( const AnimatedVolume& ) = delete;
+	~AnimatedVolume() { if( job.valid() ) { job.wait(); } }
+
+	// to call every frame : starts computing the volume at 'time' once the previous generation is uploaded
+	void update( float time )
+	{
+		if( job.valid() )
+		{
+			if( job.wait_for( chrono::seconds( 0 ) ) != future_status::ready ) { return; }
+			Stats done = job.get();
+			stats.unchanged += done.unchanged;
+			stats.computeSeconds += done.computeSeconds;
+			backReady = true;
+		}
+		if( backReady )
+		{
+			if( front().uploaded < front().changed.size() ) { return; }
+			frontIndex = 1 - frontIndex;
+			backReady = false;
+			stats.generations++;
+		}
+
+		Staging& staging = back();
+		staging.changed.clear();
+		staging.uploaded = 0;
+		vector<uint> todo;
+		for( uint i = 0; i < bricks.size(); i++ )
+		{
+			if( !mayChange || mayChange( bricks[i], lastTime, time ) ) { todo.push_back( i ); }
+			else { stats.skipped++; }
+		}
+		stats.computed += todo.size();
+		lastTime = time;
+
+		job = async( launch::async, [this, &staging, todo, time]() {
+			TRACE_THREAD( "animated volume" );
+			TRACE_SCOPE( "AnimatedVolume::compute" );
+			auto start = chrono::steady_clock::now();
+			Stats done;
+			vector<char> changed( todo.size(), 0 );
+			Parallel::forEach( todo.size(), [&]( size_t i, unsigned int ) {
+				const Brick& b = bricks[todo[i]];
+				float* dst = &staging.data[b.offset];
+				compute( b, time, dst );
+				changed[i] = copy( b, dst, false );
+			} );
+			for( size_t i = 0; i < todo.size(); i++ )
+			{
+				if( changed[i] ) { staging.changed.push_back( todo[i] ); }
+				else { done.unchanged++; }
+			}
+			done.computeSeconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+			return done;
+		} );
+	}
+
+	// the next changed brick of the front buffer to upload, if any
+	bool nextUpload( Brick& brick, const float*& data )
+	{
+		Staging& staging = front();
+		if( staging.uploaded >= staging.changed.size() ) { return false; }
+		brick = bricks[staging.changed[staging.uploaded++]];
+		data = &staging.data[brick.offset];
+		stats.uploaded++;
+		stats.bytesUploaded += brick.texels() * sizeof( float );
+		return true;
+	}
+
+	// Perlin noise (or any texture) scrolling along its 'r' axis, at 'speed' texels per second
+	static unique_ptr<AnimatedVolume> scrolling( const VoxelTexture& base, float speed )
+	{
+		shared_ptr<VoxelTexture> src = make_shared<VoxelTexture>( base );
+		src->decompress();
+		unique_ptr<AnimatedVolume> dst( new AnimatedVolume( base.width, base.height, base.depth, [src, speed]( const Brick& b, float time, float* dst ) {
+			const uint W = src->width, H = src->height, D = src->depth;
+			const float shift = speed * time;
+			const float a = shift - floorf( shift );
+			const uint offset = uint( ( long long )( floorf( shift ) ) % D + D ) % D;
+			const float* data = src->data();
+			for( uint k = 0; k < b.d; k++ )
+			{
+				const float* slice0 = data + size_t( W ) * H * ( ( b.r + k + offset ) % D );
+				const float* slice1 = data + size_t( W ) * H * ( ( b.r + k + offset + 1 ) % D );
+				for( uint j = 0; j < b.h; j++ )
+				{
+					const size_t row = b.s + size_t( W ) * ( b.t + j );
+					for( uint i = 0; i < b.w; i++ )
+						*dst++ = ( 1 - a ) * slice0[row + i] + a * slice1[row + i];
+				}
+			}
+		} ) );
+		dst->tex.xRatio = base.xRatio; dst->tex.yRatio = base.yRatio; dst->tex.zRatio = base.zRatio;
+		return dst;
+	}
+
+	// Mandelbulb whose (real) order goes back and forth between 'minOrder' and 'maxOrder' every 'period' seconds
+	static unique_ptr<AnimatedVolume> mandelbulb( uint size, float minOrder, float maxOrder, float period, int maxIter = 20 )
+	{
+		auto order = [=]( float time ) {
+			return minOrder + ( maxOrder - minOrder ) * 0.5f * ( 1 - cosf( 2 * float( M_PI ) * time / period ) );
+		};
+		return unique_ptr<AnimatedVolume>( new AnimatedVolume( size, size, size, [=]( const Brick& b, float time, float* dst ) {
+			const float n = order( time );
+			for( uint k = 0; k < b.d; k++ )
+				for( uint j = 0; j < b.h; j++ )
+					for( uint i = 0; i < b.w; i++ )
+					{
+						// oriented like VoxelMandelbulb : at( x, y, d ) is the texel ( d, x, y )
+						float x = 2 * ( float( b.t + j ) / size - 0.5f );
+						float y = 2 * ( float( b.r + k ) / size - 0.5f );
+						float z = 2 * ( float( b.s + i ) / size - 0.5f );
+						float cx = x, cy = y, cz = z;
+						int it = 0;
+						for( ; it < maxIter; it++ )
+						{
+							float r2 = x*x + y*y + z*z;
+							if( r2 > 1 ) { break; }
+							float r = sqrtf( r2 );
+							float phi = atan2f( y, x ) * n;
+							float theta = atan2f( sqrtf( x*x + y*y ), z ) * n;
+							float rn = powf( r, n );
+							x = rn * sinf( theta ) * cosf( phi ) + cx;
+							y = rn * sinf( theta ) * sinf( phi ) + cy;
+							z = rn * cosf( theta ) + cz;
+						}
+						*dst++ = ( 0.3f * it ) / maxIter;
+					}
+		}, [=]( const Brick& b, float, float ) {
+			// out of the unit ball, the first iteration escapes whatever the order
+			float d2 = 0;
+			const uint lo[3] = { b.t, b.r, b.s }, extent[3] = { b.h, b.d, b.w };
+			for( uint c = 0; c < 3; c++ )
+			{
+				float a = 2 * ( float( lo[c] ) / size - 0.5f ), z = 2 * ( float( lo[c] + extent[c] - 1 ) / size - 0.5f );
+				float closest = std::min( std::max( 0.0f, a ), z );
+				d2 += closest * closest;
+			}
+			return d2 <= 1;
+		}, 16 ) ); // small bricks, for the corners to be skipped
+	}
+
+private:
+	struct Staging {
+		vector<float> data; // all the bricks, at their offset
+		vector<uint> changed; // bricks to upload
+		size_t uploaded = 0;
+	};
+	Staging stagings[2];
+	uint frontIndex = 0;
+	bool backReady = false;
+	float lastTime = 0;
+	future<Stats> job; // computes the back buffer
+
+	inline Staging& front() { return stagings[frontIndex]; }
+	inline Staging& back() { return stagings[1 - frontIndex]; }
+
+	// copies a computed brick to 'tex', returns true if it changed it
+	bool copy( const Brick& b, const float* src, bool force )
+	{
+		bool changed = force;
+		float* data = tex.data();
+		for( uint k = 0; k < b.d; k++ )
+			for( uint j = 0; j < b.h; j++ )
+			{
+				float* row = data + b.s + size_t( tex.width ) * ( b.t + j + size_t( tex.height ) * ( b.r + k ) );
+				for( uint i = 0; i < b.w; i++, src++ )
+				{
+					changed |= row[i] != *src;
+					row[i] = *src;
+				}
+			}
+		return changed;
+	}
+};
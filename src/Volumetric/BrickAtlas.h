@@ -0,0 +1,108 @@
+#pragma once
+
+#include "BrickCache.h"
+
+// GPU side of a BrickedVolume : the resident bricks are packed in the slots of a 3D texture, and an
+// indirection texture gives, for each brick of level 0, the slot of the finest resident brick covering it
+struct BrickAtlas {
+
+	uint slotsPerAxis = 6;
+	uint slotSize = 0; // brickSize + apron
+	vector<uint64_t> slotBricks; // key of the brick in each slot, or ~0
+	vector<uint> slotLastUse; // frame of the last use, to evict the least recently used slots
+	unordered_map<uint64_t, uint> slots;
+	uint frame = 0;
+	size_t uploads = 0;
+
+	// RGBA per brick of level 0 : position of the slot (in slots) and level, or -1 when nothing covers it
+	uint indirectionW = 0, indirectionH = 0, indirectionD = 0;
+	vector<float> indirection;
+
+	GLuint id = 0, indirectionId = 0;
+
+	static const uint64_t noBrick = ~uint64_t( 0 );
+
+	inline uint slotCount() const { return slotsPerAxis * slotsPerAxis * slotsPerAxis; }
+
+	void init( const BrickedVolume& volume, uint slotsPerAxis = 6 )
+	{
+		this->slotsPerAxis = slotsPerAxis;
+		slotSize = volume.apronSize();
+		slotBricks.assign( slotCount(), uint64_t( noBrick ) ); // a copy : assign() takes a reference, and noBrick has no definition
+		slotLastUse.assign( slotCount(), 0 );
+		slots.clear();
+		indirectionW = volume.bricksX( 0 );
+		indirectionH = volume.bricksY( 0 );
+		indirectionD = volume.bricksZ( 0 );
+		indirection.assign( size_t( indirectionW ) * indirectionH * indirectionD * 4, -1.0f );
+	}
+
+	// Makes the 'wanted' bricks (coarsest first) resident, uploading at most 'maxUploads' of the ones
+	// already in the CPU cache. Slots not wanted this frame are reused. Returns the number of uploads.
+	uint update( const BrickedVolume& volume, const vector<BrickId>& wanted, BrickCache& cache, uint maxUploads )
+	{
+		frame++;
+		uint uploaded = 0;
+		uint nextSlot = 0; // slots are looked up once per frame
+		for( const BrickId& b : wanted )
+		{
+			auto found = slots.find( b.key() );
+			if( found != slots.end() ) { slotLastUse[found->second] = frame; continue; }
+			if( uploaded >= maxUploads ) { continue; }
+			BrickCache::Brick brick = cache.find( b );
+			if( !brick ) { continue; }
+
+			// a free slot, else the least recently used one not wanted this frame
+			uint slot = slotCount();
+			for( ; nextSlot < slotCount() && slot == slotCount(); nextSlot++ )
+				if( slotBricks[nextSlot] == noBrick ) { slot = nextSlot; }
+			if( slot == slotCount() )
+			{
+				uint oldest = frame;
+				for( uint i = 0; i < slotCount(); i++ )
+					if( slotLastUse[i] < oldest ) { oldest = slotLastUse[i]; slot = i; }
+			}
+			if( slot == slotCount() ) { break; } // the atlas is full of wanted bricks
+
+			if( slotBricks[slot] != noBrick ) { slots.erase( slotBricks[slot] ); }
+			slotBricks[slot] = b.key();
+			slotLastUse[slot] = frame;
+			slots[b.key()] = slot;
+			upload( slot, brick->data() );
+			uploaded++;
+			uploads++;
+		}
+		if( uploaded > 0 )
+		{
+			computeIndirection( volume );
+			uploadIndirection();
+		}
+		return uploaded;
+	}
+
+	void computeIndirection( const BrickedVolume& volume )
+	{
+		for( uint z = 0; z < indirectionD; z++ )
+			for( uint y = 0; y < indirectionH; y++ )
+				for( uint x = 0; x < indirectionW; x++ )
+				{
+					float* dst = &indirection[4 * ( x + indirectionW * ( y + size_t( indirectionH ) * z ) )];
+					dst[0] = dst[1] = dst[2] = dst[3] = -1;
+					for( uint level = 0; level < volume.levels; level++ )
+					{
+						auto found = slots.find( BrickId{ level, x >> level, y >> level, z >> level }.key() );
+						if( found == slots.end() ) { continue; }
+						const uint slot = found->second;
+						dst[0] = float( slot % slotsPerAxis );
+						dst[1] = float( ( slot / slotsPerAxis ) % slotsPerAxis );
+						dst[2] = float( slot / ( slotsPerAxis * slotsPerAxis ) );
+						dst[3] = float( level );
+						break;
+					}
+				}
+	}
+
+	void generate(); // allocates the atlas (GL_R32F) and the indirection (GL_RGBA32F) textures
+	void upload( uint slot, const float* brick );
+	void uploadIndirection();
+};
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "BrickedVolume.h"
+
+#include <list>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+
+// Bricks resident in memory, under a byte budget : the least recently used ones are evicted first
+struct BrickCache {
+
+	typedef shared_ptr<const vector<float>> Brick;
+
+	struct Stats {
+		size_t hits = 0, misses = 0, loads = 0, evictions = 0;
+		size_t bricks = 0, bytes = 0; // resident
+
+		inline double hitRate() const { return hits + misses == 0 ? 0.0 : double( hits ) / ( hits + misses ); }
+		void print( ostream& out ) const
+		{
+			out << bricks << " resident bricks (" << bytes / ( 1 << 20 ) << " MB), hit rate " << 100 * hitRate() << "% ("
+				<< hits << " hits, " << misses << " misses), " << loads << " loads, " << evictions << " evictions" << endl;
+		}
+	};
+
+	size_t budget; // in bytes
+
+	BrickCache( size_t budget = size_t( 1 ) << 30 ) : budget( budget ) {}
+
+	// returns NULL if the brick isn't resident
+	Brick find( const BrickId& id )
+	{
+		lock_guard<mutex> lock( m );
+		auto it = bricks.find( id.key() );
+		if( it == bricks.end() ) { stats.misses++; return NULL; }
+		stats.hits++;
+		lru.splice( lru.begin(), lru, it->second.second );
+		return it->second.first;
+	}
+
+	// doesn't count as an access
+	bool contains( const BrickId& id )
+	{
+		lock_guard<mutex> lock( m );
+		return bricks.find( id.key() ) != bricks.end();
+	}
+
+	void insert( const BrickId& id, const Brick& brick )
+	{
+		lock_guard<mutex> lock( m );
+		const uint64_t key = id.key();
+		auto it = bricks.find( key );
+		if( it != bricks.end() )
+		{
+			stats.bytes -= it->second.first->size() * sizeof( float );
+			it->second.first = brick;
+			lru.splice( lru.begin(), lru, it->second.second );
+		}
+		else
+		{
+			lru.push_front( key );
+			bricks[key] = make_pair( brick, lru.begin() );
+		}
+		stats.loads++;
+		stats.bytes += brick->size() * sizeof( float );
+		// never evicts the brick just inserted
+		while( stats.bytes > budget && lru.size() > 1 )
+		{
+			auto last = bricks.find( lru.back() );
+			stats.bytes -= last->second.first->size() * sizeof( float );
+			bricks.erase( last );
+			lru.pop_back();
+			stats.evictions++;
+		}
+		stats.bricks = bricks.size();
+	}
+
+	Stats getStats()
+	{
+		lock_guard<mutex> lock( m );
+		return stats;
+	}
+
+private:
+	mutex m;
+	list<uint64_t> lru; // most recently used first
+	unordered_map<uint64_t, pair<Brick, list<uint64_t>::iterator>> bricks;
+	Stats stats;
+};
+
+// Reads the requested bricks into the cache on I/O threads
+struct BrickLoader {
+
+	const BrickedVolume& volume;
+	BrickCache& cache;
+
+	BrickLoader( const BrickedVolume& volume, BrickCache& cache, uint threadCount = 2 ) : volume( volume ), cache( cache )
+	{
+		for( uint i = 0; i < threadCount; i++ ) { threads.push_back( thread( [this]() { run(); } ) ); }
+	}
+	BrickLoader( const BrickLoader& ) = delete;
+	BrickLoader& operator=( const BrickLoader& ) = delete;
+
+	~BrickLoader()
+	{
+		{
+			lock_guard<mutex> lock( m );
+			stopping = true;
+		}
+		wakeUp.notify_all();
+		for( auto& t : threads ) { t.join(); }
+	}
+
+	// replaces the pending requests (the previous frame's ones are obsolete), in priority order
+	void request( const vector<BrickId>& ids )
+	{
+		{
+			lock_guard<mutex> lock( m );
+			queue.clear();
+			queued.clear();
+			for( const BrickId& id : ids )
+			{
+				if( loading.count( id.key() ) || queued.count( id.key() ) || cache.contains( id ) ) { continue; }
+				queue.push_back( id.key() );
+				queued.insert( id.key() );
+			}
+			TRACE_COUNTER( "bricks queued", queue.size() );
+		}
+		wakeUp.notify_all();
+	}
+
+	// requests not loaded yet, including the ones being read
+	size_t pending()
+	{
+		lock_guard<mutex> lock( m );
+		return queue.size() + loading.size();
+	}
+
+	void wait()
+	{
+		unique_lock<mutex> lock( m );
+		idle.wait( lock, [this]() { return queue.empty() && loading.empty(); } );
+	}
+
+	atomic<size_t> bytesRead{ 0 };
+	atomic<size_t> failures{ 0 };
+
+private:
+	vector<thread> threads;
+	mutex m;
+	condition_variable wakeUp, idle;
+	deque<uint64_t> queue;
+	unordered_set<uint64_t> queued, loading;
+	bool stopping = false;
+
+	void run()
+	{
+		TRACE_THREAD( "brick loader" );
+		for( ;; )
+		{
+			uint64_t key;
+			{
+				unique_lock<mutex> lock( m );
+				wakeUp.wait( lock, [this]() { return stopping || !queue.empty(); } );
+				if( stopping ) { return; }
+				key = queue.front();
+				queue.pop_front();
+				queued.erase( key );
+				loading.insert( key );
+			}
+			TRACE_SCOPE( "read brick" );
+			auto brick = make_shared<vector<float>>( volume.brickTexels() );
+			if( volume.readBrick( BrickId::fromKey( key ), brick->data() ) )
+			{
+				cache.insert( BrickId::fromKey( key ), brick );
+				bytesRead += volume.brickBytes();
+			}
+			else
+			{
+				failures++;
+			}
+			{
+				lock_guard<mutex> lock( m );
+				loading.erase( key );
+				if( queue.empty() && loading.empty() ) { idle.notify_all(); }
+			}
+		}
+	}
+};
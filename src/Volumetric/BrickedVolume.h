@@ -0,0 +1,331 @@
+#pragma once
+
+#include "Voxel.h"
+#include <Mat4.h>
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Identifies a brick : its level of detail (0 = full resolution) and its position in bricks
+struct BrickId {
+	uint level, x, y, z;
+
+	inline uint64_t key() const
+	{ return ( uint64_t( level ) << 60 ) | ( uint64_t( z ) << 40 ) | ( uint64_t( y ) << 20 ) | uint64_t( x ); }
+	static inline BrickId fromKey( uint64_t k )
+	{ return { uint( k >> 60 ), uint( k & 0xFFFFF ), uint( ( k >> 20 ) & 0xFFFFF ), uint( ( k >> 40 ) & 0xFFFFF ) }; }
+};
+
+// Volume stored on disk as a pyramid of bricks, so that only the visible ones at the needed
+// resolution are read. Each brick holds brickSize^3 texels plus a one texel apron, so that it
+// can be linearly filtered alone. Texels are in the GL texture order (s fastest, then t, then r).
+struct BrickedVolume {
+
+	struct Header {
+		char magic[4];
+		uint32_t width, height, depth; // of level 0, in texels
+		uint32_t brickSize; // without the apron
+		uint32_t levels;
+		uint32_t padding[2];
+	};
+
+	uint width = 0, height = 0, depth = 0;
+	uint brickSize = 32;
+	uint levels = 0;
+	vector<size_t> levelOffsets; // index of the first brick of each level
+
+	string fileName;
+#ifdef WIN32
+	FILE* file = NULL;
+	mutex fileMutex;
+#else
+	int fd = -1;
+#endif
+
+	BrickedVolume() {}
+	BrickedVolume( const BrickedVolume& ) = delete;
+	BrickedVolume& operator=( const BrickedVolume& ) = delete;
+	~BrickedVolume() { close(); }
+
+	inline uint apronSize() const { return brickSize + 2; }
+	inline size_t brickTexels() const { return size_t( apronSize() ) * apronSize() * apronSize(); }
+	inline size_t brickBytes() const { return brickTexels() * sizeof( float ); }
+
+	// size of a level, in texels
+	inline uint levelSize( uint size, uint level ) const { return std::max( 1u, ( size + ( 1u << level ) - 1 ) >> level ); }
+	inline uint levelWidth( uint level ) const { return levelSize( width, level ); }
+	inline uint levelHeight( uint level ) const { return levelSize( height, level ); }
+	inline uint levelDepth( uint level ) const { return levelSize( depth, level ); }
+
+	// size of a level, in bricks
+	inline uint bricks( uint texels ) const { return ( texels + brickSize - 1 ) / brickSize; }
+	inline uint bricksX( uint level ) const { return bricks( levelWidth( level ) ); }
+	inline uint bricksY( uint level ) const { return bricks( levelHeight( level ) ); }
+	inline uint bricksZ( uint level ) const { return bricks( levelDepth( level ) ); }
+
+	inline bool exists( const BrickId& b ) const
+	{ return b.level < levels && b.x < bricksX( b.level ) && b.y < bricksY( b.level ) && b.z < bricksZ( b.level ); }
+
+	inline size_t index( const BrickId& b ) const
+	{ return levelOffsets[b.level] + b.x + bricksX( b.level ) * ( b.y + size_t( bricksY( b.level ) ) * b.z ); }
+
+	inline size_t offset( const BrickId& b ) const { return sizeof( Header ) + index( b ) * brickBytes(); }
+
+	void setSize( uint w, uint h, uint d, uint brick )
+	{
+		width = w; height = h; depth = d;
+		brickSize = brick;
+		levelOffsets.clear();
+		size_t count = 0;
+		for( levels = 0; ; levels++ )
+		{
+			levelOffsets.push_back( count );
+			count += size_t( bricksX( levels ) ) * bricksY( levels ) * bricksZ( levels );
+			if( bricksX( levels ) == 1 && bricksY( levels ) == 1 && bricksZ( levels ) == 1 ) { levels++; break; }
+		}
+	}
+
+	bool open( const string& name )
+	{
+		close();
+		fileName = name;
+		Header header;
+#ifdef WIN32
+		file = fopen( name.c_str(), "rb" );
+		if( file == NULL ) { return false; }
+		if( fread( &header, sizeof( Header ), 1, file ) != 1 ) { close(); return false; }
+#else
+		fd = ::open( name.c_str(), O_RDONLY );
+		if( fd < 0 ) { return false; }
+		if( pread( fd, &header, sizeof( Header ), 0 ) != sizeof( Header ) ) { close(); return false; }
+#endif
+		if( memcmp( header.magic, "BRK", 4 ) != 0 ) { cerr << name << " isn't a bricked volume" << endl; close(); return false; }
+		setSize( header.width, header.height, header.depth, header.brickSize );
+		return true;
+	}
+
+	void close()
+	{
+#ifdef WIN32
+		if( file != NULL ) { fclose( file ); file = NULL; }
+#else
+		if( fd >= 0 ) { ::close( fd ); fd = -1; }
+#endif
+	}
+
+	// thread-safe
+	bool readBrick( const BrickId& b, float* dst ) const
+	{
+#ifdef WIN32
+		lock_guard<mutex> lock( const_cast<mutex&>( fileMutex ) );
+		if( _fseeki64( file, offset( b ), SEEK_SET ) != 0 ) { return false; }
+		return fread( dst, brickBytes(), 1, file ) == 1;
+#else
+		size_t done = 0;
+		while( done < brickBytes() )
+		{
+			ssize_t n = pread( fd, (char*)dst + done, brickBytes() - done, off_t( offset( b ) + done ) );
+			if( n <= 0 ) { return false; }
+			done += size_t( n );
+		}
+		return true;
+#endif
+	}
+
+	// reads the slice 'k' (apron included, in [0;apronSize())) of a brick : apronSize()^2 texels, thread-safe
+	bool readBrickSlice( const BrickId& b, uint k, float* dst ) const
+	{
+		const size_t bytes = size_t( apronSize() ) * apronSize() * sizeof( float );
+		const size_t start = offset( b ) + k * bytes;
+#ifdef WIN32
+		lock_guard<mutex> lock( const_cast<mutex&>( fileMutex ) );
+		if( _fseeki64( file, start, SEEK_SET ) != 0 ) { return false; }
+		return fread( dst, bytes, 1, file ) == 1;
+#else
+		size_t done = 0;
+		while( done < bytes )
+		{
+			ssize_t n = pread( fd, (char*)dst + done, bytes - done, off_t( start + done ) );
+			if( n <= 0 ) { return false; }
+			done += size_t( n );
+		}
+		return true;
+#endif
+	}
+
+	// Writes a bricked volume of the level 0 texels 'texel( s, t, r )' (coordinates are clamped).
+	// Coarser levels are 2x2x2 averages of the previous one, read back through 'previous'.
+	static void write(
+		const string& name, uint w, uint h, uint d,
+		const function<float( uint s, uint t, uint r )>& texel,
+		uint brickSize = 32
+	) {
+		BrickedVolume volume;
+		volume.setSize( w, h, d, brickSize );
+
+		FILE* out = fopen( name.c_str(), "wb" );
+		if( out == NULL ) { cerr << "can't write " << name << endl; throw 1; }
+		Header header;
+		memset( &header, 0, sizeof( Header ) );
+		memcpy( header.magic, "BRK", 4 );
+		header.width = w; header.height = h; header.depth = d;
+		header.brickSize = brickSize;
+		header.levels = volume.levels;
+		fwrite( &header, sizeof( Header ), 1, out );
+
+		// the level being written is kept in memory one brick at a time, the previous one is read back
+		BrickedVolume previous;
+		vector<float> brick( volume.brickTexels() );
+		unordered_map<uint64_t, vector<float>> cached; // the neighbourhood of the brick being written
+		for( uint level = 0; level < volume.levels; level++ )
+		{
+			if( level > 0 )
+			{
+				fflush( out );
+				previous.open( name );
+			}
+			const uint lw = volume.levelWidth( level ), lh = volume.levelHeight( level ), ld = volume.levelDepth( level );
+			auto levelTexel = [&]( int s, int t, int r ) -> float {
+				s = std::min( std::max( s, 0 ), int( lw ) - 1 );
+				t = std::min( std::max( t, 0 ), int( lh ) - 1 );
+				r = std::min( std::max( r, 0 ), int( ld ) - 1 );
+				if( level == 0 ) { return texel( s, t, r ); }
+				// average of the previous level
+				const uint pw = volume.levelWidth( level - 1 ), ph = volume.levelHeight( level - 1 ), pd = volume.levelDepth( level - 1 );
+				float sum = 0;
+				for( uint i = 0; i < 8; i++ )
+				{
+					uint ps = std::min( 2 * uint( s ) + ( i & 1 ), pw - 1 );
+					uint pt = std::min( 2 * uint( t ) + ( ( i >> 1 ) & 1 ), ph - 1 );
+					uint pr = std::min( 2 * uint( r ) + ( i >> 2 ), pd - 1 );
+					BrickId id = { level - 1, ps / brickSize, pt / brickSize, pr / brickSize };
+					auto found = cached.find( id.key() );
+					if( found == cached.end() )
+					{
+						if( cached.size() >= 64 ) { cached.clear(); }
+						found = cached.insert( make_pair( id.key(), vector<float>( volume.brickTexels() ) ) ).first;
+						if( !previous.readBrick( id, found->second.data() ) ) { cerr << "can't read back " << name << endl; throw 1; }
+					}
+					const uint a = volume.apronSize();
+					sum += found->second[( ps % brickSize + 1 ) + a * ( ( pt % brickSize + 1 ) + size_t( a ) * ( pr % brickSize + 1 ) )];
+				}
+				return sum / 8;
+			};
+
+			for( uint bz = 0; bz < volume.bricksZ( level ); bz++ )
+				for( uint by = 0; by < volume.bricksY( level ); by++ )
+					for( uint bx = 0; bx < volume.bricksX( level ); bx++ )
+					{
+						const uint a = volume.apronSize();
+						for( uint k = 0; k < a; k++ )
+							for( uint j = 0; j < a; j++ )
+								for( uint i = 0; i < a; i++ )
+									brick[i + a * ( j + size_t( a ) * k )] = levelTexel(
+										int( bx * brickSize + i ) - 1,
+										int( by * brickSize + j ) - 1,
+										int( bz * brickSize + k ) - 1 );
+						fwrite( brick.data(), volume.brickBytes(), 1, out );
+					}
+			previous.close();
+			cached.clear();
+		}
+		fclose( out );
+	}
+
+	static void write( const string& name, const VoxelTexture& tex, uint brickSize = 32 )
+	{
+		const float* data = tex.data();
+		write( name, tex.width, tex.height, tex.depth, [&]( uint s, uint t, uint r ) {
+			return data[s + tex.width * ( t + size_t( tex.height ) * r )];
+		}, brickSize );
+	}
+
+	// Bricks to draw for the model-view-projection 'mvp' of the [-1;1]^3 box (sampled as pos.yzx, like
+	// VoxelTexture), coarsest first : a brick is refined while its texels cover more than 'maxTexelPixels'.
+	// 'pixelsPerUnit' is the size in pixels of one unit at distance 1 (projection[1][1] * viewport height / 2).
+	vector<BrickId> visibleBricks( const Mat4& mvp, float pixelsPerUnit, float maxTexelPixels = 1 ) const
+	{
+		vector<BrickId> dst;
+		if( levels == 0 ) { return dst; }
+		function<void( const BrickId& )> visit = [&]( const BrickId& b ) {
+			// bounds in texture coordinates, then in the box
+			// (a texel of level L covers 2^L texels of level 0, even for odd sizes)
+			const float size[3] = { float( width ), float( height ), float( depth ) };
+			const uint pos[3] = { b.x, b.y, b.z };
+			const float extent = float( brickSize << b.level );
+			float lo[3], hi[3];
+			for( uint c = 0; c < 3; c++ )
+			{
+				lo[c] = std::min( 1.0f, pos[c] * extent / size[c] );
+				hi[c] = std::min( 1.0f, ( pos[c] + 1 ) * extent / size[c] );
+			}
+			// (s,t,r) = pos.yzx, so the box's x is r, y is s and z is t
+			const float boxLo[3] = { 2 * lo[2] - 1, 2 * lo[0] - 1, 2 * lo[1] - 1 };
+			const float boxHi[3] = { 2 * hi[2] - 1, 2 * hi[0] - 1, 2 * hi[1] - 1 };
+
+			// frustum culling : all the corners out of the same clip plane
+			uint outside[6] = { 0, 0, 0, 0, 0, 0 };
+			float minW = INFINITY;
+			for( uint i = 0; i < 8; i++ )
+			{
+				const float p[3] = { i & 1 ? boxHi[0] : boxLo[0], i & 2 ? boxHi[1] : boxLo[1], i & 4 ? boxHi[2] : boxLo[2] };
+				float clip[4];
+				for( uint r = 0; r < 4; r++ )
+					clip[r] = mvp.at( r, 0 ) * p[0] + mvp.at( r, 1 ) * p[1] + mvp.at( r, 2 ) * p[2] + mvp.at( r, 3 );
+				for( uint c = 0; c < 3; c++ )
+				{
+					outside[2 * c] += clip[c] < -clip[3];
+					outside[2 * c + 1] += clip[c] > clip[3];
+				}
+				minW = std::min( minW, clip[3] );
+			}
+			for( uint i = 0; i < 6; i++ ) { if( outside[i] == 8 ) { return; } }
+
+			// projected size of a texel, at the nearest corner
+			const float texelSize = 2.0f * ( 1u << b.level ) / std::max( width, std::max( height, depth ) );
+			const float texelPixels = minW <= 0 ? INFINITY : texelSize * pixelsPerUnit / minW;
+			if( b.level == 0 || texelPixels <= maxTexelPixels )
+			{
+				dst.push_back( b );
+				return;
+			}
+			for( uint i = 0; i < 8; i++ )
+			{
+				BrickId child = { b.level - 1, 2 * b.x + ( i & 1 ), 2 * b.y + ( ( i >> 1 ) & 1 ), 2 * b.z + ( i >> 2 ) };
+				if( exists( child ) ) { visit( child ); }
+			}
+		};
+		visit( { levels - 1, 0, 0, 0 } );
+		return dst;
+	}
+
+	// 'bricks' and all their coarser ancestors, coarsest first : they are shown while the finer ones load
+	vector<BrickId> withAncestors( const vector<BrickId>& bricks ) const
+	{
+		vector<vector<BrickId>> byLevel( levels );
+		unordered_set<uint64_t> added;
+		for( const BrickId& b : bricks )
+		{
+			for( BrickId a = b; a.level < levels; a = { a.level + 1, a.x / 2, a.y / 2, a.z / 2 } )
+			{
+				if( !added.insert( a.key() ).second ) { break; }
+				byLevel[a.level].push_back( a );
+			}
+		}
+		vector<BrickId> dst;
+		for( uint level = levels; level-- > 0; ) { dst.insert( dst.end(), byLevel[level].begin(), byLevel[level].end() ); }
+		return dst;
+	}
+};
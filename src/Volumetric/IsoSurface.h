@@ -0,0 +1,313 @@
+#pragma once
+
+#include "Voxel.h"
+#include "OccupancyGrid.h"
+#include <Parallel.h>
+
+#include <stdint.h>
+
+// The surface of VoxelTexture::isoSurface (a cube per cell whose corners are on both sides of the threshold),
+// extracted per brick of cells. A min/max index (an OccupancyGrid of the brick size) skips the bricks whose
+// range can't contain the threshold, and moving the threshold only re-extracts the bricks with a texel between
+// the two thresholds. Their triangles are patched in place in the buffers, each brick having its own slots.
+// Positions are those of isoSurface : x, y, z along the texels' t, r, s axes, in [-0.5;0.5].
+struct IsoSurface {
+
+	static const uint cellVertices = 36; // 12 triangles per cube
+
+	struct Stats {
+		size_t extractions = 0;
+		size_t bricksSkipped = 0; // by the index
+		size_t bricksExtracted = 0;
+		size_t cellsVisited = 0;
+		size_t unchanged = 0; // extracted bricks with the same cells
+		size_t patched = 0, relocated = 0, compactions = 0; // bricks written in place, moved to the end of the buffers
+		size_t slotsWritten = 0; // cells whose triangles were written
+
+		void print( ostream& out ) const
+		{
+			out << extractions << " extractions : " << bricksExtracted << " bricks extracted (" << cellsVisited << " cells visited), "
+				<< bricksSkipped << " skipped, " << unchanged << " unchanged ; " << patched << " patched in place, " << relocated << " relocated, "
+				<< compactions << " compactions, " << slotsWritten << " cubes written" << endl;
+		}
+	};
+
+	uint brickSize; // in cells
+	OccupancyGrid index;
+	float threshold = 0;
+	bool extracted = false;
+	Stats stats;
+
+	// triangles, 3 floats per vertex, cellVertices per slot ; unused slots hold degenerate triangles
+	vector<float> positions, normals;
+	vector<pair<size_t, size_t>> dirty; // slots [begin;end) changed since the last upload()
+	GLuint vertexId = 0, normalId = 0;
+	size_t uploadedSize = 0; // of 'positions' in the GL buffers
+
+	IsoSurface( const VoxelTexture& tex, uint brickSize = 8 ) : brickSize( brickSize ), tex( tex )
+	{
+		if( tex.compressed )
+		{
+			VoxelTexture uncompressed = tex;
+			uncompressed.decompress();
+			index = OccupancyGrid( uncompressed, brickSize );
+		}
+		else { index = OccupancyGrid( tex, brickSize ); }
+		bricks.resize( size_t( index.width ) * index.height * index.depth );
+	}
+	// reuses a grid already computed for the texture (such as LazyVolume's one)
+	IsoSurface( const VoxelTexture& tex, const OccupancyGrid& grid ) : brickSize( grid.cellSize ), index( grid ), tex( tex )
+	{
+		bricks.resize( size_t( index.width ) * index.height * index.depth );
+	}
+
+	inline size_t cubes() const
+	{
+		size_t count = 0;
+		for( const Brick& b : bricks ) { count += b.cells.size(); }
+		return count;
+	}
+	inline size_t slots() const { return positions.size() / ( 3 * cellVertices ); }
+
+	// extracts every brick the index can't skip
+	void extract( float newThreshold )
+	{
+		vector<uint> todo;
+		for( uint b = 0; b < bricks.size(); b++ )
+		{
+			if( mayHaveSurface( b, newThreshold ) || !bricks[b].cells.empty() ) { todo.push_back( b ); }
+			else { stats.bricksSkipped++; }
+		}
+		run( todo, newThreshold );
+	}
+
+	// re-extracts the bricks whose cells can change between the current threshold and 'newThreshold'
+	void update( float newThreshold )
+	{
+		if( !extracted ) { extract( newThreshold ); return; }
+		if( newThreshold == threshold ) { return; }
+		const float lo = std::min( threshold, newThreshold ), hi = std::max( threshold, newThreshold );
+		vector<uint> todo;
+		for( uint b = 0; b < bricks.size(); b++ )
+		{
+			// a texel changes sides when lo <= v < hi
+			const float* minMax = &index.minMax[2 * size_t( b )];
+			bool flips = minMax[1] >= lo && minMax[0] < hi;
+			if( flips && ( mayHaveSurface( b, newThreshold ) || !bricks[b].cells.empty() ) ) { todo.push_back( b ); }
+			else { stats.bricksSkipped++; }
+		}
+		run( todo, newThreshold );
+	}
+
+	Mesh toMesh() const;
+
+	void upload(); // sends the dirty slots to the GL buffers
+	void draw();
+
+private:
+	struct Brick {
+		vector<uint32_t> cells; // surface cells, as texel indices
+		size_t offset = 0, capacity = 0; // slots
+	};
+
+	const VoxelTexture& tex;
+	vector<Brick> bricks;
+	size_t freeSlots = 0; // left behind by relocated bricks
+
+	inline bool mayHaveSurface( uint b, float t ) const
+	{
+		const float* minMax = &index.minMax[2 * size_t( b )];
+		return minMax[0] < t && minMax[1] >= t;
+	}
+
+	// the cube of a cell : its center and half size
+	inline void bounds( uint32_t cell, float center[3], float half[3] ) const
+	{
+		const uint W = tex.width, H = tex.height, D = tex.depth;
+		const uint s = cell % W, t = uint( ( cell / W ) % H ), r = uint( cell / ( size_t( W ) * H ) );
+		center[0] = float( t ) / H - 0.5f; center[1] = float( r ) / D - 0.5f; center[2] = float( s ) / W - 0.5f;
+		half[0] = 0.5f / H; half[1] = 0.5f / D; half[2] = 0.5f / W;
+	}
+
+	inline float texel( size_t i ) const { return tex.compressed ? tex.compressedAt( i ) : tex.data()[i]; }
+
+	void run( const vector<uint>& extractions, float newThreshold )
+	{
+		const uint W = tex.width, H = tex.height, D = tex.depth;
+		const size_t sliceSize = size_t( W ) * H;
+		vector<size_t> oldCounts( extractions.size() );
+		vector<char> changed( extractions.size(), 0 );
+
+		Parallel::forEach( extractions.size(), [&]( size_t i, unsigned int ) {
+			const uint b = extractions[i];
+			const uint bs = b % index.width, bt = ( b / index.width ) % index.height, br = uint( b / ( size_t( index.width ) * index.height ) );
+			vector<uint32_t> cells;
+			const uint sEnd = std::min( ( bs + 1 ) * brickSize, W - 1 ), tEnd = std::min( ( bt + 1 ) * brickSize, H - 1 ), rEnd = std::min( ( br + 1 ) * brickSize, D - 1 );
+			for( uint r = br * brickSize; r < rEnd; r++ )
+				for( uint t = bt * brickSize; t < tEnd; t++ )
+					for( uint s = bs * brickSize; s < sEnd; s++ )
+					{
+						const size_t i0 = s + W * ( t + size_t( H ) * r );
+						bool in = texel( i0 ) >= newThreshold;
+						for( uint c = 1; c < 8; c++ )
+						{
+							if( ( texel( i0 + ( c % 2 ) + W * ( c / 2 % 2 ) + sliceSize * ( c / 4 ) ) >= newThreshold ) != in )
+							{
+								cells.push_back( uint32_t( i0 ) );
+								break;
+							}
+						}
+					}
+			oldCounts[i] = bricks[b].cells.size();
+			if( cells != bricks[b].cells )
+			{
+				bricks[b].cells.swap( cells );
+				changed[i] = 1;
+			}
+		} );
+		stats.extractions++;
+		stats.bricksExtracted += extractions.size();
+		vector<uint> todo; // the bricks to rewrite
+		vector<size_t> todoOldCounts;
+		for( size_t i = 0; i < extractions.size(); i++ )
+		{
+			if( changed[i] ) { todo.push_back( extractions[i] ); todoOldCounts.push_back( oldCounts[i] ); }
+			else { stats.unchanged++; }
+		}
+		oldCounts.swap( todoOldCounts );
+		for( uint b : extractions )
+		{
+			const uint bs = b % index.width, bt = ( b / index.width ) % index.height, br = uint( b / ( size_t( index.width ) * index.height ) );
+			stats.cellsVisited += size_t( std::min( brickSize, W - 1 - std::min( W - 1, bs * brickSize ) ) )
+				* std::min( brickSize, H - 1 - std::min( H - 1, bt * brickSize ) ) * std::min( brickSize, D - 1 - std::min( D - 1, br * brickSize ) );
+		}
+		threshold = newThreshold;
+		extracted = true;
+
+		// the bricks that outgrew their slots move to the end of the buffers, with some room to grow
+		size_t end = slots();
+		vector<pair<size_t, size_t>> cleared; // slots to fill with degenerate triangles
+		for( size_t i = 0; i < todo.size(); i++ )
+		{
+			Brick& brick = bricks[todo[i]];
+			if( brick.cells.size() <= brick.capacity )
+			{
+				if( brick.cells.size() < oldCounts[i] ) { cleared.push_back( { brick.offset + brick.cells.size(), brick.offset + oldCounts[i] } ); }
+				stats.patched++;
+				continue;
+			}
+			if( brick.capacity > 0 ) { cleared.push_back( { brick.offset, brick.offset + oldCounts[i] } ); }
+			freeSlots += brick.capacity;
+			brick.offset = end;
+			brick.capacity = brick.cells.size() + ( brick.cells.size() + 3 ) / 4;
+			end += brick.capacity;
+			stats.relocated++;
+		}
+
+		if( freeSlots > end / 2 ) { compact(); return; }
+
+		if( end > slots() )
+		{
+			dirty.push_back( { slots(), end } );
+			positions.resize( 3 * cellVertices * end, 0.0f );
+			normals.resize( positions.size(), 0.0f );
+		}
+		Parallel::forEach( todo.size() + cleared.size(), [&]( size_t i, unsigned int ) {
+			if( i < todo.size() ) { write( bricks[todo[i]] ); }
+			else { clear( cleared[i - todo.size()].first, cleared[i - todo.size()].second ); }
+		} );
+		for( uint b : todo )
+		{
+			dirty.push_back( { bricks[b].offset, bricks[b].offset + bricks[b].cells.size() } );
+			stats.slotsWritten += bricks[b].cells.size();
+		}
+		dirty.insert( dirty.end(), cleared.begin(), cleared.end() );
+	}
+
+	// rewrites every brick contiguously
+	void compact()
+	{
+		size_t end = 0;
+		for( Brick& brick : bricks )
+		{
+			brick.offset = end;
+			brick.capacity = brick.cells.empty() ? 0 : brick.cells.size() + ( brick.cells.size() + 3 ) / 4;
+			end += brick.capacity;
+		}
+		positions.assign( 3 * cellVertices * end, 0.0f );
+		normals.assign( positions.size(), 0.0f );
+		Parallel::forEach( bricks.size(), [&]( size_t b, unsigned int ) { write( bricks[b] ); } );
+		stats.slotsWritten += cubes();
+		freeSlots = 0;
+		dirty.assign( 1, make_pair( size_t( 0 ), end ) );
+		stats.compactions++;
+	}
+
+	// the triangles of the brick's cubes
+	void write( const Brick& brick )
+	{
+		float* p = &positions[3 * cellVertices * brick.offset];
+		float* n = &normals[3 * cellVertices * brick.offset];
+		for( uint32_t cell : brick.cells )
+		{
+			float center[3], half[3];
+			bounds( cell, center, half );
+			for( uint face = 0; face < 6; face++ )
+			{
+				// the quad ( -,- ) ( +,- ) ( +,+ ) ( -,+ ) of the plane ( u, v ), counterclockwise seen from outside
+				const uint a = face / 2, u = ( a + 1 ) % 3, v = ( a + 2 ) % 3;
+				const float side = face % 2 ? 1.0f : -1.0f;
+				static const int corners[6] = { 0, 1, 2, 0, 2, 3 };
+				for( uint k = 0; k < 6; k++ )
+				{
+					const int c = side > 0 ? corners[k] : corners[5 - k];
+					float corner[3];
+					corner[a] = side;
+					corner[u] = c == 1 || c == 2 ? 1.0f : -1.0f;
+					corner[v] = c >= 2 ? 1.0f : -1.0f;
+					for( uint j = 0; j < 3; j++ )
+					{
+						*p++ = center[j] + corner[j] * half[j];
+						*n++ = j == a ? side : 0.0f;
+					}
+				}
+			}
+		}
+	}
+
+	void clear( size_t begin, size_t end )
+	{
+		fill( positions.begin() + 3 * cellVertices * begin, positions.begin() + 3 * cellVertices * end, 0.0f );
+	}
+};
+
+inline Mesh IsoSurface::toMesh() const
+{
+	// the cubes, as isoSurface used to build them
+	struct Cubes : public Mesh {
+		Cubes( const IsoSurface& surface )
+		{
+			for( const Brick& brick : surface.bricks )
+				for( uint32_t cell : brick.cells )
+				{
+					float center[3], half[3];
+					surface.bounds( cell, center, half );
+					const uint first = ptCount();
+					for( int z = -1; z <= 1; z += 2 )
+						for( int y = -1; y <= 1; y += 2 )
+							for( int x = -1; x <= 1; x += 2 )
+								addVertex( { center[0] + x * half[0], center[1] + y * half[1], center[2] + z * half[2] } );
+					const uint quads[6][4] = { { 0, 1, 3, 2 }, { 4, 6, 7, 5 }, { 0, 2, 6, 4 }, { 1, 5, 7, 3 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 } };
+					for( const auto& q : quads ) { faces.push_back( Face( { first + q[0], first + q[1], first + q[2], first + q[3] } ) ); }
+				}
+		}
+	};
+	return Cubes( *this );
+}
+
+inline Mesh VoxelTexture::isoSurface( float threshold ) const
+{
+	IsoSurface surface( *this );
+	surface.extract( threshold );
+	return surface.toMesh();
+}
@@ -0,0 +1,315 @@
+#pragma once
+
+#include "Voxel.h"
+#include "BrickedVolume.h"
+#include <Parallel.h>
+
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+// Streams the surface of VoxelTexture::isoSurface to a binary PLY file, for volumes whose surface (or texels)
+// doesn't fit in memory. The volume is read a slice at a time, and only the cells' flags of three layers and
+// the vertex indices of two planes of corners are kept : memory grows with a slice, not with the volume.
+// Cubes share their corners and the faces between two of them are left out (the file holds the boundary of
+// the cubes). PLY wants every vertex before the faces, so faces go to a temporary file appended at the end,
+// and the counts of the header are patched once known. A thread writes both, fed through a bounded queue.
+struct IsoSurfaceWriter {
+
+	typedef function<void( uint r, float* dst )> SliceReader; // the width * height texels of the slice 'r'
+
+	struct Stats {
+		size_t cubes = 0, vertices = 0, faces = 0;
+		size_t bytes = 0; // of the file
+		size_t stateBytes = 0; // slices, flags and corner planes
+		size_t peakQueuedBytes = 0;
+		double seconds = 0;
+		double stalledSeconds = 0; // waiting for the writer
+
+		void print( ostream& out ) const
+		{
+			out << cubes << " cubes : " << vertices << " vertices, " << faces << " faces, " << bytes / ( 1 << 20 ) << " MB in "
+				<< seconds << " s (" << stalledSeconds << " s waiting for the writer), " << ( stateBytes + peakQueuedBytes ) / ( 1 << 20 )
+				<< " MB at most in memory" << endl;
+		}
+	};
+
+	size_t chunkBytes = 1 << 20; // handed to the writer
+	size_t maxQueuedBytes = 64 << 20;
+
+	static SliceReader reader( const VoxelTexture& tex )
+	{
+		return [&tex]( uint r, float* dst ) {
+			const size_t sliceSize = size_t( tex.width ) * tex.height;
+			if( tex.compressed ) { tex.compressed->decompressSlices( r, 1, dst ); }
+			else { memcpy( dst, tex.data() + sliceSize * r, sliceSize * sizeof( float ) ); }
+		};
+	}
+
+	// level 0 slices, read from the bricks crossing them
+	static SliceReader reader( const BrickedVolume& volume )
+	{
+		return [&volume]( uint r, float* dst ) {
+			const uint B = volume.brickSize, A = volume.apronSize(), W = volume.width, H = volume.height;
+			const uint bricksX = volume.bricksX( 0 );
+			vector<char> failed( size_t( bricksX ) * volume.bricksY( 0 ), 0 );
+			Parallel::forEach( failed.size(), [&]( size_t i, unsigned int ) {
+				const BrickId id = { 0, uint( i % bricksX ), uint( i / bricksX ), r / B };
+				vector<float> slice( size_t( A ) * A );
+				if( !volume.readBrickSlice( id, r % B + 1, slice.data() ) ) { failed[i] = 1; return; }
+				const uint sEnd = std::min( B, W - id.x * B ), tEnd = std::min( B, H - id.y * B );
+				for( uint t = 0; t < tEnd; t++ )
+					memcpy( dst + id.x * B + size_t( W ) * ( id.y * B + t ), &slice[1 + A * ( t + 1 )], sEnd * sizeof( float ) );
+			} );
+			if( find( failed.begin(), failed.end(), 1 ) != failed.end() ) { cerr << "can't read " << volume.fileName << endl; throw 1; }
+		};
+	}
+
+	Stats write( const string& name, uint W, uint H, uint D, const SliceReader& slice, float threshold )
+	{
+		auto start = chrono::steady_clock::now();
+		Stats stats;
+		FILE* out = fopen( name.c_str(), "wb" );
+		const string facesName = name + ".faces";
+		FILE* facesOut = fopen( facesName.c_str(), "w+b" );
+		if( out == NULL || facesOut == NULL ) { cerr << "can't write " << name << endl; throw 1; }
+		writeHeader( out, threshold, 0, 0 );
+
+		done = failed = false;
+		queuedBytes = peakQueuedBytes = 0;
+		stalledSeconds = 0;
+		thread writer( [this]() { run(); } );
+		Chunk vertexChunk = { out, {} }, faceChunk = { facesOut, {} };
+		vertexChunk.data.reserve( chunkBytes );
+		faceChunk.data.reserve( chunkBytes );
+
+		try
+		{
+			if( W >= 2 && H >= 2 && D >= 2 )
+			{
+				const uint CW = W - 1, CH = H - 1; // cells per layer
+				const size_t sliceSize = size_t( W ) * H, layerSize = size_t( CW ) * CH;
+				vector<float> slices[2] = { vector<float>( sliceSize ), vector<float>( sliceSize ) };
+				vector<char> flags[3] = { vector<char>( layerSize, 0 ), vector<char>( layerSize, 0 ), vector<char>( layerSize, 0 ) };
+				vector<uint32_t> corners[2] = { vector<uint32_t>( sliceSize, ~0u ), vector<uint32_t>( sliceSize, ~0u ) };
+				stats.stateBytes = 2 * sliceSize * ( sizeof( float ) + sizeof( uint32_t ) ) + 3 * layerSize + 2 * chunkBytes;
+
+				// the cells of a layer with corners on both sides of the threshold
+				auto computeFlags = [&]( const vector<float>& lo, const vector<float>& hi, vector<char>& dst ) {
+					Parallel::forEach( CH, [&]( size_t t, unsigned int ) {
+						for( uint s = 0; s < CW; s++ )
+						{
+							const size_t i = s + W * t;
+							const bool in = lo[i] >= threshold;
+							dst[s + CW * t] =
+								( lo[i + 1] >= threshold ) != in || ( lo[i + W] >= threshold ) != in || ( lo[i + W + 1] >= threshold ) != in ||
+								( hi[i] >= threshold ) != in || ( hi[i + 1] >= threshold ) != in || ( hi[i + W] >= threshold ) != in || ( hi[i + W + 1] >= threshold ) != in;
+						}
+					} );
+				};
+
+				// the corners of each face, counterclockwise seen from outside, as ( s, t, r ) offsets to the cell
+				uint faceCorners[6][4][3];
+				for( uint face = 0; face < 6; face++ )
+				{
+					const uint a = face / 2, u = ( a + 1 ) % 3, v = ( a + 2 ) % 3;
+					const bool positive = face % 2 == 1;
+					for( uint k = 0; k < 4; k++ )
+					{
+						const uint c = positive ? k : 3 - k;
+						faceCorners[face][k][a] = positive ? 1 : 0;
+						faceCorners[face][k][u] = c == 1 || c == 2 ? 1 : 0;
+						faceCorners[face][k][v] = c >= 2 ? 1 : 0;
+					}
+				}
+
+				uint32_t vertexCount = 0;
+				auto corner = [&]( uint s, uint t, uint r, uint plane ) {
+					uint32_t& index = corners[plane][s + size_t( W ) * t];
+					if( index == ~0u )
+					{
+						if( vertexCount == uint32_t( INT32_MAX ) ) { cerr << "too many vertices for " << name << endl; throw 1; }
+						index = vertexCount++;
+						// positions of isoSurface : x, y, z along t, r, s
+						const float p[3] = { ( t - 0.5f ) / H - 0.5f, ( r - 0.5f ) / D - 0.5f, ( s - 0.5f ) / W - 0.5f };
+						append( vertexChunk, p, sizeof( p ) );
+					}
+					return index;
+				};
+
+				slice( 0, slices[0].data() );
+				slice( 1, slices[1].data() );
+				computeFlags( slices[0], slices[1], flags[1] );
+				for( uint r = 0; r + 1 < D; r++ )
+				{
+					// flags[0], [1], [2] : layers r - 1, r, r + 1
+					if( r + 2 < D )
+					{
+						slice( r + 2, slices[0].data() );
+						swap( slices[0], slices[1] );
+						computeFlags( slices[0], slices[1], flags[2] );
+					}
+					else { fill( flags[2].begin(), flags[2].end(), 0 ); }
+
+					const vector<char>& cur = flags[1];
+					for( uint t = 0; t < CH; t++ )
+						for( uint s = 0; s < CW; s++ )
+						{
+							const size_t c = s + CW * size_t( t );
+							if( !cur[c] ) { continue; }
+							stats.cubes++;
+							const bool neighbours[6] = {
+								s > 0 && cur[c - 1], s + 1 < CW && cur[c + 1],
+								t > 0 && cur[c - CW], t + 1 < CH && cur[c + CW],
+								flags[0][c] != 0, flags[2][c] != 0
+							};
+							for( uint face = 0; face < 6; face++ )
+							{
+								if( neighbours[face] ) { continue; }
+								uint8_t record[1 + 4 * sizeof( int32_t )];
+								record[0] = 4;
+								for( uint k = 0; k < 4; k++ )
+								{
+									const uint* o = faceCorners[face][k];
+									int32_t index = int32_t( corner( s + o[0], t + o[1], r + o[2], o[2] ) );
+									memcpy( record + 1 + k * sizeof( int32_t ), &index, sizeof( int32_t ) );
+								}
+								append( faceChunk, record, sizeof( record ) );
+								stats.faces++;
+							}
+						}
+
+					// the corners of the plane r + 1 are the first ones of the next layer
+					swap( corners[0], corners[1] );
+					fill( corners[1].begin(), corners[1].end(), ~0u );
+					swap( flags[0], flags[1] );
+					swap( flags[1], flags[2] );
+				}
+				stats.vertices = vertexCount;
+			}
+		}
+		catch( ... )
+		{
+			// lets the writer finish before giving up
+			stop( writer );
+			fclose( facesOut );
+			fclose( out );
+			remove( facesName.c_str() );
+			throw;
+		}
+
+		push( vertexChunk );
+		push( faceChunk );
+		stop( writer );
+		stats.stalledSeconds = stalledSeconds;
+		stats.peakQueuedBytes = peakQueuedBytes;
+
+		// the faces after the vertices, then the final counts
+		vector<char> buffer( chunkBytes );
+		fseek( facesOut, 0, SEEK_SET );
+		for( size_t n; ( n = fread( buffer.data(), 1, buffer.size(), facesOut ) ) > 0; ) { fwrite( buffer.data(), 1, n, out ); }
+		fclose( facesOut );
+		remove( facesName.c_str() );
+		fseek( out, 0, SEEK_SET );
+		writeHeader( out, threshold, stats.vertices, stats.faces );
+		fseek( out, 0, SEEK_END );
+		stats.bytes = size_t( ftell( out ) );
+		if( fclose( out ) != 0 || failed ) { cerr << "error when writing " << name << endl; throw 1; }
+
+		stats.seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+		return stats;
+	}
+
+private:
+	struct Chunk {
+		FILE* file;
+		vector<char> data;
+	};
+
+	deque<Chunk> queue;
+	size_t queuedBytes = 0, peakQueuedBytes = 0;
+	double stalledSeconds = 0;
+	bool done = false, failed = false;
+	mutex m;
+	condition_variable wakeUp, room;
+
+	// fixed width counts, to be patched in place
+	static void writeHeader( FILE* out, float threshold, size_t vertices, size_t faces )
+	{
+		fprintf( out,
+			"ply\nformat binary_little_endian 1.0\ncomment iso surface at %g\n"
+			"element vertex %010zu\nproperty float x\nproperty float y\nproperty float z\n"
+			"element face %010zu\nproperty list uchar int vertex_indices\nend_header\n",
+			threshold, vertices, faces );
+	}
+
+	void append( Chunk& chunk, const void* src, size_t bytes )
+	{
+		const char* p = ( const char* )src;
+		chunk.data.insert( chunk.data.end(), p, p + bytes );
+		if( chunk.data.size() >= chunkBytes )
+		{
+			push( chunk );
+			chunk.data.reserve( chunkBytes );
+		}
+	}
+
+	void stop( thread& writer )
+	{
+		{
+			lock_guard<mutex> lock( m );
+			done = true;
+		}
+		wakeUp.notify_all();
+		writer.join();
+	}
+
+	// hands the chunk to the writer, waiting while the queue is full
+	void push( Chunk& chunk )
+	{
+		if( chunk.data.empty() ) { return; }
+		{
+			unique_lock<mutex> lock( m );
+			if( queuedBytes > 0 && queuedBytes + chunk.data.size() > maxQueuedBytes )
+			{
+				auto start = chrono::steady_clock::now();
+				room.wait( lock, [&]() { return queuedBytes == 0 || queuedBytes + chunk.data.size() <= maxQueuedBytes; } );
+				stalledSeconds += chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+			}
+			queuedBytes += chunk.data.size();
+			peakQueuedBytes = std::max( peakQueuedBytes, queuedBytes );
+			queue.push_back( Chunk{ chunk.file, vector<char>() } );
+			queue.back().data.swap( chunk.data );
+		}
+		wakeUp.notify_one();
+	}
+
+	void run()
+	{
+		for( ;; )
+		{
+			Chunk chunk;
+			{
+				unique_lock<mutex> lock( m );
+				wakeUp.wait( lock, [this]() { return done || !queue.empty(); } );
+				if( queue.empty() ) { return; }
+				chunk.file = queue.front().file;
+				chunk.data.swap( queue.front().data );
+				queue.pop_front();
+			}
+			bool ok = fwrite( chunk.data.data(), 1, chunk.data.size(), chunk.file ) == chunk.data.size();
+			{
+				lock_guard<mutex> lock( m );
+				queuedBytes -= chunk.data.size();
+				failed |= !ok;
+			}
+			room.notify_one();
+		}
+	}
+};
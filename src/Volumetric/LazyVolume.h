@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Voxel.h"
+#include "OccupancyGrid.h"
+
+#include <string>
+#include <future>
+#include <thread>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <exception>
+#include <iostream>
+
+// A volume that is only generated once requested, on a worker thread,
+// then uploaded a few slices per frame (see Volumetric's display())
+// A generator that throws leaves the volume Failed, reported once, instead of taking the viewer down.
+struct LazyVolume {
+
+	enum State { Idle, Generating, Uploading, Ready, Failed };
+
+	struct Generated {
+		VoxelTexture tex;
+		OccupancyGrid grid;
+	};
+
+	string name;
+	function<VoxelTexture()> build; // called on the worker thread
+	bool compress = false; // keeps the generated texture compressed, once its grid is built
+	State state = Idle;
+	future<Generated> job;
+
+	// valid from Uploading on
+	VoxelTexture tex;
+	OccupancyGrid grid;
+	uint uploadedSlices = 0;
+
+	LazyVolume( const string& name, const function<VoxelTexture()>& build ) : name( name ), build( build ) {}
+
+	// starts generating the volume, if it hasn't been yet
+	void request()
+	{
+		if( state != Idle ) { return; }
+		state = Generating;
+		function<VoxelTexture()> build = this->build;
+		bool compress = this->compress;
+		string name = this->name;
+		// a detached thread rather than async(), whose future would make exit() wait for the generation
+		shared_ptr<promise<Generated>> done( new promise<Generated>() );
+		job = done->get_future();
+		thread( [build, compress, name, done]() {
+			TRACE_THREAD( "volume generation" );
+			TRACE_SCOPE_DETAIL( "LazyVolume::request", name );
+			try
+			{
+				Generated dst;
+				dst.tex = build();
+				{
+					TRACE_SCOPE( "OccupancyGrid" );
+					dst.grid = OccupancyGrid( dst.tex );
+				}
+				if( compress ) { dst.tex.compress(); }
+				done->set_value( std::move( dst ) );
+			}
+			catch( ... ) { done->set_exception( current_exception() ); }
+		} ).detach();
+	}
+
+	// returns true once the volume is generated (the first time, it moves the result out of the worker)
+	bool generated()
+	{
+		if( state == Generating && job.wait_for( chrono::seconds( 0 ) ) == future_status::ready )
+		{
+			try
+			{
+				Generated result = job.get();
+				tex = result.tex;
+				grid = result.grid;
+				state = Uploading;
+			}
+			catch( const exception& e ) { cerr << "error when generating " << name << " : " << e.what() << endl; state = Failed; }
+			catch( ... ) { cerr << "error when generating " << name << endl; state = Failed; }
+		}
+		return state == Uploading || state == Ready;
+	}
+};
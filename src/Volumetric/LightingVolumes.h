@@ -0,0 +1,230 @@
+#pragma once
+
+#include "Voxel.h"
+#include <Vec.h>
+#include <Parallel.h>
+
+#include <stdint.h>
+#include <algorithm>
+
+// Precomputed lighting of a VoxelTexture for a directional light, laid out like the texture (s fastest,
+// then t, then r) and sampled like GL_LINEAR + GL_CLAMP_TO_EDGE textures, at texture coordinates.
+namespace Lighting {
+
+	// trilinear interpolation of 'texel( x, y, z )', clamped to the edges
+	template<typename Texel>
+	inline void trilinear( uint W, uint H, uint D, float s, float t, float r, const Texel& texel )
+	{
+		float u = std::min( std::max( s * W - 0.5f, 0.0f ), float( W - 1 ) );
+		float v = std::min( std::max( t * H - 0.5f, 0.0f ), float( H - 1 ) );
+		float w = std::min( std::max( r * D - 0.5f, 0.0f ), float( D - 1 ) );
+		uint u0 = uint( u ), v0 = uint( v ), w0 = uint( w );
+		uint u1 = std::min( u0 + 1, W - 1 ), v1 = std::min( v0 + 1, H - 1 ), w1 = std::min( w0 + 1, D - 1 );
+		float a = u - u0, b = v - v0, c = w - w0;
+		texel( u0, v0, w0, ( 1 - a ) * ( 1 - b ) * ( 1 - c ) ); texel( u1, v0, w0, a * ( 1 - b ) * ( 1 - c ) );
+		texel( u0, v1, w0, ( 1 - a ) * b * ( 1 - c ) ); texel( u1, v1, w0, a * b * ( 1 - c ) );
+		texel( u0, v0, w1, ( 1 - a ) * ( 1 - b ) * c ); texel( u1, v0, w1, a * ( 1 - b ) * c );
+		texel( u0, v1, w1, ( 1 - a ) * b * c ); texel( u1, v1, w1, a * b * c );
+	}
+
+	// the emission curve of fragFront.glsl
+	inline float curve( float gain, float density ) { return std::max( 0.0f, expf( gain * density ) - 1 ); }
+}
+
+// Outward normals (opposite to the density's gradient), packed in RGBA8 : normal * 0.5 + 0.5,
+// and the gradient's magnitude relative to the largest one in alpha
+struct GradientVolume {
+
+	uint width = 0, height = 0, depth = 0;
+	vector<uint32_t> normals;
+	GLuint id = 0;
+
+	GradientVolume() {}
+	GradientVolume( const VoxelTexture& tex, uint threads = 0 )
+		: width( tex.width ), height( tex.height ), depth( tex.depth ), normals( tex.size() )
+	{
+		const float* data = tex.data();
+		const uint W = width, H = height, D = depth;
+		vector<float> gradients( 3 * tex.size() );
+		vector<float> maxNorms( D, 0.0f );
+
+		// central differences (one-sided on the borders), a slice per task
+		Parallel::forEach( D, [&]( size_t r, unsigned int ) {
+			const size_t r0 = r > 0 ? r - 1 : r, r1 = r + 1 < D ? r + 1 : r;
+			for( uint t = 0; t < H; t++ )
+			{
+				const uint t0 = t > 0 ? t - 1 : t, t1 = t + 1 < H ? t + 1 : t;
+				const float* row = data + W * ( t + H * r );
+				const float* rowT0 = data + W * ( t0 + H * r ), * rowT1 = data + W * ( t1 + H * r );
+				const float* rowR0 = data + W * ( t + H * r0 ), * rowR1 = data + W * ( t + H * r1 );
+				const float invT = 1.0f / std::max( 1u, t1 - t0 ), invR = 1.0f / std::max( size_t( 1 ), r1 - r0 );
+				float* dst = &gradients[3 * W * ( t + H * r )];
+				float maxNorm = maxNorms[r];
+				for( uint s = 0; s < W; s++ )
+				{
+					const uint s0 = s > 0 ? s - 1 : s, s1 = s + 1 < W ? s + 1 : s;
+					float gs = ( row[s1] - row[s0] ) / std::max( 1u, s1 - s0 );
+					float gt = ( rowT1[s] - rowT0[s] ) * invT;
+					float gr = ( rowR1[s] - rowR0[s] ) * invR;
+					dst[3 * s] = gs; dst[3 * s + 1] = gt; dst[3 * s + 2] = gr;
+					maxNorm = std::max( maxNorm, gs * gs + gt * gt + gr * gr );
+				}
+				maxNorms[r] = maxNorm;
+			}
+		}, threads );
+
+		float maxNorm = sqrtf( *max_element( maxNorms.begin(), maxNorms.end() ) );
+		const float invMax = maxNorm > 0 ? 1 / maxNorm : 0;
+		Parallel::forEach( D, [&]( size_t r, unsigned int ) {
+			const size_t begin = size_t( W ) * H * r, end = begin + size_t( W ) * H;
+			for( size_t i = begin; i < end; i++ )
+			{
+				const float* g = &gradients[3 * i];
+				float n = sqrtf( g[0] * g[0] + g[1] * g[1] + g[2] * g[2] );
+				float inv = n > 0 ? -1 / n : 0;
+				uint32_t packed = uint32_t( std::min( 255.0f, n * invMax * 255 + 0.5f ) ) << 24;
+				for( uint c = 0; c < 3; c++ ) { packed |= uint32_t( ( g[c] * inv * 0.5f + 0.5f ) * 255 + 0.5f ) << ( 8 * c ); }
+				normals[i] = packed;
+			}
+		}, threads );
+	}
+
+	// interpolated normal (not normalized, as GL would filter it)
+	Vec3F normal( float s, float t, float r ) const
+	{
+		Vec3F dst;
+		Lighting::trilinear( width, height, depth, s, t, r, [&]( uint x, uint y, uint z, float weight ) {
+			uint32_t packed = normals[x + width * ( y + size_t( height ) * z )];
+			for( uint c = 0; c < 3; c++ ) { dst[c] += weight * ( float( ( packed >> ( 8 * c ) ) & 0xFF ) / 255 * 2 - 1 ); }
+		} );
+		return dst;
+	}
+
+	void generate(); // uploads 'normals' as a GL_RGBA8 3D texture
+};
+
+// Fraction of a directional light reaching each texel, computed by sweeping the slices of the axis closest
+// to the light's direction : each texel attenuates what reaches the texel before it along the light.
+// The sweep can be spread over several frames, the last complete volume staying usable meanwhile.
+struct TransmittanceVolume {
+
+	uint width = 0, height = 0, depth = 0;
+	float gain = 5; // extinction per texel : absorption * max(0,exp(gain*density)-1)
+	float absorption = 0.02f;
+	Vec3F direction; // of the light in 'values', in texels (s,t,r)
+	vector<float> values;
+	GLuint id = 0;
+
+	// starts computing the transmittance for the light 'towards' (in texels (s,t,r))
+	void start( const VoxelTexture& tex, const Vec3F& towards )
+	{
+		width = tex.width; height = tex.height; depth = tex.depth;
+		pending.resize( tex.size() );
+		pendingDirection = towards.normalized();
+		const uint size[3] = { width, height, depth };
+		axis = 0;
+		for( uint c = 1; c < 3; c++ )
+			if( fabsf( pendingDirection[c] ) > fabsf( pendingDirection[axis] ) ) { axis = c; }
+		u = axis == 0 ? 1 : 0;
+		v = axis == 2 ? 1 : 2;
+		U = size[u]; V = size[v];
+		slice = 0;
+		prevT.assign( size_t( U + 2 ) * ( V + 2 ), 1.0f ); // the light enters unattenuated
+		prevE.assign( prevT.size(), 0.0f );
+		curE.assign( prevT.size(), 0.0f );
+	}
+
+	inline bool sweeping() const { return slice < ( axis == 0 ? width : axis == 1 ? height : depth ); }
+
+	// sweeps up to 'maxSlices' more slices ; returns true once 'values' holds the new direction
+	bool sweep( const VoxelTexture& tex, uint maxSlices, uint threads = 0 )
+	{
+		const uint size[3] = { width, height, depth };
+		const size_t stride[3] = { 1, width, size_t( width ) * height };
+		const float* data = tex.data();
+		const uint P = U + 2; // padded rows
+		for( uint n = 0; n < maxSlices && sweeping(); n++, slice++ )
+		{
+			const size_t sliceOffset = stride[axis] * ( pendingDirection[axis] >= 0 ? slice : size[axis] - 1 - slice );
+
+			// one slice along the light : its texels' predecessors are at a constant offset in the previous one
+			const float dAxis = fabsf( pendingDirection[axis] );
+			const float du = -pendingDirection[u] / dAxis, dv = -pendingDirection[v] / dAxis;
+			const float stepLength = 1 / dAxis; // in texels
+			const int iu = std::min( int( floorf( du ) ), 0 ), iv = std::min( int( floorf( dv ) ), 0 );
+			const float au = du - iu, av = dv - iv;
+			const float w00 = ( 1 - au ) * ( 1 - av ), w10 = au * ( 1 - av ), w01 = ( 1 - au ) * av, w11 = au * av;
+			const bool first = slice == 0;
+
+			Parallel::forEach( V, [&]( size_t y, unsigned int ) {
+				float* e = &curE[P * ( y + 1 ) + 1];
+				const float* src = data + sliceOffset + stride[v] * y;
+				for( uint x = 0; x < U; x++ ) { e[x] = absorption * Lighting::curve( gain, src[stride[u] * x] ); }
+
+				const size_t prevRow = P * ( y + 1 + iv ) + 1 + iu;
+				const float* t0 = &prevT[prevRow], * t1 = &prevT[prevRow + P];
+				const float* e0 = &prevE[prevRow], * e1 = &prevE[prevRow + P];
+				float* dst = &pending[sliceOffset + stride[v] * y];
+				for( uint x = 0; x < U; x++ )
+				{
+					float t = w00 * t0[x] + w10 * t0[x + 1] + w01 * t1[x] + w11 * t1[x + 1];
+					float previousE = w00 * e0[x] + w10 * e0[x + 1] + w01 * e1[x] + w11 * e1[x + 1];
+					dst[stride[u] * x] = first ? 1.0f : t * expf( -0.5f * ( e[x] + previousE ) * stepLength );
+				}
+			}, threads );
+
+			// the slice becomes the previous one (its padding stays 1 and 0)
+			Parallel::forEach( V, [&]( size_t y, unsigned int ) {
+				const float* src = &pending[sliceOffset + stride[v] * y];
+				float* t = &prevT[P * ( y + 1 ) + 1];
+				for( uint x = 0; x < U; x++ ) { t[x] = src[stride[u] * x]; }
+			}, threads );
+			swap( prevE, curE );
+		}
+		if( sweeping() ) { return false; }
+		values.swap( pending );
+		direction = pendingDirection;
+		return true;
+	}
+
+	void compute( const VoxelTexture& tex, const Vec3F& towards, uint threads = 0 )
+	{
+		start( tex, towards );
+		sweep( tex, ~0u, threads );
+	}
+
+	float at( float s, float t, float r ) const
+	{
+		float dst = 0;
+		Lighting::trilinear( width, height, depth, s, t, r, [&]( uint x, uint y, uint z, float weight ) {
+			dst += weight * values[x + width * ( y + size_t( height ) * z )];
+		} );
+		return dst;
+	}
+
+	void generate(); // uploads 'values' as a GL_R32F 3D texture (or updates it)
+
+private:
+	vector<float> pending; // the sweep in progress
+	Vec3F pendingDirection;
+	uint axis = 0, u = 1, v = 2; // swept axis, and the slices' axes
+	uint U = 0, V = 0;
+	uint slice = 0;
+	vector<float> prevT, prevE, curE; // previous transmittance and extinctions, with a padding of 1 texel
+};
+
+// The lighting of fragFront.glsl : ambient + diffuse * transmittance * lambert
+struct VolumeLighting {
+
+	const GradientVolume* gradients = NULL;
+	const TransmittanceVolume* transmittance = NULL;
+	float ambient = 0.3f;
+
+	inline float at( float s, float t, float r ) const
+	{
+		Vec3F n = gradients->normal( s, t, r );
+		const Vec3F& l = transmittance->direction;
+		float lambert = std::max( 0.0f, -( n[0] * l[0] + n[1] * l[1] + n[2] * l[2] ) );
+		return ambient + ( 1 - ambient ) * transmittance->at( s, t, r ) * lambert;
+	}
+};
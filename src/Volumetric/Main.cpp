@@ -1,5 +1,13 @@
 
 #include "Voxel.h"
+#include "VoxelCache.h"
+#include "OccupancyGrid.h"
+#include "LazyVolume.h"
+#include "TransferFunction.h"
+#include "BrickAtlas.h"
+#include "AnimatedVolume.h"
+#include "LightingVolumes.h"
+#include "VoxelDistanceField.h"
 
 #include <stdlib.h>
 #include <iostream>
@@ -8,31 +16,80 @@
 #include <fstream>
 #include <sstream>
 #include <unordered_map>
+#include <chrono>
+#include <memory>
 
 using namespace std;
 
 bool demoMode = false;
-int currentModel = 0;
-
-vector<VoxelTexture> textures;
+size_t currentModel = 0;
+
+vector<LazyVolume> models;
+LazyVolume placeholder( "placeholder", []() { return VoxelTexture( VoxelCube() ); } ); // shown while a model is generated
+bool skipEmpty = true;
+double uploadBudget = 4; // in ms per frame
+TransferFunction transfer;
+bool preintegration = false;
+bool compressModels = true; // generated models are kept compressed in memory (see VoxelCompression.h)
+
+// out-of-core volume, streamed from disk (see VolumeRenderer's --bricks to write one)
+const string brickedFile = "volume.bricks";
+bool showBricked = false;
+BrickedVolume bricked;
+unique_ptr<BrickCache> brickCache;
+unique_ptr<BrickLoader> brickLoader;
+BrickAtlas atlas;
+const unsigned int maxBrickUploads = 16; // per frame
+
+// animation of the current model, its changed bricks are uploaded within 'uploadBudget'
+unique_ptr<AnimatedVolume> animated;
+chrono::steady_clock::time_point animationStart;
+
+// directional lighting of the shown model, the transmittance being swept a few slices per frame when the light moves
+bool lighting = false;
+bool lightReady = false; // once a transmittance volume is uploaded
+float lightAngle = 0.5f; // around the 'r' axis
+const LazyVolume* litModel = NULL;
+VoxelTexture litTex; // uncompressed copy of the lit model
+GradientVolume gradients;
+TransmittanceVolume transmittance;
+const unsigned int lightSlicesPerFrame = 16;
+
+// iso surface of the shown model, re-extracted incrementally as its threshold moves
+unique_ptr<IsoSurface> surface;
+const LazyVolume* surfaceModel = NULL;
+float surfaceThreshold = 0.5f;
 
 Mesh box = Cube();
 
 GlewGlut::Shader shaderBack;
 GlewGlut::Shader shader;
+GlewGlut::Shader shaderBricked;
 GLuint fbo;
 GLuint fboTex;
 
 GLuint wPos, hPos;
 GLuint offPos;
+GLuint skipEmptyPos;
+bool singlePass = false; // exit points computed in fragFront.glsl instead of rendered in the framebuffer
+
+// frame times (glFinish included), printed every 'timedFrames' frames
+bool timeFrames = false;
+const int timedFrames = 100;
+int frameCount = 0;
+double frameSum = 0;
 int offSet = 0;
+const float preintegrationStep = 0.04f; // plain ray marching uses 0.01
+
 
 struct Camera : public GlewGlut::TurnAroundCamera
 {
 	void display() override
 	{
-		if (demoMode)
+		if (demoMode) {
 			viewRotZ += 1;
+			GlewGlut::target.moved();
+		}
 		GlewGlut::TurnAroundCamera::display();
 	}
 };
@@ -41,6 +98,10 @@ Camera cam;
 
 void resize() {
 
+	shaderBricked.use();
+	glUniform1f(shaderBricked.getUniformLocation("width"), GLfloat( cam.currentW ) );
+	glUniform1f(shaderBricked.getUniformLocation("height"), GLfloat( cam.currentH ) );
+	shader.use();
 	glUniform1f(wPos, GLfloat( cam.currentW ) );
 	glUniform1f(hPos, GLfloat( cam.currentH ) );
 
@@ -55,13 +116,357 @@ void resize() {
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+void VoxelTexture::allocate()
+{
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_3D, id);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RED, width, height, depth, 0, GL_RED, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+}
+
+void VoxelTexture::upload( unsigned int firstSlice, unsigned int count )
+{
+	static vector<float> staging; // compressed slices are decompressed there first
+	const float* slices;
+	if (compressed) {
+		staging.resize(size_t( width ) * height * count);
+		compressed->decompressSlices(firstSlice, count, staging.data());
+		slices = staging.data();
+	} else {
+		slices = data() + size_t( width ) * height * firstSlice;
+	}
+	glBindTexture(GL_TEXTURE_3D, id);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, firstSlice, width, height, count, GL_RED, GL_FLOAT, slices);
+}
+
 void VoxelTexture::generate()
 {
+	TRACE_SCOPE( "VoxelTexture::generate" );
+	allocate();
+	upload( 0, depth );
+}
+
+void OccupancyGrid::generate()
+{
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_3D, id);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RG32F, width, height, depth, 0, GL_RG, GL_FLOAT, minMax.data());
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+}
+
+void BrickAtlas::generate()
+{
+	const unsigned int size = slotsPerAxis * slotSize;
 	glGenTextures(1, &id);
 	glBindTexture(GL_TEXTURE_3D, id);
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_RED, width, height, depth, 0, GL_RED, GL_FLOAT, voxels.data());
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, size, size, size, 0, GL_RED, GL_FLOAT, NULL);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+	glGenTextures(1, &indirectionId);
+	glBindTexture(GL_TEXTURE_3D, indirectionId);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA32F, indirectionW, indirectionH, indirectionD, 0, GL_RGBA, GL_FLOAT, indirection.data());
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+}
+
+void BrickAtlas::upload( unsigned int slot, const float* brick )
+{
+	glBindTexture(GL_TEXTURE_3D, id);
+	glTexSubImage3D(GL_TEXTURE_3D, 0,
+		(slot % slotsPerAxis) * slotSize, ((slot / slotsPerAxis) % slotsPerAxis) * slotSize, (slot / (slotsPerAxis * slotsPerAxis)) * slotSize,
+		slotSize, slotSize, slotSize, GL_RED, GL_FLOAT, brick);
+}
+
+void BrickAtlas::uploadIndirection()
+{
+	glBindTexture(GL_TEXTURE_3D, indirectionId);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, indirectionW, indirectionH, indirectionD, GL_RGBA, GL_FLOAT, indirection.data());
+}
+
+// opens the bricked volume the first time it's shown
+bool openBricked() {
+
+	if (brickLoader) { return true; }
+	if (!bricked.open(brickedFile)) {
+		cout << "can't open " << brickedFile << " (VolumeRenderer --bricks " << brickedFile << " writes one)" << endl;
+		return false;
+	}
+	brickCache.reset(new BrickCache());
+	brickLoader.reset(new BrickLoader(bricked, *brickCache));
+	atlas.init(bricked);
+	glActiveTexture(GL_TEXTURE4);
+	atlas.generate();
+	glActiveTexture(GL_TEXTURE5);
+	glBindTexture(GL_TEXTURE_3D, atlas.indirectionId);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_3D, atlas.id);
+	glActiveTexture(GL_TEXTURE0);
+
+	shaderBricked.use();
+	glUniform3f(shaderBricked.getUniformLocation("volumeSize"), GLfloat(bricked.width), GLfloat(bricked.height), GLfloat(bricked.depth));
+	glUniform1f(shaderBricked.getUniformLocation("brickSize"), GLfloat(bricked.brickSize));
+	cout << brickedFile << " : " << bricked.width << "x" << bricked.height << "x" << bricked.depth << ", " << bricked.levels << " levels" << endl;
+	return true;
+}
+
+uint brickUploads = 0; // of the last frame
+
+// requests the bricks needed by the current view, and uploads the loaded ones
+void streamBricks() {
+
+	Mat4 modelView, projection;
+	glGetFloatv(GL_MODELVIEW_MATRIX, modelView.m);
+	glGetFloatv(GL_PROJECTION_MATRIX, projection.m);
+	const float pixelsPerUnit = projection.at(1, 1) * cam.currentH / 2;
+	vector<BrickId> wanted = bricked.withAncestors(bricked.visibleBricks(projection * modelView, pixelsPerUnit));
+	brickLoader->request(wanted);
+	glActiveTexture(GL_TEXTURE4);
+	brickUploads = atlas.update(bricked, wanted, *brickCache, maxBrickUploads);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+// uploads the animated volume's changed bricks until the frame's budget is spent
+void updateAnimation() {
+
+	animated->update(chrono::duration<float>(chrono::steady_clock::now() - animationStart).count());
+
+	auto start = chrono::steady_clock::now();
+	AnimatedVolume::Brick brick;
+	const float* data;
+	glBindTexture(GL_TEXTURE_3D, animated->tex.id);
+	while (chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() < uploadBudget
+		&& animated->nextUpload(brick, data)) {
+		glTexSubImage3D(GL_TEXTURE_3D, 0, brick.s, brick.t, brick.r, brick.w, brick.h, brick.d, GL_RED, GL_FLOAT, data);
+	}
+}
+
+LazyVolume& shownModel();
+void bindModel( const LazyVolume& model );
+
+void stopAnimation() {
+
+	if (!animated) { return; }
+	animated->stats.print(cout);
+	animated.reset();
+	bindModel(shownModel());
+	shader.use();
+	glUniform1i(skipEmptyPos, skipEmpty);
+}
+
+// the current model, or the placeholder until it's ready
+LazyVolume& shownModel() {
+
+	if (currentModel < models.size() && models[currentModel].state == LazyVolume::Ready) {
+		return models[currentModel];
+	}
+	return placeholder;
+}
+
+void TransferFunction::generate()
+{
+	if (id == 0) { glGenTextures(1, &id); }
+	glBindTexture(GL_TEXTURE_2D, id);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, size, size, 0, GL_RED, GL_FLOAT, table.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+void GradientVolume::generate()
+{
+	if (id == 0) { glGenTextures(1, &id); }
+	glBindTexture(GL_TEXTURE_3D, id);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA8, width, height, depth, 0, GL_RGBA, GL_UNSIGNED_BYTE, normals.data());
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+}
+
+void TransmittanceVolume::generate()
+{
+	if (id == 0) { glGenTextures(1, &id); }
+	glBindTexture(GL_TEXTURE_3D, id);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, width, height, depth, 0, GL_RED, GL_FLOAT, values.data());
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+}
+
+void IsoSurface::upload()
+{
+	const size_t slotFloats = 3 * cellVertices;
+	if (vertexId == 0) {
+		glGenBuffers(1, &vertexId);
+		glGenBuffers(1, &normalId);
+	}
+	if (uploadedSize != positions.size()) {
+		glBindBuffer(GL_ARRAY_BUFFER, vertexId);
+		glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(float), positions.data(), GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, normalId);
+		glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float), normals.data(), GL_DYNAMIC_DRAW);
+		uploadedSize = positions.size();
+	} else {
+		for (const auto& range : dirty) {
+			if (range.second <= range.first) { continue; }
+			const GLintptr offset = range.first * slotFloats * sizeof(float);
+			const GLsizeiptr size = (range.second - range.first) * slotFloats * sizeof(float);
+			glBindBuffer(GL_ARRAY_BUFFER, vertexId);
+			glBufferSubData(GL_ARRAY_BUFFER, offset, size, positions.data() + range.first * slotFloats);
+			glBindBuffer(GL_ARRAY_BUFFER, normalId);
+			glBufferSubData(GL_ARRAY_BUFFER, offset, size, normals.data() + range.first * slotFloats);
+		}
+	}
+	dirty.clear();
+}
+
+void IsoSurface::draw()
+{
+	upload();
+	glBindBuffer(GL_ARRAY_BUFFER, vertexId);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, normalId);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glNormalPointer(GL_FLOAT, 0, 0);
+	glDrawArrays(GL_TRIANGLES, 0, GLsizei(slots() * cellVertices));
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	GlewGlut::drawCounters().drawCalls++; // counted as Mesh::draw's
+	GlewGlut::drawCounters().triangles += slots() * cellVertices / 3;
+}
+
+// re-extracts the iso surface at 'surfaceThreshold', from scratch when the shown model changed
+void updateSurface() {
+
+	const LazyVolume& model = shownModel();
+	if (surfaceModel != &model) {
+		surface.reset(new IsoSurface(model.tex, model.grid));
+		surfaceModel = &model;
+	}
+	auto start = chrono::steady_clock::now();
+	surface->update(surfaceThreshold);
+	cout << "iso surface at " << surfaceThreshold << " : " << surface->cubes() << " cubes in "
+		<< chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+}
+
+// draws the iso surface with the fixed pipeline's lighting, in the box's frame
+void drawSurface() {
+
+	glUseProgram(0);
+	glCullFace(GL_BACK);
+	glEnable(GL_LIGHTING);
+	glEnable(GL_LIGHT0);
+	glEnable(GL_NORMALIZE);
+	glPushMatrix();
+	// the surface's x, y, z are the texels' t, r, s while the box's are r, s, t
+	const GLfloat axes[16] = { 0, 0, 2, 0, 2, 0, 0, 0, 0, 2, 0, 0, 0, 0, 0, 1 };
+	glMultMatrixf(axes);
+	surface->draw();
+	glPopMatrix();
+	glDisable(GL_LIGHTING);
+}
+
+// light slanted downwards, turning around the 'r' axis (in texels)
+Vec3F lightDirection() {
+
+	return Vec3F(cosf(lightAngle), sinf(lightAngle), -0.7f).normalized();
+}
+
+// restarts the transmittance sweep, and the gradients when the shown model changed
+void startLighting() {
+
+	const LazyVolume& model = shownModel();
+	if (litModel != &model || litTex.size() != model.tex.size()) {
+		litModel = &model;
+		litTex = model.tex;
+		litTex.decompress();
+		auto start = chrono::steady_clock::now();
+		gradients = GradientVolume(litTex);
+		glActiveTexture(GL_TEXTURE6);
+		gradients.generate();
+		glActiveTexture(GL_TEXTURE0);
+		lightReady = false;
+		cout << "gradients of " << model.name << " : " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+	}
+	transmittance.gain = transfer.gain;
+	transmittance.start(litTex, lightDirection());
+}
+
+// continues the transmittance sweep, and uploads it once done
+void updateLighting() {
+
+	if (lighting && transmittance.sweeping() && transmittance.sweep(litTex, lightSlicesPerFrame)) {
+		glActiveTexture(GL_TEXTURE7);
+		transmittance.generate();
+		glActiveTexture(GL_TEXTURE0);
+		lightReady = true;
+		shader.use();
+		glUniform3f(shader.getUniformLocation("lightDir"), transmittance.direction[0], transmittance.direction[1], transmittance.direction[2]);
+	}
+	shader.use();
+	glUniform1i(shader.getUniformLocation("lighting"), lighting && lightReady && !animated);
+}
+
+// sets the gain, and recomputes the pre-integration table for the shown model, the gain and the brightness when it's on
+void updateTransferFunction() {
+
+	shader.use();
+	if (preintegration) {
+		transfer.brightness = expf(0.1f * offSet);
+		transfer.fit(shownModel().grid);
+		transfer.compute();
+		glActiveTexture(GL_TEXTURE3);
+		transfer.generate();
+		glActiveTexture(GL_TEXTURE0);
+	}
+	glUniform1f(shader.getUniformLocation("gain"), transfer.gain);
+	glUniform2f(shader.getUniformLocation("preintegrationDomain"), transfer.minDensity, transfer.maxDensity);
+	glUniform1i(shader.getUniformLocation("usePreintegration"), preintegration);
+	glUniform1f(shader.getUniformLocation("stepSize"), preintegration ? preintegrationStep : 0.01f);
+
+	// the transmittance depends on the model and the gain
+	if (lighting) { startLighting(); }
+}
+
+void bindModel( const LazyVolume& model ) {
+
+	shader.use();
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_3D, model.tex.id);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_3D, model.grid.id);
+	glUniform1f(shader.getUniformLocation("cellSize"), GLfloat( model.grid.cellSize ) );
+	glActiveTexture(GL_TEXTURE0);
+	updateTransferFunction();
+}
+
+// uploads slices of the current model until the frame's budget is spent
+void uploadCurrentModel() {
+
+	if (currentModel >= models.size()) { return; }
+	LazyVolume& model = models[currentModel];
+	if (!model.generated() || model.state == LazyVolume::Ready) { return; }
+
+	auto start = chrono::steady_clock::now();
+	if (model.uploadedSlices == 0) { model.tex.allocate(); }
+	while (model.uploadedSlices < model.tex.depth) {
+		unsigned int count = std::min(8u, model.tex.depth - model.uploadedSlices);
+		model.tex.upload(model.uploadedSlices, count);
+		model.uploadedSlices += count;
+		if (chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() > uploadBudget) { break; }
+	}
+	if (model.uploadedSlices == model.tex.depth) {
+		model.grid.generate();
+		model.state = LazyVolume::Ready;
+		cout << model.name << " is ready" << endl;
+		bindModel(model);
+		if (surface) { updateSurface(); } // the placeholder's was shown
+	}
 }
 
 void init() {
@@ -69,6 +474,7 @@ void init() {
 	glClearColor(0.0, 0.0, 0.0, 1.0);
 	shaderBack = GlewGlut::Shader("vert.glsl", "fragBack.glsl");
 	shader = GlewGlut::Shader("vert.glsl", "fragFront.glsl");
+	shaderBricked = GlewGlut::Shader("vert.glsl", "fragFront_Bricked.glsl");
 
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
@@ -85,28 +491,59 @@ void init() {
 	wPos = shader.getUniformLocation("width");
 	hPos = shader.getUniformLocation("height");
 	offPos = shader.getUniformLocation("offset");
+	skipEmptyPos = shader.getUniformLocation("skipEmpty");
 
 	// binding to the shader
 	shader.use();
 	glUniform1i(shader.getUniformLocation("backRender"), 0);
 
-	textures.push_back( PerlinNoise( 256 ) );
-	textures.push_back(VoxelCube());
-	/*auto mri = VoxelMRI("data/MRbrain/MRbrain.", 1, 109);
-	mri.zRatio = -1; mri.xRatio = 0.7;
-	textures.push_back(mri);*/
-	auto mandelbulb = VoxelMandelbulb(128, 3);
-	mandelbulb.compute();
-	textures.push_back(mandelbulb);
-
-	for (auto& tex : textures) {
-		tex.generate();
+	// models are only generated once selected
+	models.push_back( LazyVolume( "PerlinNoise", []() {
+		return VoxelCache().get( { "PerlinNoise", PerlinNoise::version, { 256, 0 } }, []() {
+			return VoxelTexture( PerlinNoise( 256, 0 ) );
+		} );
+	} ) );
+	models.push_back( LazyVolume( "VoxelCube", []() { return VoxelTexture( VoxelCube() ); } ) );
+	/*models.push_back( LazyVolume( "VoxelMRI", []() {
+		auto mri = VoxelMRI("data/MRbrain/MRbrain.", 1, 109);
+		mri.zRatio = -1; mri.xRatio = 0.7;
+		return VoxelTexture( mri );
+	} ) );*/
+	models.push_back( LazyVolume( "VoxelMandelbulb", []() {
+		return VoxelCache().get( { "VoxelMandelbulb", VoxelMandelbulb::version, { 128, 3, 20 } }, []() {
+			auto mandelbulb = VoxelMandelbulb(128, 3);
+			mandelbulb.compute();
+			return VoxelTexture( mandelbulb );
+		} );
+	} ) );
+	if (ifstream("suzan.obj").peek() != EOF) { // voxelized from its signed distance field
+		models.push_back( LazyVolume( "suzan.obj", []() {
+			return VoxelDistanceField( Mesh::loadWavefront("suzan.obj"), 128 ).density();
+		} ) );
 	}
+	for (LazyVolume& model : models) { model.compress = compressModels; }
+	models[currentModel].request();
+
+	placeholder.tex = placeholder.build();
+	placeholder.tex.generate();
+	placeholder.grid = OccupancyGrid( placeholder.tex );
+	placeholder.grid.generate();
+	placeholder.state = LazyVolume::Ready;
 
+	shader.use();
 	glUniform1i(shader.getUniformLocation("voxels"), 1);
+	glUniform1i(shader.getUniformLocation("occupancy"), 2);
+	glUniform1i(shader.getUniformLocation("preintegration"), 3);
+	glUniform1i(shader.getUniformLocation("gradients"), 6);
+	glUniform1i(shader.getUniformLocation("transmittance"), 7);
+	glUniform1i(skipEmptyPos, skipEmpty);
 
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_3D, textures[0].id);
+	shaderBricked.use();
+	glUniform1i(shaderBricked.getUniformLocation("backRender"), 0);
+	glUniform1i(shaderBricked.getUniformLocation("atlas"), 4);
+	glUniform1i(shaderBricked.getUniformLocation("indirection"), 5);
+
+	bindModel( shownModel() );
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, fboTex);
@@ -114,26 +551,85 @@ void init() {
 
 void display() {
 
-	if (currentModel < textures.size()) {
-		auto& model = textures[currentModel];
-		glScalef(model.xRatio, model.yRatio, model.zRatio);
+	{
+		GlewGlut::PassTimers::Scope pass(GlewGlut::timers, "uploads");
+
+		uploadCurrentModel();
+
+		if (showBricked) {
+			streamBricks();
+		} else if (animated) {
+			glActiveTexture(GL_TEXTURE1);
+			updateAnimation();
+			glActiveTexture(GL_TEXTURE0);
+			GlewGlut::target.moved(); // no full resolution frames while it plays
+			const VoxelTexture& model = animated->tex;
+			glScalef(model.xRatio, model.yRatio, model.zRatio);
+		} else {
+			const VoxelTexture& model = shownModel().tex;
+			glScalef(model.xRatio, model.yRatio, model.zRatio);
+		}
+		updateLighting();
+	}
+
+	auto start = chrono::steady_clock::now();
+	if (timeFrames) { glFinish(); start = chrono::steady_clock::now(); }
+
+	if (surface) {
+		GlewGlut::PassTimers::Scope pass(GlewGlut::timers, "surface");
+		if (surfaceModel != &shownModel()) { updateSurface(); } // whatever changed the shown model
+		glBindFramebuffer(GL_FRAMEBUFFER, GlewGlut::target.target());
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		drawSurface();
+		return;
 	}
 
 	// first pass : rendering back faces on the framebuffer
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glCullFace(GL_BACK);
-	shaderBack.use();
-	box.draw();
+	if (!singlePass) {
+		GlewGlut::PassTimers::Scope pass(GlewGlut::timers, "back faces");
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glCullFace(GL_BACK);
+		shaderBack.use();
+		box.draw();
+	}
 
 	// second pass : rendering the scene
-	glBindFramebuffer(GL_FRAMEBUFFER, NULL);
+	{
+		GlewGlut::PassTimers::Scope pass(GlewGlut::timers, "ray marching");
+		glBindFramebuffer(GL_FRAMEBUFFER, GlewGlut::target.target());
+
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		glCullFace(GL_FRONT);
+		if (showBricked) {
+			shaderBricked.use();
+			glUniform1i(shaderBricked.getUniformLocation("offset"), offSet);
+			glUniform1f(shaderBricked.getUniformLocation("gain"), transfer.gain);
+		} else {
+			shader.use();
+		}
+		box.draw();
+	}
+
+	if (timeFrames) {
+		glFinish();
+		frameSum += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		if (++frameCount == timedFrames) {
+			cout << (singlePass ? "single pass : " : "two passes : ") << frameSum / frameCount << " ms per frame" << endl;
+			frameCount = 0;
+			frameSum = 0;
+		}
+	}
+}
 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+// frames are drawn while the scene changes on its own, else only on input (see GlewGlut::markDirty)
+bool animating() {
 
-	glCullFace(GL_FRONT);
-	shader.use();
-	box.draw();
+	const bool loading = currentModel < models.size()
+		&& (models[currentModel].state == LazyVolume::Generating || models[currentModel].state == LazyVolume::Uploading);
+	const bool streaming = showBricked && brickLoader && (brickLoader->pending() > 0 || brickUploads > 0);
+	return demoMode || animated || loading || streaming || (lighting && transmittance.sweeping());
 }
 
 int main(int argc, char *argv[])
@@ -146,6 +642,7 @@ int main(int argc, char *argv[])
 				offSet++;
 				shader.use();
 				glUniform1i( offPos, offSet );
+				updateTransferFunction();
 			}
 		}
 	};
@@ -157,6 +654,7 @@ int main(int argc, char *argv[])
 				offSet--;
 				shader.use();
 				glUniform1i( offPos, offSet );
+				updateTransferFunction();
 			}
 		}
 	};
@@ -172,20 +670,181 @@ int main(int argc, char *argv[])
 		[]( bool down ) {
 			if( !down )
 			{
+				stopAnimation();
 				currentModel++;
-				if (currentModel >= textures.size()) { currentModel = 0; }
-				if (currentModel < textures.size()) {
-					glActiveTexture(GL_TEXTURE1);
-					glBindTexture(GL_TEXTURE_3D, textures[currentModel].id);
+				if (currentModel >= models.size()) { currentModel = 0; }
+				if (currentModel < models.size()) {
+					models[currentModel].request();
+					bindModel( shownModel() );
+					if( surface ) { updateSurface(); }
 				}
 			}
 		}
 	};
+	GlewGlut::keys['p'] = {
+		"Switches the pre-integrated transfer function (4x larger steps, off by default : see TransferFunction.h)",
+		[]( bool down ) {
+			if( !down )
+			{
+				preintegration = !preintegration;
+				updateTransferFunction();
+			}
+		}
+	};
+	GlewGlut::keys[']'] = {
+		"Increase the transfer function's gain",
+		[]( bool down ) {
+			if( down )
+			{
+				transfer.gain += 0.5f;
+				updateTransferFunction();
+			}
+		}
+	};
+	GlewGlut::keys['['] = {
+		"Decrease the transfer function's gain",
+		[]( bool down ) {
+			if( down )
+			{
+				transfer.gain = std::max( 0.5f, transfer.gain - 0.5f );
+				updateTransferFunction();
+			}
+		}
+	};
+	GlewGlut::keys['e'] = {
+		"Switches empty-space skipping and early ray termination",
+		[]( bool down ) {
+			if( !down )
+			{
+				skipEmpty = !skipEmpty;
+				shader.use();
+				glUniform1i( skipEmptyPos, skipEmpty && !animated );
+			}
+		}
+	};
+
+	GlewGlut::keys['s'] = {
+		"Switches between one pass (analytic exit points) and two passes (back faces rendered first)",
+		[]( bool down ) {
+			if( !down )
+			{
+				singlePass = !singlePass;
+				shader.use();
+				glUniform1i( shader.getUniformLocation( "singlePass" ), singlePass );
+				shaderBricked.use();
+				glUniform1i( shaderBricked.getUniformLocation( "singlePass" ), singlePass );
+				frameCount = 0;
+				frameSum = 0;
+			}
+		}
+	};
+	GlewGlut::keys['t'] = {
+		"Switches the frame time measurement",
+		[]( bool down ) {
+			if( !down )
+			{
+				timeFrames = !timeFrames;
+				frameCount = 0;
+				frameSum = 0;
+			}
+		}
+	};
+	GlewGlut::keys['a'] = {
+		"Switches the animation of the current model (Perlin noise scrolling, Mandelbulb changing order)",
+		[]( bool down ) {
+			if( down ) { return; }
+			if( animated )
+			{
+				stopAnimation();
+				return;
+			}
+			const LazyVolume& model = shownModel();
+			if( model.name == "PerlinNoise" ) { animated = AnimatedVolume::scrolling( model.tex, 30 ); }
+			else if( model.name == "VoxelMandelbulb" ) { animated = AnimatedVolume::mandelbulb( 128, 2, 8, 20 ); }
+			else { cout << "no animation for " << model.name << endl; return; }
+			animationStart = chrono::steady_clock::now();
+			glActiveTexture( GL_TEXTURE1 );
+			animated->tex.generate();
+			glActiveTexture( GL_TEXTURE0 );
+			// the occupancy grid isn't updated
+			shader.use();
+			glUniform1i( skipEmptyPos, 0 );
+		}
+	};
+	GlewGlut::keys['l'] = {
+		"Switches the directional lighting (gradients and light transmittance volumes)",
+		[]( bool down ) {
+			if( !down )
+			{
+				lighting = !lighting;
+				if( lighting ) { startLighting(); }
+			}
+		}
+	};
+	GlewGlut::keys['k'] = {
+		"Turns the light",
+		[]( bool down ) {
+			if( down )
+			{
+				lightAngle += float( M_PI ) / 12;
+				if( lighting ) { startLighting(); }
+			}
+		}
+	};
+	GlewGlut::keys['i'] = {
+		"Switches to the iso surface of the current model",
+		[]( bool down ) {
+			if( down ) { return; }
+			if( surface ) { surface.reset(); surfaceModel = NULL; }
+			else { updateSurface(); }
+		}
+	};
+	GlewGlut::keys['.'] = {
+		"Raises the iso surface's threshold",
+		[]( bool down ) {
+			if( down && surface )
+			{
+				surfaceThreshold += 0.02f;
+				updateSurface();
+			}
+		}
+	};
+	GlewGlut::keys[','] = {
+		"Lowers the iso surface's threshold",
+		[]( bool down ) {
+			if( down && surface )
+			{
+				surfaceThreshold -= 0.02f;
+				updateSurface();
+			}
+		}
+	};
+	GlewGlut::keys['b'] = {
+		"Switches to the out-of-core volume streamed from volume.bricks",
+		[]( bool down ) {
+			if( !down )
+				showBricked = !showBricked && openBricked();
+		}
+	};
+	GlewGlut::keys['n'] = {
+		"Prints the brick streaming counters",
+		[]( bool down ) {
+			if( !down && brickCache )
+			{
+				brickCache->getStats().print( cout );
+				cout << brickLoader->pending() << " pending loads, " << brickLoader->bytesRead / ( 1 << 20 ) << " MB read, "
+					<< atlas.slots.size() << "/" << atlas.slotCount() << " atlas slots, " << atlas.uploads << " uploads" << endl;
+			}
+		}
+	};
 
 	GlewGlut::Callbacks callbacks;
 	callbacks.display = display;
 	callbacks.init = init;
 	callbacks.reshape = resize;
+	callbacks.animating = animating;
 	GlewGlut::Params params; params.camera = &cam;
+	params.dynamicResolution = true;
+	params.parseArguments(argc, argv);
 	GlewGlut::main(callbacks, params);
 }
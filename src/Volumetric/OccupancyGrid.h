@@ -0,0 +1,63 @@
+#pragma once
+
+#include "Voxel.h"
+#include <Parallel.h>
+
+// Coarse min/max of a VoxelTexture, to skip empty regions when ray marching.
+// Cells are laid out like the GL texture (s fastest, then t, then r) and each one
+// also covers the neighbour texels a GL_LINEAR + GL_REPEAT lookup inside it can read.
+struct OccupancyGrid {
+
+	uint cellSize; // in texels
+	uint width, height, depth; // in cells
+	vector<float> minMax; // 2 floats per cell
+	GLuint id;
+
+	OccupancyGrid() {}
+	OccupancyGrid( const VoxelTexture& tex, uint cellSize = 8 ) : cellSize( cellSize )
+	{
+		const int W = tex.width, H = tex.height, D = tex.depth;
+		width = ( W + cellSize - 1 ) / cellSize;
+		height = ( H + cellSize - 1 ) / cellSize;
+		depth = ( D + cellSize - 1 ) / cellSize;
+		minMax.resize( 2 * size_t( width ) * height * depth );
+
+		const float* data = tex.data();
+		Parallel::forEach( depth, [&]( size_t r, unsigned int ) {
+			for( uint t = 0; t < height; t++ )
+				for( uint s = 0; s < width; s++ )
+				{
+					float minV = INFINITY, maxV = -INFINITY;
+					for( int z = int( r * cellSize ) - 1; z <= int( ( r + 1 ) * cellSize ); z++ )
+						for( int y = int( t * cellSize ) - 1; y <= int( ( t + 1 ) * cellSize ); y++ )
+							for( int x = int( s * cellSize ) - 1; x <= int( ( s + 1 ) * cellSize ); x++ )
+							{
+								float v = data[wrap( x, W ) + W * ( wrap( y, H ) + size_t( H ) * wrap( z, D ) )];
+								minV = std::min( minV, v );
+								maxV = std::max( maxV, v );
+							}
+					float* cell = &minMax[2 * index( s, t, uint( r ) )];
+					cell[0] = minV;
+					cell[1] = maxV;
+				}
+		} );
+	}
+
+	static inline int wrap( int i, int size ) { return ( ( i % size ) + size ) % size; }
+
+	inline size_t index( uint s, uint t, uint r ) const { return s + width * ( t + size_t( height ) * r ); }
+	inline float minAt( uint s, uint t, uint r ) const { return minMax[2 * index( s, t, r )]; }
+	inline float maxAt( uint s, uint t, uint r ) const { return minMax[2 * index( s, t, r ) + 1]; }
+
+	// the transfer function max(0,exp(5*d)-1) is null where densities are <= 0
+	inline bool empty( uint s, uint t, uint r ) const { return maxAt( s, t, r ) <= 0; }
+
+	float emptyRatio() const
+	{
+		size_t count = 0;
+		for( size_t i = 1; i < minMax.size(); i += 2 ) { count += minMax[i] <= 0; }
+		return float( count ) / ( minMax.size() / 2 );
+	}
+
+	void generate(); // uploads 'minMax' as a GL_RG32F 3D texture
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "Voxel.h"
+#include "OccupancyGrid.h"
+#include <Parallel.h>
+
+// Pre-integrated transfer function : table[back][front] is the mean emission along a segment
+// whose density goes linearly from 'front' to 'back', so that a ray marcher can take large steps.
+//
+// Off by default ('p' in Volumetric, --preint in VolumeRenderer) : it only helps when the curve is steep
+// over thin dense shells. On the mandelbulb, against a 0.001 step reference, it lowers the worst pixel
+// error at gains of 40 and more (253 to 113 at gain 60 and the 0.01 step, 255 to 216 at the 0.04 step).
+// At the default gain of 5, and on perlin at any gain, the error comes from undersampling the density
+// rather than the curve : it's then up to 70% worse than plain marching at the same step, and 10 to 20% slower.
+struct TransferFunction {
+
+	float gain = 5; // the curve is max(0,exp(gain*density)-1), as in fragFront.glsl
+	float brightness = 1; // exp(0.1*offset), folded in the table
+	float minDensity = 0, maxDensity = 1; // domain of the table
+	uint size = 256;
+	vector<float> table;
+	GLuint id = 0;
+
+	inline float curve( float density ) const { return std::max( 0.0f, expf( gain * density ) - 1 ); }
+
+	// sets the domain to the densities of 'tex'
+	void fit( const VoxelTexture& tex )
+	{
+		minDensity = INFINITY;
+		maxDensity = -INFINITY;
+		const float* data = tex.data();
+		for( size_t i = 0; i < tex.size(); i++ )
+		{
+			minDensity = std::min( minDensity, data[i] );
+			maxDensity = std::max( maxDensity, data[i] );
+		}
+		if( !( maxDensity > minDensity ) ) { maxDensity = minDensity + 1; }
+	}
+
+	// same, from the (much smaller) occupancy grid of the texture
+	void fit( const OccupancyGrid& grid )
+	{
+		minDensity = INFINITY;
+		maxDensity = -INFINITY;
+		for( size_t i = 0; i < grid.minMax.size(); i += 2 )
+		{
+			minDensity = std::min( minDensity, grid.minMax[i] );
+			maxDensity = std::max( maxDensity, grid.minMax[i + 1] );
+		}
+		if( !( maxDensity > minDensity ) ) { maxDensity = minDensity + 1; }
+	}
+
+	inline float densityAt( float i ) const { return minDensity + ( maxDensity - minDensity ) * i / ( size - 1 ); }
+
+	// to call again when the curve, the brightness or the domain change
+	void compute()
+	{
+		// integral of the curve over the domain, finely sampled
+		const uint fine = 16 * size;
+		vector<double> integral( fine + 1, 0.0 );
+		const double h = double( maxDensity - minDensity ) / fine;
+		for( uint i = 1; i <= fine; i++ )
+		{
+			float d0 = minDensity + float( ( i - 1 ) * h ), d1 = minDensity + float( i * h );
+			integral[i] = integral[i - 1] + 0.5 * h * ( curve( d0 ) + curve( d1 ) );
+		}
+		auto integralAt = [&]( float density ) {
+			double x = ( density - minDensity ) / h;
+			uint i = uint( std::min( std::max( x, 0.0 ), double( fine - 1 ) ) );
+			double a = x - i;
+			return ( 1 - a ) * integral[i] + a * integral[i + 1];
+		};
+
+		table.resize( size_t( size ) * size );
+		Parallel::forEach( size, [&]( size_t back, unsigned int ) {
+			const float b = densityAt( float( back ) );
+			for( uint front = 0; front < size; front++ )
+			{
+				const float f = densityAt( float( front ) );
+				float mean = ( back == front ) ? curve( f )
+					: float( ( integralAt( b ) - integralAt( f ) ) / ( b - f ) );
+				table[back * size + front] = brightness * std::max( mean, 0.0f );
+			}
+		} );
+	}
+
+	// same as texture( table, ( vec2( front, back ) * ( size - 1 ) + 0.5 ) / size ) with GL_LINEAR
+	float lookup( float front, float back ) const
+	{
+		const float scale = ( size - 1 ) / ( maxDensity - minDensity );
+		float x = std::min( std::max( ( front - minDensity ) * scale, 0.0f ), float( size - 1 ) );
+		float y = std::min( std::max( ( back - minDensity ) * scale, 0.0f ), float( size - 1 ) );
+		uint x0 = std::min( uint( x ), size - 2 ), y0 = std::min( uint( y ), size - 2 );
+		float a = x - x0, b = y - y0;
+		const float* row0 = &table[y0 * size], * row1 = &table[( y0 + 1 ) * size];
+		return ( 1 - b ) * ( ( 1 - a ) * row0[x0] + a * row0[x0 + 1] )
+			+ b * ( ( 1 - a ) * row1[x0] + a * row1[x0 + 1] );
+	}
+
+	void generate(); // uploads 'table' as a GL_R32F 2D texture (or updates it)
+};
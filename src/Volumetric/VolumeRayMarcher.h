@@ -0,0 +1,293 @@
+#pragma once
+
+#include "Voxel.h"
+#include "OccupancyGrid.h"
+#include "TransferFunction.h"
+#include "LightingVolumes.h"
+#include <Mat4.h>
+#include <Parallel.h>
+
+#include <vector>
+#include <chrono>
+#include <math.h>
+
+// CPU reference of Volumetric's GL path (fragBack.glsl + fragFront.glsl) : no GL context needed
+
+// Same transformations as GlewGlut::TurnAroundCamera followed by Volumetric's display()
+struct VolumeCamera {
+
+	float viewTrX = 0, viewY = 0;
+	float viewRotX = 30, viewRotZ = 10, zoom = 1;
+
+	Mat4 projection( uint w, uint h ) const
+	{ return Mat4::perspective( 50, float( w ) / h, 0.1f, 100 ); }
+
+	Mat4 modelView( const VoxelTexture& tex ) const
+	{
+		return Mat4::lookAt( { 0, -3, 0 }, { 0, 0, 0 }, { 0, 0, 1 } )
+			* Mat4::translation( viewTrX, 0, viewY )
+			* Mat4::rotation( viewRotX, 1, 0, 0 )
+			* Mat4::rotation( viewRotZ, 0, 0, 1 )
+			* Mat4::scaling( zoom, zoom, zoom )
+			* Mat4::scaling( tex.xRatio, tex.yRatio, tex.zRatio );
+	}
+};
+
+struct VolumeRenderStats {
+	size_t rays = 0, samples = 0;
+	double seconds = 0;
+
+	void print( std::ostream& out ) const
+	{
+		out << rays << " rays, " << samples << " samples in " << seconds * 1000 << " ms : "
+			<< rays / seconds / 1e6 << " Mrays/s, "
+			<< samples / seconds / 1e6 << " Msamples/s" << std::endl;
+	}
+};
+
+struct VolumeRayMarcher {
+
+	static const uint PacketSize = 8; // rays marched together : a data layout (SoA), each lane is still marched scalar
+	static const uint TileSize = 16;
+
+	const VoxelTexture& tex;
+	int offset = 0; // brightness, as the 'offset' uniform
+	float step = 0.01f; // precision of the ray marching, as in fragFront.glsl
+	float gain = 5; // of the transfer function
+	unsigned int threads = 0; // 0 = all cores
+
+	const OccupancyGrid* grid = NULL; // when set, empty cells are skipped
+	bool earlyExit = false; // stops marching once the pixel is saturated
+	int maxSteps = 1 << 30; // cap of the marching iterations (samples and skips)
+	const TransferFunction* transfer = NULL; // when set, integrates segments with the pre-integrated table
+	const VolumeLighting* lighting = NULL; // when set, the emission is lit
+
+	VolumeRayMarcher( const VoxelTexture& tex ) : tex( tex ) {}
+
+	// texture( voxels, vec3( s, t, r ) ) with GL_LINEAR filtering and the default GL_REPEAT wrapping
+	float sample( float s, float t, float r ) const
+	{
+		const float* data = tex.data();
+		const int W = tex.width, H = tex.height, D = tex.depth;
+		float u = s * W - 0.5f, v = t * H - 0.5f, w = r * D - 0.5f;
+		float fu = floorf( u ), fv = floorf( v ), fw = floorf( w );
+		float a = u - fu, b = v - fv, c = w - fw;
+		int u0 = int( fu ) % W, v0 = int( fv ) % H, w0 = int( fw ) % D;
+		if( u0 < 0 ) { u0 += W; }
+		if( v0 < 0 ) { v0 += H; }
+		if( w0 < 0 ) { w0 += D; }
+		int u1 = u0 + 1 == W ? 0 : u0 + 1, v1 = v0 + 1 == H ? 0 : v0 + 1, w1 = w0 + 1 == D ? 0 : w0 + 1;
+		auto texel = [&]( int x, int y, int z ) { return data[x + W * ( y + size_t( H ) * z )]; };
+		return
+			( 1 - c ) * (
+				( 1 - b ) * ( ( 1 - a ) * texel( u0, v0, w0 ) + a * texel( u1, v0, w0 ) )
+				+ b * ( ( 1 - a ) * texel( u0, v1, w0 ) + a * texel( u1, v1, w0 ) )
+			) + c * (
+				( 1 - b ) * ( ( 1 - a ) * texel( u0, v0, w1 ) + a * texel( u1, v0, w1 ) )
+				+ b * ( ( 1 - a ) * texel( u0, v1, w1 ) + a * texel( u1, v1, w1 ) )
+			);
+	}
+
+	// getDensity() of fragFront.glsl, pos in [0;1]^3
+	inline float density( float x, float y, float z ) const
+	{ return std::max( 0.0f, expf( gain * sample( y, z, x ) ) - 1 ); }
+
+	// getLight() of fragFront.glsl, pos in [0;1]^3
+	inline float light( float x, float y, float z ) const
+	{ return lighting != NULL ? lighting->at( y, z, x ) : 1.0f; }
+
+	// multiplies the sums, when it isn't already in the transfer function's table
+	inline float brightness() const { return transfer != NULL ? 1.0f : expf( 0.1f * offset ); }
+
+	struct RayPacket {
+		float start[3][PacketSize], end[3][PacketSize]; // in [0;1]^3
+		float nbSteps[PacketSize];
+		float sum[PacketSize];
+		uint count = 0;
+	};
+
+	// Intersects the ray going through the pixel center with the [-1;1]^3 box.
+	// Returns false when there's no front face to rasterize (box missed, or clipped by the near plane).
+	static bool boxEntryExit( const Mat4& invMVP, float ndcX, float ndcY, Vec3F& entry, Vec3F& exit )
+	{
+		Vec3F o = invMVP.transformPoint( { ndcX, ndcY, -1.0f } );
+		Vec3F d = invMVP.transformPoint( { ndcX, ndcY, 1.0f } ) - o;
+		float tMin = -INFINITY, tMax = INFINITY;
+		for( uint i = 0; i < 3; i++ )
+		{
+			float t0 = ( -1 - o[i] ) / d[i], t1 = ( 1 - o[i] ) / d[i];
+			if( t0 > t1 ) { std::swap( t0, t1 ); }
+			tMin = std::max( tMin, t0 );
+			tMax = std::min( tMax, t1 );
+		}
+		if( !( tMin < tMax ) || tMin < 0 || tMin > 1 ) { return false; }
+		entry = o + d * tMin;
+		exit = o + d * std::min( tMax, 1.0f );
+		return true;
+	}
+
+	// Number of samples until the ray leaves the grid cell of 'pos' (in [0;1]^3), and whether that cell is empty
+	float cellExit( const float pos[3], const float delta[3], bool& empty ) const
+	{
+		const float cs = float( grid->cellSize );
+		const uint dims[3] = { grid->width, grid->height, grid->depth };
+		// texture coordinates are pos.yzx
+		const float p[3] = { pos[1] * tex.width / cs, pos[2] * tex.height / cs, pos[0] * tex.depth / cs };
+		const float d[3] = { delta[1] * tex.width / cs, delta[2] * tex.height / cs, delta[0] * tex.depth / cs };
+		uint cell[3];
+		for( uint c = 0; c < 3; c++ )
+			cell[c] = uint( std::min( std::max( floorf( p[c] ), 0.0f ), float( dims[c] - 1 ) ) );
+		empty = grid->empty( cell[0], cell[1], cell[2] );
+		float tExit = INFINITY; // in samples
+		for( uint c = 0; c < 3; c++ )
+		{
+			if( fabsf( d[c] ) < 1e-8f ) { continue; }
+			float bound = d[c] > 0 ? floorf( p[c] ) + 1 - p[c] : p[c] - floorf( p[c] );
+			tExit = std::min( tExit, bound / fabsf( d[c] ) );
+		}
+		return floorf( tExit ) + 1;
+	}
+
+	// main() of fragFront.glsl for every ray of the packet ; returns the number of samples.
+	// Only the setup and the positions are computed lane-wise : the lanes skip cells, end and saturate apart,
+	// and sample() is a scalar gather, so the marching itself is a scalar loop over the active lanes.
+	size_t march( RayPacket& p ) const
+	{
+		const float saturation = 3 / brightness(); // above it, all the channels are saturated
+		float delta[3][PacketSize], i[PacketSize];
+		float nextCell[PacketSize]; // first sample out of the last non-empty cell looked up
+		float front[PacketSize]; // pre-integration : density at the start of the segment
+		bool frontValid[PacketSize];
+		bool active[PacketSize];
+		for( uint l = 0; l < PacketSize; l++ )
+		{
+			float dx = p.end[0][l] - p.start[0][l], dy = p.end[1][l] - p.start[1][l], dz = p.end[2][l] - p.start[2][l];
+			p.nbSteps[l] = sqrtf( dx * dx + dy * dy + dz * dz ) / step;
+			float inv = p.nbSteps[l] > 0 ? 1 / p.nbSteps[l] : 0;
+			delta[0][l] = dx * inv; delta[1][l] = dy * inv; delta[2][l] = dz * inv;
+			p.sum[l] = 0;
+			i[l] = 0;
+			nextCell[l] = 0;
+			frontValid[l] = false;
+			active[l] = l < p.count;
+		}
+
+		size_t samples = 0;
+		for( int it = 0; it < maxSteps; it++ )
+		{
+			float pos[3][PacketSize];
+			for( uint c = 0; c < 3; c++ )
+				for( uint l = 0; l < PacketSize; l++ )
+					pos[c][l] = p.start[c][l] + i[l] * delta[c][l];
+
+			bool any = false;
+			for( uint l = 0; l < p.count; l++ )
+			{
+				if( !active[l] ) { continue; }
+				if( !( i[l] < p.nbSteps[l] ) ) { active[l] = false; continue; }
+				any = true;
+				if( grid != NULL && i[l] >= nextCell[l] )
+				{
+					const float lanePos[3] = { pos[0][l], pos[1][l], pos[2][l] };
+					const float laneDelta[3] = { delta[0][l], delta[1][l], delta[2][l] };
+					bool empty;
+					float exit = cellExit( lanePos, laneDelta, empty );
+					// with pre-integration, the last segment of the cell ends out of it
+					if( empty && ( transfer == NULL || exit > 1 ) )
+					{
+						i[l] += transfer == NULL ? exit : exit - 1;
+						frontValid[l] = false;
+						continue;
+					}
+					nextCell[l] = i[l] + exit;
+				}
+				if( transfer != NULL )
+				{
+					if( !frontValid[l] )
+					{
+						front[l] = sample( pos[1][l], pos[2][l], pos[0][l] );
+						samples++;
+					}
+					const float length = std::min( 1.0f, p.nbSteps[l] - i[l] );
+					const float t = i[l] + length;
+					const float back = sample(
+						p.start[1][l] + t * delta[1][l],
+						p.start[2][l] + t * delta[2][l],
+						p.start[0][l] + t * delta[0][l] );
+					samples++;
+					p.sum[l] += length * step * transfer->lookup( front[l], back ) * light( pos[0][l], pos[1][l], pos[2][l] );
+					front[l] = back;
+					frontValid[l] = true;
+				}
+				else
+				{
+					p.sum[l] += step * density( pos[0][l], pos[1][l], pos[2][l] ) * light( pos[0][l], pos[1][l], pos[2][l] );
+					samples++;
+				}
+				if( earlyExit && p.sum[l] >= saturation ) { active[l] = false; }
+				i[l]++;
+			}
+			if( !any ) { break; }
+		}
+		return samples;
+	}
+
+	// blue color ramp of fragFront.glsl, written as an 8 bits framebuffer would
+	inline void shade( float sum, unsigned char* rgba ) const
+	{
+		sum *= brightness();
+		const float color[3] = { sum / 3, sum / 2, sum };
+		for( uint c = 0; c < 3; c++ )
+			rgba[c] = (unsigned char)( std::min( std::max( color[c], 0.0f ), 1.0f ) * 255 + 0.5f );
+		rgba[3] = 255;
+	}
+
+	// Renders the volume in 'rgba' (top row first, as in PNG files)
+	VolumeRenderStats render( const VolumeCamera& camera, uint w, uint h, std::vector<unsigned char>& rgba ) const
+	{
+		rgba.assign( size_t( w ) * h * 4, 0 );
+		for( size_t i = 3; i < rgba.size(); i += 4 ) { rgba[i] = 255; }
+
+		const Mat4 invMVP = ( camera.projection( w, h ) * camera.modelView( tex ) ).inverse();
+		const uint tilesX = ( w + TileSize - 1 ) / TileSize, tilesY = ( h + TileSize - 1 ) / TileSize;
+		const unsigned int nbThreads = threads == 0 ? Parallel::threadCount() : threads;
+		std::vector<size_t> samples( nbThreads, 0 ), rays( nbThreads, 0 );
+
+		auto start = std::chrono::steady_clock::now();
+		Parallel::forEach( size_t( tilesX ) * tilesY, [&]( size_t tile, unsigned int worker ) {
+			const uint x0 = uint( tile % tilesX ) * TileSize, y0 = uint( tile / tilesX ) * TileSize;
+			for( uint y = y0; y < std::min( y0 + TileSize, h ); y++ )
+				for( uint xp = x0; xp < std::min( x0 + TileSize, w ); xp += PacketSize )
+				{
+					RayPacket packet;
+					uint pixels[PacketSize];
+					for( uint x = xp; x < std::min( xp + PacketSize, std::min( x0 + TileSize, w ) ); x++ )
+					{
+						Vec3F entry, exit;
+						rays[worker]++;
+						if( !boxEntryExit( invMVP, 2 * ( x + 0.5f ) / w - 1, 2 * ( y + 0.5f ) / h - 1, entry, exit ) ) { continue; }
+						for( uint c = 0; c < 3; c++ )
+						{
+							packet.start[c][packet.count] = ( 1 + entry[c] ) / 2;
+							packet.end[c][packet.count] = ( 1 + exit[c] ) / 2;
+						}
+						pixels[packet.count++] = x;
+					}
+					for( uint l = packet.count; l < PacketSize; l++ ) // inactive lanes
+						for( uint c = 0; c < 3; c++ ) { packet.start[c][l] = packet.end[c][l] = 0; }
+					samples[worker] += march( packet );
+					for( uint l = 0; l < packet.count; l++ )
+						shade( packet.sum[l], &rgba[4 * ( size_t( h - 1 - y ) * w + pixels[l] )] );
+				}
+		}, nbThreads );
+
+		VolumeRenderStats stats;
+		stats.seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+		for( unsigned int t = 0; t < nbThreads; t++ )
+		{
+			stats.rays += rays[t];
+			stats.samples += samples[t];
+		}
+		return stats;
+	}
+};
@@ -1,11 +1,14 @@
 #pragma once
 
 #include "Mesh.h"
+#include <Trace.h>
 #include <stdlib.h>
 #include <iostream>
 #include <vector>
 #include <fstream>
 #include <sstream>
+#include <memory>
+#include <random>
 
 #include <math.h>
 
@@ -26,6 +29,9 @@ using namespace std;
 
 typedef unsigned int GLuint;
 
+struct MappedFile; // see VoxelCache.h
+struct CompressedVoxels; // see VoxelCompression.h
+
 struct VoxelTexture {
 
 	unsigned int width, height, depth;
@@ -33,14 +39,57 @@ struct VoxelTexture {
 	vector<float> voxels;
 	GLuint id;
 
-	inline float& at( unsigned int x, unsigned int y, unsigned int z )
-	{ return voxels[ depth * ( height * y + x ) + z ]; }
-	inline const float& at( unsigned int x, unsigned int y, unsigned int z ) const
-	{ return voxels[ depth * ( height * y + x ) + z ]; }
+	// when read back from a VoxelCache, the voxels live in a (copy-on-write) file mapping
+	shared_ptr<MappedFile> mapping;
+	float* mapped = NULL;
+
+	// once compressed, 'voxels' is empty and data() is NULL : the texture is read through at() or decompress()
+	shared_ptr<const CompressedVoxels> compressed;
+
+	VoxelTexture() {}
+	VoxelTexture( VoxelTexture&& ) = default;
+	VoxelTexture& operator=( VoxelTexture&& ) = default;
+	VoxelTexture( const VoxelTexture& other ) { *this = other; }
+
+	// a copy owns its voxels : a mapping, writable, isn't shared between copies
+	VoxelTexture& operator=( const VoxelTexture& other )
+	{
+		if( this == &other ) { return *this; }
+		width = other.width; height = other.height; depth = other.depth;
+		xRatio = other.xRatio; yRatio = other.yRatio; zRatio = other.zRatio;
+		id = other.id;
+		if( other.mapping ) { voxels.assign( other.mapped, other.mapped + other.size() ); }
+		else { voxels = other.voxels; }
+		mapping.reset();
+		mapped = NULL;
+		compressed = other.compressed;
+		return *this;
+	}
+
+	inline float* data() { return mapping ? mapped : voxels.data(); }
+	inline const float* data() const { return mapping ? mapped : voxels.data(); }
+	inline size_t size() const { return size_t( width ) * height * depth; }
+
+	// reads a texel, without decompressing the texture
+	inline float at( unsigned int x, unsigned int y, unsigned int z ) const
+	{ size_t i = depth * ( height * y + x ) + z; return compressed ? compressedAt( i ) : data()[i]; }
+
+	// to write a texel : a compressed texture has to be decompress()ed first
+	inline float& voxel( unsigned int x, unsigned int y, unsigned int z )
+	{
+		if( compressed ) { cerr << "can't write to a compressed texture, decompress() it first" << endl; throw 1; }
+		return data()[ depth * ( height * y + x ) + z ];
+	}
+
+	void compress(); // see VoxelCompression.h
+	void decompress();
+	float compressedAt( size_t index ) const;
 
-	void generate();
+	void generate(); // allocate() + upload() of every slice
+	void allocate(); // creates the GL texture, without its data
+	void upload( unsigned int firstSlice, unsigned int count ); // uploads slices of the texture's 'r' axis
 
-	Mesh isoSurface( float threshold = 0 ) const;
+	Mesh isoSurface( float threshold = 0 ) const; // see IsoSurface.h, to re-extract it as the threshold moves
 
 	void resize( unsigned int w, unsigned int h, unsigned int d )
 	{
@@ -48,6 +97,9 @@ struct VoxelTexture {
 		this->height = h;
 		this->depth = d;
 		voxels = vector<float>(width*height*depth);
+		mapping.reset();
+		mapped = NULL;
+		compressed.reset();
 	}
 	inline void resize( unsigned int size ) { resize( size, size, size ); }
 
@@ -77,7 +129,7 @@ struct VoxelTexture {
 						xI = xO - xF,
 						yI = yO - yF,
 						zI = zO - zF;
-					dst.at( x, y, z ) =// at( xF, yF, zF );
+					dst.voxel( x, y, z ) =// at( xF, yF, zF );
 						xI * (
 							yI * (
 								zI * at( xC, yC, zC ) + ( 1 - zI ) * at( xC, yC, zF )
@@ -107,12 +159,13 @@ struct ParametricVoxel : public VoxelTexture {
 
 	void compute() {
 
+		TRACE_SCOPE("ParametricVoxel::compute");
 		for (unsigned int d = 0; d < depth; d++) {
 			for (unsigned int y = 0; y < height; y++) {
 				for (unsigned int x = 0; x < width; x++) {
 
 					float v = density( float(x) / width, float(y) / height, float(d) / depth);
-					this->at( x, y, d ) = v;
+					this->voxel( x, y, d ) = v;
 				}
 			}
 		}
@@ -121,6 +174,8 @@ struct ParametricVoxel : public VoxelTexture {
 
 struct VoxelSphere : public ParametricVoxel {
 
+	static const unsigned int version = 1; // to bump when density() changes (invalidates the VoxelCache)
+
 	float radius;
 
 	float density(float x, float y, float z) {
@@ -146,6 +201,8 @@ struct VoxelCube : public VoxelTexture {
 // https://en.wikipedia.org/wiki/Mandelbulb
 struct VoxelMandelbulb : public ParametricVoxel {
 
+	static const unsigned int version = 1; // to bump when density() changes (invalidates the VoxelCache)
+
 	int order;
 	int maxIter = 20;
 
@@ -281,19 +338,27 @@ struct VoxelMRI : public VoxelTexture {
 
 struct PerlinNoise : public VoxelTexture
 {
+	static const unsigned int version = 1; // to bump when the noise changes (invalidates the VoxelCache)
+
 	PerlinNoise() {}
 	PerlinNoise( const VoxelTexture& tex ) // HACK ?
 	{
 		this->width = tex.width;
 		this->height = tex.height;
 		this->depth = tex.depth;
-		this->voxels = tex.voxels;
+		if( tex.compressed )
+		{
+			VoxelTexture copy( tex );
+			copy.decompress();
+			this->voxels = move( copy.voxels );
+		}
+		else { this->voxels.assign( tex.data(), tex.data() + tex.size() ); }
 	}
 
-	void addNoise( float scale = 1.0 )
+	void addNoise( std::mt19937& rng, float scale = 1.0 )
 	{
 		for( unsigned int i = 0; i < this->voxels.size(); i++ )
-			this->voxels[i] += scale * ( 1 - 2.0f * float(rand()) / RAND_MAX );
+			this->voxels[i] += scale * ( 1 - 2.0f * float( rng() ) / rng.max() );
 	}
 
 	void normalize()
@@ -308,43 +373,20 @@ struct PerlinNoise : public VoxelTexture
 			voxels[i] = ( voxels[i] - minV ) / ( maxV - minV );
 	}
 
-	PerlinNoise( unsigned int w )
+	PerlinNoise( unsigned int w, unsigned int seed = 0 )
 	{
+		TRACE_SCOPE( "PerlinNoise" );
+		std::mt19937 rng( seed );
 		this->resize( 1 );
 		while( this->width < w )
 		{
 			unsigned int newS = this->width * 2;
 			*this = this->resample( newS, newS, newS );
-			addNoise( pow( float(this->width), -0.3f ) );
+			addNoise( rng, pow( float(this->width), -0.3f ) );
 		}
 		//normalize();
 	}
 };
 
-Mesh VoxelTexture::isoSurface( float threshold ) const
-{
-	Mesh mesh;
-	for( unsigned int z = 0; z < depth-1; z++ )
-		for( unsigned int y = 0; y < height-1; y++ )
-			for( unsigned int x = 0; x < width-1; x++ )
-			{
-				bool surface = false;
-				bool in = at( x, y, z ) >= threshold;
-				for( uint i = 1; i < 8; i++ )
-					if( ( at( x + ( i % 2 ), y + ( i / 2 % 2 ), z + ( i / 4 % 2 ) ) >= threshold ) != in )
-					{
-						surface = true;
-						break;
-					}
-
-				if( surface )
-				{
-					Mesh cube = Cube();
-					cube.translate( { float( 2*x ), float( 2*y ), float( 2*z ) } );
-					cube.scale( { 0.5f / width, 0.5f / height, 0.5f / depth } );
-					cube.translate( { -0.5f, -0.5f, -0.5f } );
-					mesh += cube;
-				}
-			}
-	return mesh;
-}
+#include "VoxelCompression.h"
+#include "IsoSurface.h"
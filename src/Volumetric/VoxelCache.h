@@ -0,0 +1,199 @@
+#pragma once
+
+#include "Voxel.h"
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <functional>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef WIN32
+#include <direct.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file, mapped copy-on-write so that the voxels stay editable
+struct MappedFile {
+
+	char* bytes = NULL;
+	size_t size = 0;
+
+	MappedFile( const MappedFile& ) = delete;
+	MappedFile& operator=( const MappedFile& ) = delete;
+
+	// returns false if the file can't be opened
+	bool open( const string& fileName )
+	{
+#ifdef WIN32
+		HANDLE file = CreateFileA( fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+		if( file == INVALID_HANDLE_VALUE ) { return false; }
+		LARGE_INTEGER fileSize;
+		if( !GetFileSizeEx( file, &fileSize ) || fileSize.QuadPart == 0 ) { CloseHandle( file ); return false; }
+		HANDLE mapping = CreateFileMappingA( file, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+		CloseHandle( file );
+		if( mapping == NULL ) { return false; }
+		void* ptr = MapViewOfFile( mapping, FILE_MAP_COPY, 0, 0, 0 );
+		CloseHandle( mapping ); // the view keeps its own reference
+		if( ptr == NULL ) { return false; }
+		bytes = (char*)ptr;
+		size = size_t( fileSize.QuadPart );
+		return true;
+#else
+		int fd = ::open( fileName.c_str(), O_RDONLY );
+		if( fd < 0 ) { return false; }
+		struct stat st;
+		if( fstat( fd, &st ) != 0 || st.st_size == 0 ) { ::close( fd ); return false; }
+		void* ptr = mmap( NULL, size_t( st.st_size ), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+		::close( fd ); // the mapping keeps its own reference
+		if( ptr == MAP_FAILED ) { return false; }
+		bytes = (char*)ptr;
+		size = size_t( st.st_size );
+		return true;
+#endif
+	}
+
+	MappedFile() {}
+	~MappedFile()
+	{
+		if( bytes == NULL ) { return; }
+#ifdef WIN32
+		UnmapViewOfFile( bytes );
+#else
+		munmap( bytes, size );
+#endif
+	}
+};
+
+// Identifies a procedurally generated volume : the generator, its code version and its parameters
+struct VoxelCacheKey {
+
+	string generator;
+	unsigned int version; // the generator's code version : a different one invalidates the file
+	vector<double> params; // size, order, maxIter, seed...
+
+	string fileName() const
+	{
+		stringstream ss;
+		ss << generator;
+		for( double p : params ) { ss << "_" << p; }
+		ss << ".vox";
+		return ss.str();
+	}
+};
+
+// On-disk cache of generated VoxelTextures. Files are a small header followed by the raw
+// floats, so that reading one back is a mmap : the header records the writer's byte order and
+// float layout, and a file from another platform is regenerated instead of mapped.
+struct VoxelCache {
+
+	static const uint32_t formatVersion = 2;
+	static const uint32_t byteOrderMark = 0x01020304; // reads back as 0x04030201 on the other endianness
+	static constexpr float floatProbe = -1.5f; // its bits differ with the float layout (and the byte order)
+
+	struct Header {
+		char magic[4];
+		uint32_t formatVersion;
+		uint32_t generatorVersion;
+		uint32_t width, height, depth;
+		float xRatio, yRatio, zRatio;
+		uint32_t byteOrder; // byteOrderMark, written in the native order
+		float probe; // floatProbe
+		uint32_t padding[5]; // voxels start on a 64 bytes boundary
+	};
+
+	string directory;
+
+	VoxelCache( const string& directory = "voxelCache" ) : directory( directory ) {}
+
+	inline string path( const VoxelCacheKey& key ) const { return directory + "/" + key.fileName(); }
+
+	// Returns false if there is no valid file for 'key'
+	bool load( const VoxelCacheKey& key, VoxelTexture& dst ) const
+	{
+		shared_ptr<MappedFile> file( new MappedFile() );
+		if( !file->open( path( key ) ) ) { return false; }
+		if( file->size < sizeof( Header ) ) { return false; }
+		Header header;
+		memcpy( &header, file->bytes, sizeof( Header ) );
+		if( memcmp( header.magic, "VOX", 4 ) != 0
+			|| header.byteOrder != byteOrderMark
+			|| header.probe != floatProbe
+			|| header.formatVersion != formatVersion
+			|| header.generatorVersion != key.version ) { return false; }
+		size_t count = size_t( header.width ) * header.height * header.depth;
+		if( file->size != sizeof( Header ) + count * sizeof( float ) ) { return false; }
+
+		dst.width = header.width;
+		dst.height = header.height;
+		dst.depth = header.depth;
+		dst.xRatio = header.xRatio;
+		dst.yRatio = header.yRatio;
+		dst.zRatio = header.zRatio;
+		dst.voxels = vector<float>();
+		dst.mapped = (float*)( file->bytes + sizeof( Header ) );
+		dst.mapping = file;
+		return true;
+	}
+
+	void store( const VoxelCacheKey& key, const VoxelTexture& tex ) const
+	{
+#ifdef WIN32
+		_mkdir( directory.c_str() );
+#else
+		mkdir( directory.c_str(), 0755 );
+#endif
+		Header header;
+		memset( &header, 0, sizeof( Header ) );
+		memcpy( header.magic, "VOX", 4 );
+		header.formatVersion = formatVersion;
+		header.generatorVersion = key.version;
+		header.width = tex.width;
+		header.height = tex.height;
+		header.depth = tex.depth;
+		header.xRatio = tex.xRatio;
+		header.yRatio = tex.yRatio;
+		header.zRatio = tex.zRatio;
+		header.byteOrder = byteOrderMark;
+		header.probe = floatProbe;
+
+		// writing next to the destination then renaming, so that readers never see a partial file
+		const string fileName = path( key );
+		const string tmpName = fileName + ".tmp";
+		{
+			ofstream out( tmpName, ios::binary | ios::trunc );
+			if( !out.is_open() ) { cerr << "can't write " << tmpName << endl; return; }
+			out.write( (const char*)&header, sizeof( Header ) );
+			out.write( (const char*)tex.data(), tex.size() * sizeof( float ) );
+			if( !out.good() ) { cerr << "error when writing " << tmpName << endl; return; }
+		}
+		remove( fileName.c_str() );
+		if( rename( tmpName.c_str(), fileName.c_str() ) != 0 ) { cerr << "can't write " << fileName << endl; }
+	}
+
+	// Returns the cached volume for 'key', or builds and stores it
+	VoxelTexture get( const VoxelCacheKey& key, const function<VoxelTexture()>& build ) const
+	{
+		VoxelTexture tex;
+		{
+			TRACE_SCOPE_DETAIL( "VoxelCache::load", key.fileName() );
+			if( load( key, tex ) ) { return tex; }
+		}
+		cout << "Generating " << key.fileName() << endl;
+		tex = build();
+		TRACE_SCOPE_DETAIL( "VoxelCache::store", key.fileName() );
+		store( key, tex );
+		return tex;
+	}
+};
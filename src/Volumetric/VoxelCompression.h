@@ -0,0 +1,204 @@
+#pragma once
+
+#include "Voxel.h"
+#include <Parallel.h>
+
+#include <atomic>
+#include <stdint.h>
+
+// Voxels stored as independent blocks of 8^3 texels (in the GL texture order : s fastest, then t, then r).
+// Densities are quantized to 16 bits over the texture's range, and each block keeps its minimum and
+// the offsets to it bit-packed on just enough bits : uniform blocks take a single word.
+struct CompressedVoxels {
+
+	static const uint blockSize = 8;
+	static const uint blockTexels = blockSize * blockSize * blockSize;
+
+	uint width = 0, height = 0, depth = 0; // in texels
+	uint blocksX = 0, blocksY = 0, blocksZ = 0;
+	float minValue = 0, step = 1; // quantization : v = minValue + q * step
+	vector<uint32_t> words; // per block : a header ( min | bits << 16 ), then blockTexels * bits bits
+	vector<size_t> offsets; // of each block in 'words'
+	uint64_t uid; // identifies the blocks in the decompression caches
+
+	CompressedVoxels() : uid( nextUid() ) {}
+	CompressedVoxels( const float* data, uint w, uint h, uint d, uint threads = 0 ) : uid( nextUid() )
+	{
+		width = w; height = h; depth = d;
+		blocksX = ( w + blockSize - 1 ) / blockSize;
+		blocksY = ( h + blockSize - 1 ) / blockSize;
+		blocksZ = ( d + blockSize - 1 ) / blockSize;
+
+		const size_t size = size_t( w ) * h * d;
+		float maxValue = -INFINITY;
+		minValue = INFINITY;
+		for( size_t i = 0; i < size; i++ )
+		{
+			minValue = std::min( minValue, data[i] );
+			maxValue = std::max( maxValue, data[i] );
+		}
+		step = maxValue > minValue ? ( maxValue - minValue ) / 65535 : 1;
+
+		// blocks are encoded in parallel, each z row of blocks in its own buffer
+		vector<vector<uint32_t>> rows( blocksZ );
+		vector<vector<size_t>> rowOffsets( blocksZ );
+		Parallel::forEach( blocksZ, [&]( size_t bz, unsigned int ) {
+			uint16_t q[blockTexels];
+			for( uint by = 0; by < blocksY; by++ )
+				for( uint bx = 0; bx < blocksX; bx++ )
+				{
+					// texels out of the texture repeat its border
+					uint16_t qMin = 65535, qMax = 0;
+					for( uint i = 0; i < blockTexels; i++ )
+					{
+						uint s = std::min( bx * blockSize + i % blockSize, w - 1 );
+						uint t = std::min( by * blockSize + ( i / blockSize ) % blockSize, h - 1 );
+						uint r = std::min( uint( bz ) * blockSize + i / ( blockSize * blockSize ), d - 1 );
+						float v = ( data[s + w * ( t + size_t( h ) * r )] - minValue ) / step;
+						q[i] = uint16_t( std::min( std::max( v + 0.5f, 0.0f ), 65535.0f ) );
+						qMin = std::min( qMin, q[i] );
+						qMax = std::max( qMax, q[i] );
+					}
+					uint bits = 0;
+					while( bits < 16 && ( qMax - qMin ) >> bits ) { bits++; }
+
+					vector<uint32_t>& dst = rows[bz];
+					rowOffsets[bz].push_back( dst.size() );
+					dst.push_back( qMin | ( bits << 16 ) );
+					if( bits == 0 ) { continue; }
+					uint64_t acc = 0;
+					uint used = 0;
+					for( uint i = 0; i < blockTexels; i++ )
+					{
+						acc |= uint64_t( q[i] - qMin ) << used;
+						used += bits;
+						if( used >= 32 )
+						{
+							dst.push_back( uint32_t( acc ) );
+							acc >>= 32;
+							used -= 32;
+						}
+					}
+					if( used > 0 ) { dst.push_back( uint32_t( acc ) ); }
+				}
+		}, threads );
+
+		for( uint bz = 0; bz < blocksZ; bz++ )
+		{
+			for( size_t offset : rowOffsets[bz] ) { offsets.push_back( words.size() + offset ); }
+			words.insert( words.end(), rows[bz].begin(), rows[bz].end() );
+		}
+		words.shrink_to_fit();
+	}
+
+	inline size_t blockCount() const { return offsets.size(); }
+	inline size_t block( uint bx, uint by, uint bz ) const { return bx + blocksX * ( by + size_t( blocksY ) * bz ); }
+	inline size_t bytes() const { return words.size() * sizeof( uint32_t ) + offsets.size() * sizeof( size_t ); }
+	inline double ratio() const { return double( width ) * height * depth * sizeof( float ) / bytes(); }
+	inline float maxError() const { return step / 2; } // plus the float rounding
+
+	// decodes the blockTexels texels of a block (the ones out of the texture included)
+	void decodeBlock( size_t b, float* dst ) const
+	{
+		const uint32_t* src = &words[offsets[b]];
+		const uint bits = src[0] >> 16;
+		const float base = minValue + float( src[0] & 0xFFFF ) * step;
+		if( bits == 0 )
+		{
+			for( uint i = 0; i < blockTexels; i++ ) { dst[i] = base; }
+			return;
+		}
+		const uint32_t mask = ( 1u << bits ) - 1;
+		const uint32_t* p = src + 1;
+		uint64_t acc = 0;
+		uint available = 0;
+		for( uint i = 0; i < blockTexels; i++ )
+		{
+			if( available < bits )
+			{
+				acc |= uint64_t( *p++ ) << available;
+				available += 32;
+			}
+			dst[i] = base + float( uint32_t( acc ) & mask ) * step;
+			acc >>= bits;
+			available -= bits;
+		}
+	}
+
+	// decompresses the slices [firstSlice;firstSlice+count) of the 'r' axis to 'dst', in parallel
+	void decompressSlices( uint firstSlice, uint count, float* dst, uint threads = 0 ) const
+	{
+		if( count == 0 ) { return; }
+		const uint bz0 = firstSlice / blockSize, bz1 = ( firstSlice + count - 1 ) / blockSize;
+		const size_t rowBlocks = size_t( blocksX ) * blocksY;
+		Parallel::forEach( rowBlocks * ( bz1 - bz0 + 1 ), [&]( size_t i, unsigned int ) {
+			const uint bx = uint( i % blocksX ), by = uint( ( i / blocksX ) % blocksY ), bz = bz0 + uint( i / rowBlocks );
+			float texels[blockTexels];
+			decodeBlock( block( bx, by, bz ), texels );
+			const uint sEnd = std::min( uint( blockSize ), width - bx * blockSize ), tEnd = std::min( uint( blockSize ), height - by * blockSize );
+			for( uint k = 0; k < blockSize; k++ )
+			{
+				const uint r = bz * blockSize + k;
+				if( r < firstSlice || r >= firstSlice + count || r >= depth ) { continue; }
+				for( uint j = 0; j < tEnd; j++ )
+				{
+					float* row = dst + ( bx * blockSize ) + width * ( ( by * blockSize + j ) + size_t( height ) * ( r - firstSlice ) );
+					const float* src = texels + blockSize * ( j + blockSize * k );
+					for( uint s = 0; s < sEnd; s++ ) { row[s] = src[s]; }
+				}
+			}
+		}, threads );
+	}
+
+	inline void decompress( float* dst, uint threads = 0 ) const { decompressSlices( 0, depth, dst, threads ); }
+
+	// random access, through a small per-thread cache of decompressed blocks
+	float at( size_t index ) const
+	{
+		struct CachedBlock {
+			uint64_t uid = 0;
+			size_t block = 0;
+			float texels[blockTexels];
+		};
+		static thread_local CachedBlock cache[64]; // a row of blocks of textures up to 512 texels wide
+
+		const uint s = uint( index % width ), t = uint( ( index / width ) % height ), r = uint( index / ( size_t( width ) * height ) );
+		const size_t b = block( s / blockSize, t / blockSize, r / blockSize );
+		CachedBlock& cached = cache[b % 64];
+		if( cached.uid != uid || cached.block != b )
+		{
+			decodeBlock( b, cached.texels );
+			cached.uid = uid;
+			cached.block = b;
+		}
+		return cached.texels[s % blockSize + blockSize * ( t % blockSize + blockSize * ( r % blockSize ) )];
+	}
+
+private:
+	static uint64_t nextUid()
+	{
+		static atomic<uint64_t> counter( 0 );
+		return ++counter;
+	}
+};
+
+inline float VoxelTexture::compressedAt( size_t index ) const { return compressed->at( index ); }
+
+inline void VoxelTexture::compress()
+{
+	TRACE_SCOPE( "VoxelTexture::compress" );
+	if( compressed ) { return; }
+	compressed = make_shared<CompressedVoxels>( data(), width, height, depth );
+	voxels = vector<float>();
+	mapping.reset();
+	mapped = NULL;
+}
+
+inline void VoxelTexture::decompress()
+{
+	if( !compressed ) { return; }
+	shared_ptr<const CompressedVoxels> src = compressed;
+	compressed.reset();
+	voxels.resize( size() );
+	src->decompress( voxels.data() );
+}
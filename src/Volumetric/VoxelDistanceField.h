@@ -0,0 +1,257 @@
+#pragma once
+
+#include "Voxel.h"
+#include <Parallel.h>
+
+#include <array>
+#include <chrono>
+#include <algorithm>
+
+// Signed distance field of a closed Mesh (negative inside), in texture units (the texture's side is 1), sampled
+// at the texels' centers of a cubic texture fitted around the mesh. Distances are exact within 'band' texels of
+// the triangles, then propagated by fast sweeping : the closest surface points are passed on to the next texels
+// in the 8 diagonal orderings, planes of independent texels in parallel. The sign is the winding number's, counted
+// along the 's' lines from the signed crossings of the triangles.
+// The mesh's x, y, z axes are the ones of Volumetric's box : the texels' r, s, t.
+struct VoxelDistanceField : public VoxelTexture {
+
+	struct Stats {
+		size_t triangles = 0, bandTexels = 0;
+		double bandSeconds = 0, sweepSeconds = 0, signSeconds = 0;
+
+		void print( ostream& out ) const
+		{
+			out << triangles << " triangles, " << bandTexels << " texels in the band : band in " << 1000 * bandSeconds << " ms, sweeps in "
+				<< 1000 * sweepSeconds << " ms, signs in " << 1000 * signSeconds << " ms" << endl;
+		}
+	};
+
+	float texelSize; // in the mesh's units
+	Vec3F origin; // the mesh's point at the center of the texel ( 0, 0, 0 )
+	Stats stats;
+
+	VoxelDistanceField( const Mesh& mesh, uint size = 128, uint band = 2, uint sweeps = 1, uint threads = 0 )
+	{
+		this->resize( size );
+		const vector<Vec3F>& points = mesh.getVertices();
+		if( points.empty() ) { cerr << "empty mesh" << endl; throw 1; }
+
+		// the mesh's bounding cube, with a margin of 'band' texels
+		Vec3F lo = points[0], hi = points[0];
+		for( const Vec3F& p : points )
+			for( uint c = 0; c < 3; c++ ) { lo[c] = std::min( lo[c], p[c] ); hi[c] = std::max( hi[c], p[c] ); }
+		float extent = 0;
+		for( uint c = 0; c < 3; c++ ) { extent = std::max( extent, hi[c] - lo[c] ); }
+		texelSize = std::max( extent, 1e-6f ) / std::max( 1, int( size ) - 2 * int( band ) - 1 );
+		for( uint c = 0; c < 3; c++ ) { origin[c] = ( lo[c] + hi[c] ) / 2 - texelSize * ( size - 1 ) / 2; }
+
+		// triangles in texels ( s, t, r ), texel centers at integer coordinates
+		auto toTexels = [&]( const Vec3F& p ) {
+			return Vec3F( ( p[1] - origin[1] ) / texelSize, ( p[2] - origin[2] ) / texelSize, ( p[0] - origin[0] ) / texelSize );
+		};
+		vector<array<Vec3F, 3>> triangles;
+		for( const auto& tri : mesh.triangles() )
+			triangles.push_back( {{ toTexels( points[tri[0]] ), toTexels( points[tri[1]] ), toTexels( points[tri[2]] ) }} );
+		stats.triangles = triangles.size();
+
+		// the triangles touching each slab of 'slabSize' slices (of the 'r' axis)
+		const uint slabSize = 4, slabs = ( size + slabSize - 1 ) / slabSize;
+		vector<vector<uint>> bins( slabs );
+		for( uint i = 0; i < triangles.size(); i++ )
+		{
+			float rMin = INFINITY, rMax = -INFINITY;
+			for( const Vec3F& p : triangles[i] ) { rMin = std::min( rMin, p[2] ); rMax = std::max( rMax, p[2] ); }
+			int first = std::max( 0, int( floorf( rMin - band ) ) ), last = std::min( int( size ) - 1, int( ceilf( rMax + band ) ) );
+			for( int slab = first / int( slabSize ); slab <= last / int( slabSize ) && first <= last; slab++ ) { bins[slab].push_back( i ); }
+		}
+
+		// the closest surface points, and the squared distances to them
+		const size_t count = this->size();
+		const Closest unknown = { { INFINITY, INFINITY, INFINITY }, INFINITY };
+		closest.assign( count, unknown );
+
+		auto start = chrono::steady_clock::now();
+		const float band2 = float( band * band );
+		Parallel::forEach( slabs, [&]( size_t slab, unsigned int ) {
+			const int r0 = int( slab * slabSize ), r1 = std::min( int( size ), r0 + int( slabSize ) );
+			for( uint i : bins[slab] )
+			{
+				const array<Vec3F, 3>& tri = triangles[i];
+				int lo[3], hi[3];
+				for( uint c = 0; c < 3; c++ )
+				{
+					float a = std::min( tri[0][c], std::min( tri[1][c], tri[2][c] ) ), b = std::max( tri[0][c], std::max( tri[1][c], tri[2][c] ) );
+					lo[c] = std::max( 0, int( floorf( a - band ) ) );
+					hi[c] = std::min( int( size ) - 1, int( ceilf( b + band ) ) );
+				}
+				lo[2] = std::max( lo[2], r0 ); hi[2] = std::min( hi[2], r1 - 1 );
+				for( int r = lo[2]; r <= hi[2]; r++ )
+					for( int t = lo[1]; t <= hi[1]; t++ )
+						for( int s = lo[0]; s <= hi[0]; s++ )
+						{
+							const Vec3F p = Vec3F( float( s ), float( t ), float( r ) );
+							const Vec3F q = closestPoint( p, tri );
+							const float d = distance2( p, q );
+							const size_t index = s + size * ( t + size_t( size ) * r );
+							Closest& dst = closest[index];
+							if( d <= band2 && d < dst.d2 ) { dst = { { q[0], q[1], q[2] }, d }; }
+						}
+			}
+		}, threads );
+		for( const Closest& c : closest ) { stats.bandTexels += c.d2 < INFINITY; }
+		stats.bandSeconds = seconds( start );
+
+		start = chrono::steady_clock::now();
+		for( uint i = 0; i < sweeps; i++ ) { sweep( threads ); }
+		stats.sweepSeconds = seconds( start );
+
+		start = chrono::steady_clock::now();
+		applySigns( triangles, bins, slabSize, threads );
+		stats.signSeconds = seconds( start );
+		closest = vector<Closest>();
+	}
+
+	// a density for the ray marchers : 0.5 on the surface, ramping up to 1 'width' inside it (in texture units)
+	VoxelTexture density( float width = 0.05f ) const
+	{
+		VoxelTexture dst = *this;
+		for( float& v : dst.voxels ) { v = std::min( 1.f, std::max( 0.f, 0.5f - 0.5f * v / width ) ); }
+		return dst;
+	}
+
+private:
+	struct Closest {
+		float p[3]; // the closest surface point, in texels
+		float d2; // squared distance to it, INFINITY when unknown
+	};
+	vector<Closest> closest; // per texel
+
+	static inline double seconds( chrono::steady_clock::time_point start )
+	{ return chrono::duration<double>( chrono::steady_clock::now() - start ).count(); }
+
+	static inline float dot( const Vec3F& a, const Vec3F& b ) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; }
+	static inline float distance2( const Vec3F& a, const Vec3F& b ) { Vec3F d = a - b; return dot( d, d ); }
+
+	// Real-Time Collision Detection, 5.1.5
+	static Vec3F closestPoint( const Vec3F& p, const array<Vec3F, 3>& tri )
+	{
+		const Vec3F& a = tri[0], & b = tri[1], & c = tri[2];
+		const Vec3F ab = b - a, ac = c - a, ap = p - a;
+		const float d1 = dot( ab, ap ), d2 = dot( ac, ap );
+		if( d1 <= 0 && d2 <= 0 ) { return a; }
+		const Vec3F bp = p - b;
+		const float d3 = dot( ab, bp ), d4 = dot( ac, bp );
+		if( d3 >= 0 && d4 <= d3 ) { return b; }
+		const float vc = d1 * d4 - d3 * d2;
+		if( vc <= 0 && d1 >= 0 && d3 <= 0 ) { return a + ab * ( d1 / ( d1 - d3 ) ); }
+		const Vec3F cp = p - c;
+		const float d5 = dot( ab, cp ), d6 = dot( ac, cp );
+		if( d6 >= 0 && d5 <= d6 ) { return c; }
+		const float vb = d5 * d2 - d1 * d6;
+		if( vb <= 0 && d2 >= 0 && d6 <= 0 ) { return a + ac * ( d2 / ( d2 - d6 ) ); }
+		const float va = d3 * d6 - d5 * d4;
+		if( va <= 0 && ( d4 - d3 ) >= 0 && ( d5 - d6 ) >= 0 ) { return b + ( c - b ) * ( ( d4 - d3 ) / ( ( d4 - d3 ) + ( d5 - d6 ) ) ); }
+		const float denom = 1 / ( va + vb + vc );
+		return a + ab * ( vb * denom ) + ac * ( vc * denom );
+	}
+
+	// the texel 'index' at ( s, t, r ) takes the closest point of 'from' if it's closer than its own
+	inline void relax( size_t index, size_t from, float s, float t, float r )
+	{
+		const Closest& src = closest[from];
+		if( src.d2 == INFINITY ) { return; }
+		const float ds = src.p[0] - s, dt = src.p[1] - t, dr = src.p[2] - r;
+		const float d = ds * ds + dt * dt + dr * dr;
+		Closest& dst = closest[index];
+		if( d < dst.d2 ) { dst = { { src.p[0], src.p[1], src.p[2] }, d }; }
+	}
+
+	// the 8 orderings of the texels, each one relaxing from its 3 upwind neighbours : the texels of a plane
+	// s + t + r = k (in the ordering's directions) only depend on the previous plane, they're relaxed in parallel
+	void sweep( uint threads )
+	{
+		const int N = int( width );
+		for( uint ordering = 0; ordering < 8; ordering++ )
+		{
+			const int ds = ordering & 1 ? -1 : 1, dt = ordering & 2 ? -1 : 1, dr = ordering & 4 ? -1 : 1;
+			for( int k = 0; k <= 3 * ( N - 1 ); k++ )
+			{
+				const int r0 = std::max( 0, k - 2 * ( N - 1 ) ), r1 = std::min( N - 1, k );
+				Parallel::forEach( r1 - r0 + 1, [&]( size_t i, unsigned int ) {
+					const int rr = r0 + int( i ); // along the ordering
+					const int r = dr > 0 ? rr : N - 1 - rr;
+					const int t0 = std::max( 0, k - rr - ( N - 1 ) ), t1 = std::min( N - 1, k - rr );
+					for( int tt = t0; tt <= t1; tt++ )
+					{
+						const int ss = k - rr - tt;
+						const int t = dt > 0 ? tt : N - 1 - tt, s = ds > 0 ? ss : N - 1 - ss;
+						const size_t index = s + N * ( t + size_t( N ) * r );
+						if( ss > 0 ) { relax( index, index - ds, float( s ), float( t ), float( r ) ); }
+						if( tt > 0 ) { relax( index, index - dt * N, float( s ), float( t ), float( r ) ); }
+						if( rr > 0 ) { relax( index, index - dr * ptrdiff_t( N ) * N, float( s ), float( t ), float( r ) ); }
+					}
+				}, threads );
+			}
+		}
+	}
+
+	// distances with the sign of the winding number : crossings of each 's' line, entering ones counting +1
+	void applySigns( const vector<array<Vec3F, 3>>& triangles, const vector<vector<uint>>& bins, uint slabSize, uint threads )
+	{
+		const uint N = width;
+		const float scale = 1.0f / N;
+		Parallel::forEach( bins.size(), [&]( size_t slab, unsigned int ) {
+			const int r0 = int( slab * slabSize ), r1 = std::min( int( N ), r0 + int( slabSize ) );
+			vector<vector<pair<float, int>>> crossings( size_t( N ) * ( r1 - r0 ) );
+			for( uint i : bins[slab] )
+			{
+				// the triangle projected on the ( t, r ) plane, counterclockwise
+				Vec3F a = triangles[i][0], b = triangles[i][1], c = triangles[i][2];
+				const float area = ( b[1] - a[1] ) * ( c[2] - a[2] ) - ( b[2] - a[2] ) * ( c[1] - a[1] );
+				if( area == 0 ) { continue; }
+				const int entering = area < 0 ? 1 : -1; // the normal's s points backwards
+				if( area < 0 ) { swap( b, c ); }
+				const Vec3F* v[3] = { &a, &b, &c };
+
+				const int tMin = std::max( 0, int( ceilf( std::min( a[1], std::min( b[1], c[1] ) ) ) ) );
+				const int tMax = std::min( int( N ) - 1, int( floorf( std::max( a[1], std::max( b[1], c[1] ) ) ) ) );
+				const int rMin = std::max( r0, int( ceilf( std::min( a[2], std::min( b[2], c[2] ) ) ) ) );
+				const int rMax = std::min( r1 - 1, int( floorf( std::max( a[2], std::max( b[2], c[2] ) ) ) ) );
+				for( int r = rMin; r <= rMax; r++ )
+					for( int t = tMin; t <= tMax; t++ )
+					{
+						// edge functions, shared edges belonging to a single triangle (top-left rule)
+						float w[3];
+						bool inside = true;
+						for( uint e = 0; e < 3 && inside; e++ )
+						{
+							const Vec3F& p0 = *v[( e + 1 ) % 3], & p1 = *v[( e + 2 ) % 3];
+							const float dt = p1[1] - p0[1], dr = p1[2] - p0[2];
+							w[e] = dt * ( r - p0[2] ) - dr * ( t - p0[1] );
+							inside = w[e] > 0 || ( w[e] == 0 && ( dr < 0 || ( dr == 0 && dt > 0 ) ) );
+						}
+						if( !inside ) { continue; }
+						const float sum = w[0] + w[1] + w[2];
+						const float s = ( w[0] * a[0] + w[1] * b[0] + w[2] * c[0] ) / sum;
+						crossings[t + N * size_t( r - r0 )].push_back( { s, entering } );
+					}
+			}
+
+			float* dst = this->data();
+			for( int r = r0; r < r1; r++ )
+				for( uint t = 0; t < N; t++ )
+				{
+					vector<pair<float, int>>& line = crossings[t + N * size_t( r - r0 )];
+					sort( line.begin(), line.end() );
+					int winding = 0;
+					size_t next = 0;
+					const size_t row = N * ( t + N * size_t( r ) );
+					for( uint s = 0; s < N; s++ )
+					{
+						while( next < line.size() && line[next].first < s ) { winding += line[next++].second; }
+						dst[row + s] = sqrtf( closest[row + s].d2 ) * scale * ( winding != 0 ? -1 : 1 );
+					}
+				}
+		}, threads );
+	}
+};
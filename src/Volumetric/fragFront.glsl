@@ -5,8 +5,29 @@ uniform float height;
 uniform int offset;
 
 uniform sampler2D backRender;
+uniform int singlePass; // when set, the exit point is computed instead of read from backRender
 uniform sampler3D voxels;
 
+// empty-space skipping (see OccupancyGrid.h)
+uniform sampler3D occupancy; // min and max densities of cells of 'cellSize' texels
+uniform float cellSize;
+uniform int skipEmpty;
+uniform int maxSteps = 1024; // cap of the marching iterations
+
+// transfer function (see TransferFunction.h)
+uniform float gain = 5;
+uniform float stepSize = 0.01; // precision of the ray marching
+uniform int usePreintegration; // when set, the brightness is in the table
+uniform sampler2D preintegration; // mean emission of segments from front (x) to back (y) densities
+uniform vec2 preintegrationDomain; // densities of the first and last texels of the table
+
+// directional lighting (see LightingVolumes.h)
+uniform int lighting;
+uniform sampler3D gradients; // outward normals * 0.5 + 0.5
+uniform sampler3D transmittance; // fraction of the light reaching each texel
+uniform vec3 lightDir; // direction the light travels, in texture space
+uniform float ambient = 0.3;
+
 in vec3 posAbs;
 in vec3 posRel;
 out vec4 color;
@@ -21,16 +42,45 @@ out vec4 color;
 /*float getDensity( vec3 pos ) { return 1; }*/
 
 // 3d sampler
+float getRawDensity( vec3 pos ) {
+
+	return texture(voxels, pos.yzx).r;
+}
+
 float getDensity( vec3 pos ) {
 
-	return max(0,exp(5*texture(voxels, pos.yzx).r)-1);
+	return max(0,exp(gain*getRawDensity(pos))-1);
+}
+
+float getLight( vec3 pos ) {
+
+	if(lighting == 0) { return 1.0; }
+	vec3 normal = texture(gradients, pos.yzx).xyz * 2 - 1;
+	float lambert = max(0.0, -dot(normal, lightDir));
+	return ambient + (1 - ambient) * texture(transmittance, pos.yzx).r * lambert;
+}
+
+float getPreintegrated( float front, float back ) {
+
+	vec2 uv = (vec2(front, back) - preintegrationDomain.x) / (preintegrationDomain.y - preintegrationDomain.x);
+	float size = float(textureSize(preintegration, 0).x);
+	return texture(preintegration, (clamp(uv, 0.0, 1.0) * (size - 1) + 0.5) / size).r;
+}
+
+// exit point of the ray from the eye through posAbs, out of the [-1;1]^3 box (in texture space)
+vec3 boxExit() {
+
+	vec3 eye = (gl_ModelViewMatrixInverse * vec4(0.0, 0.0, 0.0, 1.0)).xyz;
+	vec3 dir = posAbs - eye;
+	vec3 t = (vec3(1.0) - sign(dir) * posAbs) / max(abs(dir), vec3(1e-8));
+	return (vec3(1.0) + posAbs + min(t.x, min(t.y, t.z)) * dir) / 2;
 }
 
 void main() {
 
-	float step = 0.01; // precision of the ray marching
+	float step = stepSize;
 
-	vec3 end = texture( backRender,
+	vec3 end = singlePass != 0 ? boxExit() : texture( backRender,
 		vec2(
 			gl_FragCoord.x / width,
 			gl_FragCoord.y / height
@@ -41,14 +91,54 @@ void main() {
 	float distance = length(start - end);
 
 	float nbSteps = distance / step;
+	vec3 delta = (end - start) / nbSteps;
+	float brightness = usePreintegration != 0 ? 1.0 : exp(0.1*offset);
+	float saturation = 3.0 / brightness; // above it, all the channels are saturated
+
+	// the grid is sampled like the texture : pos.yzx
+	vec3 gridScale = vec3(textureSize(voxels, 0)) / cellSize;
+	vec3 gridDelta = delta.yzx * gridScale;
+	vec3 invGridDelta = 1.0 / max(abs(gridDelta), vec3(1e-8));
+	ivec3 gridMax = textureSize(occupancy, 0) - ivec3(1);
+
 	float sum = 0;
-	for(int i = 0; i < nbSteps; i++) { // offset by 0.5 ?
-		vec3 pos = ((nbSteps-i) * start + i * end ) / nbSteps;
-		sum += step * getDensity(pos);
+	float i = 0;
+	float nextCell = 0; // first sample out of the last non-empty cell looked up
+	float front = 0; // pre-integration : density at the start of the segment
+	bool frontValid = false;
+	for(int it = 0; it < maxSteps && i < nbSteps; it++) { // offset by 0.5 ?
+		vec3 pos = start + i * delta;
+		if(skipEmpty != 0 && i >= nextCell) {
+			vec3 gridPos = pos.yzx * gridScale;
+			vec3 cell = floor(gridPos);
+			vec3 bound = mix(gridPos - cell, cell + vec3(1.0) - gridPos, greaterThan(gridDelta, vec3(0.0)));
+			vec3 tExit = bound * invGridDelta;
+			float exit = floor(min(tExit.x, min(tExit.y, tExit.z))) + 1;
+			// with pre-integration, the last segment of the cell ends out of it
+			if(texelFetch(occupancy, clamp(ivec3(cell), ivec3(0), gridMax), 0).g <= 0
+				&& (usePreintegration == 0 || exit > 1)) {
+				i += usePreintegration == 0 ? exit : exit - 1;
+				frontValid = false;
+				continue;
+			}
+			nextCell = i + exit;
+		}
+		if(usePreintegration != 0) {
+			if(!frontValid) { front = getRawDensity(pos); }
+			float len = min(1.0, nbSteps - i);
+			float back = getRawDensity(start + (i + len) * delta);
+			sum += len * step * getPreintegrated(front, back) * getLight(pos);
+			front = back;
+			frontValid = true;
+		} else {
+			sum += step * getDensity(pos) * getLight(pos);
+		}
+		if(skipEmpty != 0 && sum >= saturation) { break; }
+		i++;
 	}
 
 	//color = vec4( vec3(sum)/2, 1.0);
-	sum *= exp(0.1*offset);
+	sum *= brightness;
 
 	color = vec4( // blue color ramp
 
@@ -0,0 +1,86 @@
+#version 130
+
+uniform float width;
+uniform float height;
+uniform int offset;
+
+uniform sampler2D backRender;
+uniform int singlePass; // when set, the exit point is computed instead of read from backRender
+
+// out-of-core volume (see BrickAtlas.h)
+uniform sampler3D atlas; // resident bricks, with a one texel apron
+uniform sampler3D indirection; // per brick of level 0 : slot and level of the finest resident brick
+uniform vec3 volumeSize; // of level 0, in texels
+uniform float brickSize; // without the apron
+
+uniform float gain = 5;
+uniform float stepSize = 0.01;
+
+in vec3 posAbs;
+in vec3 posRel;
+out vec4 color;
+
+float getRawDensity( vec3 pos ) {
+
+	vec3 p = clamp(pos.yzx, 0.0, 1.0);
+	ivec3 cell = min(ivec3(p * volumeSize / brickSize), textureSize(indirection, 0) - ivec3(1));
+	vec4 entry = texelFetch(indirection, cell, 0);
+	if(entry.w < 0) { return 0.0; }
+
+	// a texel of level L covers 2^L texels of level 0
+	float scale = exp2(entry.w);
+	vec3 brick = floor(vec3(cell) / scale);
+	vec3 local = clamp(p * volumeSize / scale - brick * brickSize, vec3(0.0), vec3(brickSize));
+	vec3 atlasPos = entry.xyz * (brickSize + 2) + 1 + local;
+	return texture(atlas, atlasPos / vec3(textureSize(atlas, 0))).r;
+}
+
+float getDensity( vec3 pos ) {
+
+	return max(0,exp(gain*getRawDensity(pos))-1);
+}
+
+// exit point of the ray from the eye through posAbs, out of the [-1;1]^3 box (in texture space)
+vec3 boxExit() {
+
+	vec3 eye = (gl_ModelViewMatrixInverse * vec4(0.0, 0.0, 0.0, 1.0)).xyz;
+	vec3 dir = posAbs - eye;
+	vec3 t = (vec3(1.0) - sign(dir) * posAbs) / max(abs(dir), vec3(1e-8));
+	return (vec3(1.0) + posAbs + min(t.x, min(t.y, t.z)) * dir) / 2;
+}
+
+void main() {
+
+	float step = stepSize;
+
+	vec3 end = singlePass != 0 ? boxExit() : texture( backRender,
+		vec2(
+			gl_FragCoord.x / width,
+			gl_FragCoord.y / height
+		)
+	).xyz;
+
+	vec3 start = (vec3(1.0)+posAbs)/2;
+	float distance = length(start - end);
+
+	float nbSteps = distance / step;
+	vec3 delta = (end - start) / nbSteps;
+	float brightness = exp(0.1*offset);
+	float saturation = 3.0 / brightness;
+
+	float sum = 0;
+	for(float i = 0; i < nbSteps; i++) {
+		sum += step * getDensity(start + i * delta);
+		if(sum >= saturation) { break; }
+	}
+
+	sum *= brightness;
+
+	color = vec4( // blue color ramp
+
+		sum/3,
+		sum/2,
+		sum,
+		1.0
+	);
+}